@@ -0,0 +1,321 @@
+// Asynchronous logger that keeps terminal and pipe writes off the event loop.
+//
+// A log call copies a small fixed-size binary record into a ring owned by
+// the calling thread and returns. A background flusher thread drains the
+// rings, formats the records and writes them out in batches, so a slow
+// terminal or pipe only delays the flusher. Once the rings are empty the
+// flusher sleeps on a futex until the next record arrives. If a ring is
+// full, or its thread is over its rate limit, the record is dropped and
+// counted rather than blocking the caller.
+
+#ifndef WEBSOCKET_SRC_ASYNC_LOGGER_H_
+#define WEBSOCKET_SRC_ASYNC_LOGGER_H_
+
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core.h"
+
+// --- Enum for log levels ---
+enum class LogLevel : uint8_t { DEBUG, INFO, WARN, ERROR, OFF };
+
+// --- One log record ---
+// Fixed size so a ring is a plain array. Only the free text is copied; the
+// event must be a string literal.
+struct LogRecord {
+  static const size_t kMaxText = 224;
+  static const int64_t kNoValue = INT64_MIN;
+
+  uint64_t timestamp_ns;  // CLOCK_REALTIME
+  const char* event;
+  int64_t value;  // e.g. a client socket, kNoValue if unused
+  LogLevel level;
+  uint16_t text_len;  // text is truncated to kMaxText bytes
+  char text[kMaxText];
+};
+
+// --- Single-producer/single-consumer ring of log records ---
+// The owning thread claims and publishes slots; the flusher peeks and pops
+// them. Head, tail and the records each start a cache line of their own, so
+// the two threads only share the lines they actually hand over.
+class LogRing {
+ public:
+  static const size_t kCapacity = 1024;  // must be a power of two
+
+  // Producer side. Returns the next free slot, or nullptr if the ring is full.
+  LogRecord* Claim() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == kCapacity)
+      return nullptr;
+    return &records_[head & (kCapacity - 1)];
+  }
+  void Publish() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Consumer side. Returns the oldest record, or nullptr if the ring is empty.
+  const LogRecord* Peek() const {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return nullptr;
+    return &records_[tail & (kCapacity - 1)];
+  }
+  void Pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Records the producer dropped since the flusher last looked.
+  std::atomic<uint64_t> dropped{0};
+
+  // Token bucket of the producer thread, touched only by that thread.
+  double tokens = 0;
+  uint64_t last_refill_ns = 0;
+
+ private:
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) LogRecord records_[kCapacity];
+};
+
+class AsyncLogger {
+ public:
+  // Formatted output is written out in batches of about this size.
+  static const size_t kBatchBytes = 64 * 1024;
+
+  static AsyncLogger& Instance() {
+    static AsyncLogger logger;
+    return logger;
+  }
+
+  ~AsyncLogger() { Stop(); }
+
+  // Starts the flusher thread writing to fd. Records below level are dropped
+  // at the call site. A nonzero rate_per_sec caps the records each thread may
+  // log per second, with bursts of up to one second's worth.
+  void Start(int fd, LogLevel level, uint32_t rate_per_sec) {
+    if (running_.load()) return;
+    fd_ = fd;
+    rate_per_sec_ = rate_per_sec;
+    running_.store(true);
+    flusher_ = std::thread(&AsyncLogger::FlushLoop, this);
+    min_level_.store(static_cast<uint8_t>(level), std::memory_order_relaxed);
+  }
+
+  // Stops accepting records, writes out everything still queued and joins
+  // the flusher thread.
+  void Stop() {
+    min_level_.store(static_cast<uint8_t>(LogLevel::OFF));
+    if (!running_.exchange(false)) return;
+    Wake();
+    flusher_.join();
+  }
+
+  // One relaxed load; this is all a filtered-out log call costs.
+  bool Enabled(LogLevel level) const {
+    return static_cast<uint8_t>(level) >=
+           min_level_.load(std::memory_order_relaxed);
+  }
+
+  // Copies the record into the calling thread's ring. Never blocks.
+  void Write(LogLevel level, const char* event, int64_t value,
+             const ByteView& text) {
+    static thread_local LogRing* ring = nullptr;
+    if (ring == nullptr) ring = RegisterRing();
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    if (rate_per_sec_ > 0 && !TakeToken(ring, now_ns)) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      NotifyFlusher();
+      return;
+    }
+    LogRecord* record = ring->Claim();
+    if (record == nullptr) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      NotifyFlusher();
+      return;
+    }
+    record->timestamp_ns = now_ns;
+    record->event = event;
+    record->value = value;
+    record->level = level;
+    size_t len = text.size;
+    if (len > LogRecord::kMaxText) len = LogRecord::kMaxText;
+    if (len > 0) memcpy(record->text, text.data, len);
+    record->text_len = static_cast<uint16_t>(len);
+    ring->Publish();
+    NotifyFlusher();
+  }
+
+ private:
+  AsyncLogger() = default;
+
+  // Rings are allocated once per thread and kept for the life of the
+  // process, so the flusher never races a thread that exits.
+  LogRing* RegisterRing() {
+    LogRing* ring = new LogRing();
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings_.push_back(ring);
+    return ring;
+  }
+
+  bool TakeToken(LogRing* ring, uint64_t now_ns) {
+    if (now_ns > ring->last_refill_ns) {
+      ring->tokens += (now_ns - ring->last_refill_ns) * 1e-9 * rate_per_sec_;
+      if (ring->tokens > rate_per_sec_) ring->tokens = rate_per_sec_;
+      ring->last_refill_ns = now_ns;
+    }
+    if (ring->tokens < 1) return false;
+    ring->tokens -= 1;
+    return true;
+  }
+
+  // Wakes the flusher if it is asleep. The fence pairs with the one in
+  // FlushLoop: either the flusher finds what was just queued before it
+  // sleeps, or this finds it asleep.
+  void NotifyFlusher() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed) != 0) Wake();
+  }
+
+  void Wake() {
+    sleeping_.store(0);
+    sleeping_.notify_one();
+  }
+
+  void FlushLoop() {
+    // Room for a full batch and the record that overflows it, so formatting
+    // never reallocates.
+    std::string out;
+    out.reserve(2 * kBatchBytes);
+    while (running_.load()) {
+      if (Drain(&out) > 0) continue;
+      // Announce the sleep, then look once more, so a record queued in
+      // between is either drained here or wakes the flusher.
+      sleeping_.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (Drain(&out) == 0 && running_.load()) sleeping_.wait(1);
+      sleeping_.store(0, std::memory_order_relaxed);
+    }
+    Drain(&out);
+  }
+
+  // Formats every queued record into out and writes it. Returns the number
+  // of records written.
+  size_t Drain(std::string* out) {
+    {
+      // Copied into storage that is reused, so draining does not allocate
+      // once every thread has registered.
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      draining_ = rings_;
+    }
+    size_t count = 0;
+    for (LogRing* ring : draining_) {
+      const LogRecord* record;
+      while ((record = ring->Peek()) != nullptr) {
+        Format(*record, out);
+        ring->Pop();
+        count++;
+        if (out->size() >= kBatchBytes) WriteOut(out);
+      }
+      if (ring->dropped.load(std::memory_order_relaxed) == 0) continue;
+      uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+      if (dropped > 0) {
+        out->append("(" + std::to_string(dropped) + " log records dropped)\n");
+      }
+    }
+    WriteOut(out);
+    return count;
+  }
+
+  // "HH:MM:SS.mmm LEVEL event [value]: text"
+  static void Format(const LogRecord& record, std::string* out) {
+    static const char* const kLevelNames[] = {"DEBUG", "INFO", "WARN",
+                                              "ERROR"};
+    time_t seconds = record.timestamp_ns / 1000000000ULL;
+    unsigned millis = (record.timestamp_ns / 1000000ULL) % 1000;
+    tm local;
+    localtime_r(&seconds, &local);
+    char prefix[64];
+    int n = snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03u %s ",
+                     local.tm_hour, local.tm_min, local.tm_sec, millis,
+                     kLevelNames[static_cast<int>(record.level)]);
+    out->append(prefix, n);
+    out->append(record.event);
+    if (record.value != LogRecord::kNoValue) {
+      n = snprintf(prefix, sizeof(prefix), " [%lld]",
+                   static_cast<long long>(record.value));
+      out->append(prefix, n);
+    }
+    if (record.text_len > 0) {
+      out->append(": ");
+      out->append(record.text, record.text_len);
+    }
+    out->push_back('\n');
+  }
+
+  void WriteOut(std::string* out) {
+    size_t written = 0;
+    while (written < out->size()) {
+      ssize_t n = write(fd_, out->data() + written, out->size() - written);
+      if (n <= 0) break;
+      written += n;
+    }
+    out->clear();
+  }
+
+  std::atomic<uint8_t> min_level_{static_cast<uint8_t>(LogLevel::OFF)};
+  std::atomic<bool> running_{false};
+  int fd_ = STDOUT_FILENO;
+  uint32_t rate_per_sec_ = 0;
+  std::thread flusher_;
+  std::mutex rings_mutex_;
+  std::vector<LogRing*> rings_;
+  // The flusher's copy of rings_.
+  std::vector<LogRing*> draining_;
+  // 1 while the flusher sleeps, or is about to.
+  std::atomic<uint32_t> sleeping_{0};
+};
+
+// --- Log an event ---
+// value is an optional integer field (e.g. a socket) and text optional free
+// text. Nothing is logged until AsyncLogger::Instance().Start() is called.
+inline void Log(LogLevel level, const char* event,
+                int64_t value = LogRecord::kNoValue,
+                const ByteView& text = {nullptr, 0}) {
+  AsyncLogger& logger = AsyncLogger::Instance();
+  if (!logger.Enabled(level)) return;
+  logger.Write(level, event, value, text);
+}
+
+inline void Log(LogLevel level, const char* event, int64_t value,
+                const std::string& text) {
+  Log(level, event, value, ByteView{text.data(), text.size()});
+}
+
+// Parses "debug", "info", "warn", "error" or "off". Returns false otherwise.
+inline bool ParseLogLevel(const std::string& name, LogLevel* level) {
+  static const char* const kNames[] = {"debug", "info", "warn", "error",
+                                       "off"};
+  for (int i = 0; i < 5; i++) {
+    if (name == kNames[i]) {
+      *level = static_cast<LogLevel>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif  // WEBSOCKET_SRC_ASYNC_LOGGER_H_
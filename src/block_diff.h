@@ -0,0 +1,251 @@
+// Block-based binary diff between two versions of a monitored file.
+//
+// Line diffs are meaningless for images, databases and other binary files,
+// so these are compared the way rsync does it. The previous version is kept
+// only as a table of checksums of its fixed-size blocks: a weak checksum
+// that can be rolled along the new version one byte at a time, and a strong
+// 64-bit hash that confirms a weak match. Every block of the new version
+// found in the table is sent as a reference to the old block; everything in
+// between is sent as literal bytes.
+//
+// The weak checksum is the rsync one: with x the bytes of a block of length
+// n, a = sum(x[i]) and b = sum((n - i) * x[i]), both mod 2^16. Over a whole
+// block both sums are plain reductions the compiler can vectorize; moving
+// the window by one byte updates them in O(1).
+
+#ifndef WEBSOCKET_SRC_BLOCK_DIFF_H_
+#define WEBSOCKET_SRC_BLOCK_DIFF_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "line_diff.h"
+
+// --- Block checksums of one file version ---
+// The last block may be shorter than block_size; it is only ever matched as
+// a whole when comparing tables, never by the rolling search.
+struct BlockTable {
+  size_t block_size = 0;
+  size_t size = 0;  // of the content
+  std::vector<uint32_t> weak;
+  std::vector<uint64_t> strong;
+};
+
+// Heuristic of git and diff(1): a NUL byte near the start means binary.
+inline bool LooksBinary(const char* data, size_t len) {
+  return memchr(data, '\0', len < 8000 ? len : 8000) != nullptr;
+}
+
+// About the square root of the file size, like rsync, so the table and the
+// number of references both stay near sqrt(len). A multiple of 64 between
+// 512 bytes and 64 KiB.
+inline size_t ChooseBlockSize(size_t len) {
+  size_t size = static_cast<size_t>(std::sqrt(static_cast<double>(len)));
+  size = (size + 63) & ~static_cast<size_t>(63);
+  if (size < 512) return 512;
+  if (size > 65536) return 65536;
+  return size;
+}
+
+// Packs the two sums of a block into its weak checksum.
+inline uint32_t WeakChecksum(uint32_t a, uint32_t b) {
+  return (a & 0xffff) | (b << 16);
+}
+
+// The sums of one whole block. Kept as two independent reductions over the
+// bytes so they vectorize.
+inline void BlockSums(const uint8_t* data, size_t len, uint32_t* a,
+                      uint32_t* b) {
+  uint32_t sum = 0, weighted = 0;
+  for (size_t i = 0; i < len; i++) {
+    sum += data[i];
+    weighted += static_cast<uint32_t>(len - i) * data[i];
+  }
+  *a = sum;
+  *b = weighted;
+}
+
+// --- Build the block table of a file version ---
+inline void BuildBlockTable(const char* data, size_t len, BlockTable* table) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  table->block_size = ChooseBlockSize(len);
+  table->size = len;
+  table->weak.clear();
+  table->strong.clear();
+  size_t count = (len + table->block_size - 1) / table->block_size;
+  table->weak.reserve(count);
+  table->strong.reserve(count);
+  for (size_t start = 0; start < len; start += table->block_size) {
+    size_t n = std::min(table->block_size, len - start);
+    uint32_t a, b;
+    BlockSums(bytes + start, n, &a, &b);
+    table->weak.push_back(WeakChecksum(a, b));
+    table->strong.push_back(HashLine(data + start, n));
+  }
+}
+
+// True if both tables describe the same content, as far as the hashes can
+// tell.
+inline bool SameBlocks(const BlockTable& x, const BlockTable& y) {
+  return x.size == y.size && x.block_size == y.block_size &&
+         x.strong == y.strong;
+}
+
+// Appends the low bytes of value to out, least significant first.
+inline void AppendLittleEndian(std::string* out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    out->push_back(static_cast<char>(value >> (8 * i)));
+}
+
+// --- Encode a binary delta message ---
+// All integers are little-endian:
+//   'D' u64 base, u64 version, u64 new size, u32 block size of base
+// followed by operations that build the new content front to back:
+//   1 u32 first block, u32 block count   copy blocks of the base version
+//   2 u32 length, bytes                  literal bytes
+// old is the table of the base version; data is the new content.
+inline std::string EncodeBlockDelta(uint64_t base, uint64_t version,
+                                    const BlockTable& old, const char* data,
+                                    size_t len) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  std::string delta = "D";
+  AppendLittleEndian(&delta, base, 8);
+  AppendLittleEndian(&delta, version, 8);
+  AppendLittleEndian(&delta, len, 8);
+  AppendLittleEndian(&delta, old.block_size, 4);
+
+  // Chained hash index of the old full blocks by weak checksum.
+  const size_t block = old.block_size;
+  size_t full_blocks = block > 0 ? old.size / block : 0;
+  size_t buckets = 16;
+  while (buckets < 2 * full_blocks) buckets *= 2;
+  std::vector<int32_t> heads(buckets, -1), next(full_blocks, -1);
+  for (size_t i = full_blocks; i-- > 0;) {
+    size_t bucket = old.weak[i] & (buckets - 1);
+    next[i] = heads[bucket];
+    heads[bucket] = static_cast<int32_t>(i);
+  }
+
+  size_t copy_first = 0, copy_count = 0;
+  auto flush_copy = [&]() {
+    if (copy_count == 0) return;
+    delta.push_back(1);
+    AppendLittleEndian(&delta, copy_first, 4);
+    AppendLittleEndian(&delta, copy_count, 4);
+    copy_count = 0;
+  };
+  auto emit_literal = [&](size_t begin, size_t end) {
+    if (end == begin) return;
+    flush_copy();
+    delta.push_back(2);
+    AppendLittleEndian(&delta, end - begin, 4);
+    delta.append(data + begin, end - begin);
+  };
+
+  size_t literal_start = 0;
+  size_t pos = 0;
+  uint32_t a = 0, b = 0;
+  bool have_sums = false;
+  while (full_blocks > 0 && pos + block <= len) {
+    if (!have_sums) {
+      BlockSums(bytes + pos, block, &a, &b);
+      have_sums = true;
+    }
+    uint32_t weak = WeakChecksum(a, b);
+    int32_t match = -1;
+    bool hashed = false;
+    uint64_t strong = 0;
+    // The block after the last one copied is the likeliest match.
+    size_t expected = copy_first + copy_count;
+    if (copy_count > 0 && expected < full_blocks &&
+        old.weak[expected] == weak) {
+      strong = HashLine(data + pos, block);
+      hashed = true;
+      if (old.strong[expected] == strong) match = expected;
+    }
+    for (int32_t i = heads[weak & (buckets - 1)]; match < 0 && i >= 0;
+         i = next[i]) {
+      if (old.weak[i] != weak) continue;
+      if (!hashed) {
+        strong = HashLine(data + pos, block);
+        hashed = true;
+      }
+      if (old.strong[i] == strong) match = i;
+    }
+    if (match >= 0) {
+      emit_literal(literal_start, pos);
+      if (copy_count > 0 &&
+          copy_first + copy_count == static_cast<size_t>(match)) {
+        copy_count++;
+      } else {
+        flush_copy();
+        copy_first = match;
+        copy_count = 1;
+      }
+      pos += block;
+      literal_start = pos;
+      have_sums = false;
+      continue;
+    }
+    // Roll the window one byte forward.
+    if (pos + block < len) {
+      uint32_t out = bytes[pos], in = bytes[pos + block];
+      a += in - out;
+      b += a - static_cast<uint32_t>(block) * out;
+    }
+    pos++;
+  }
+  emit_literal(literal_start, len);
+  flush_copy();
+  return delta;
+}
+
+// Reads a little-endian integer of the given size at pos, advancing pos.
+inline uint64_t ReadLittleEndian(const std::string& in, size_t* pos,
+                                 int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++)
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(in[*pos + i]))
+             << (8 * i);
+  *pos += bytes;
+  return value;
+}
+
+// --- Apply a binary delta message ---
+// What the page script does, for rebuilding past versions: writes the
+// version delta makes from old to out. Returns false if the delta is
+// malformed or does not fit old.
+inline bool ApplyBlockDelta(const std::string& delta, const std::string& old,
+                            std::string* out) {
+  const size_t kHeader = 29;
+  if (delta.size() < kHeader || delta[0] != 'D') return false;
+  size_t pos = 17;
+  size_t size = ReadLittleEndian(delta, &pos, 8);
+  size_t block = ReadLittleEndian(delta, &pos, 4);
+  out->clear();
+  out->reserve(size);
+  while (pos < delta.size()) {
+    char op = delta[pos++];
+    if (op == 1 && pos + 8 <= delta.size()) {
+      size_t first = ReadLittleEndian(delta, &pos, 4);
+      size_t count = ReadLittleEndian(delta, &pos, 4);
+      size_t begin = first * block;
+      if (begin > old.size()) return false;
+      out->append(old, begin, std::min(count * block, old.size() - begin));
+    } else if (op == 2 && pos + 4 <= delta.size()) {
+      size_t len = ReadLittleEndian(delta, &pos, 4);
+      if (pos + len > delta.size()) return false;
+      out->append(delta, pos, len);
+      pos += len;
+    } else {
+      return false;
+    }
+  }
+  return out->size() == size;
+}
+
+#endif  // WEBSOCKET_SRC_BLOCK_DIFF_H_
@@ -0,0 +1,129 @@
+// Chat payload encoding shared by the chat client and server.
+//
+// Every chat frame payload starts with a one byte kind followed by kind
+// specific fields. Strings are prefixed with a 4 byte length in network order.
+//
+//   MESSAGE: kind | u32 name_len | name | u32 topic_len | topic | body
+//   JOIN:    kind | u32 name_len | name | u32 topic_len | topic
+//   LEAVE:   kind | u32 name_len | name | u32 topic_len | topic
+//   LOGIN:   kind | u32 name_len | name | u32 0
+//   DIRECT:  kind | u32 name_len | name | u32 target_len | target | body
+//
+// An empty topic addresses the lobby, i.e. every connected client. DIRECT
+// reuses the topic field for the recipient's username.
+//
+// Once a connection has sent LOGIN, the session kinds below omit the
+// username; the server uses the name registered for the connection.
+//
+//   SESSION_MESSAGE: kind | u32 topic_len | topic | body
+//   SESSION_DIRECT:  kind | u32 target_len | target | body
+
+#ifndef WEBSOCKET_SRC_CHAT_PROTOCOL_H_
+#define WEBSOCKET_SRC_CHAT_PROTOCOL_H_
+
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "core.h"
+
+// --- Enum for chat payload kinds ---
+enum class ChatKind : uint8_t {
+  MESSAGE = 0x01,
+  JOIN = 0x02,
+  LEAVE = 0x03,
+  LOGIN = 0x04,
+  DIRECT = 0x05,
+  SESSION_MESSAGE = 0x06,
+  SESSION_DIRECT = 0x07
+};
+
+// Returns true for the kinds that rely on the name registered by LOGIN.
+inline bool IsSessionKind(ChatKind kind) {
+  return kind == ChatKind::SESSION_MESSAGE || kind == ChatKind::SESSION_DIRECT;
+}
+
+// --- Decoded chat payload ---
+// The fields point into the payload that was decoded, so decoding copies
+// nothing. username is empty for session kinds.
+struct ChatView {
+  ChatKind kind;
+  ByteView username;
+  ByteView topic;
+  ByteView body;
+};
+
+// Appends a 4 byte network order length followed by the string bytes.
+inline void AppendLengthPrefixed(std::string* out, const std::string& value) {
+  uint32_t len_network = htonl(static_cast<uint32_t>(value.size()));
+  out->append(reinterpret_cast<const char*>(&len_network),
+              sizeof(len_network));
+  out->append(value);
+}
+
+// Reads a length-prefixed string starting at *pos and advances *pos past it.
+// Returns false if the payload is too short.
+inline bool ReadLengthPrefixed(const ByteView& payload, size_t* pos,
+                               ByteView* value) {
+  if (payload.size < *pos + 4) return false;
+  uint32_t len;
+  memcpy(&len, payload.data + *pos, 4);
+  len = ntohl(len);
+  *pos += 4;
+  if (payload.size - *pos < len) return false;
+  value->data = payload.data + *pos;
+  value->size = len;
+  *pos += len;
+  return true;
+}
+
+// --- Build a chat payload ---
+// body is only sent for MESSAGE and DIRECT.
+inline std::string EncodeChatPayload(ChatKind kind, const std::string& username,
+                                     const std::string& topic,
+                                     const std::string& body = "") {
+  std::string payload;
+  payload.reserve(1 + 4 + username.size() + 4 + topic.size() + body.size());
+  payload.push_back(static_cast<char>(kind));
+  AppendLengthPrefixed(&payload, username);
+  AppendLengthPrefixed(&payload, topic);
+  if (kind == ChatKind::MESSAGE || kind == ChatKind::DIRECT)
+    payload.append(body);
+  return payload;
+}
+
+// --- Build a session chat payload ---
+// kind must be SESSION_MESSAGE or SESSION_DIRECT.
+inline std::string EncodeSessionPayload(ChatKind kind, const std::string& topic,
+                                        const std::string& body) {
+  std::string payload;
+  payload.reserve(1 + 4 + topic.size() + body.size());
+  payload.push_back(static_cast<char>(kind));
+  AppendLengthPrefixed(&payload, topic);
+  payload.append(body);
+  return payload;
+}
+
+// --- Parse a chat payload ---
+// Returns false if the kind is unknown or a length prefix is inconsistent.
+inline bool DecodeChatPayload(const ByteView& payload, ChatView* out) {
+  if (payload.size == 0) return false;
+  uint8_t kind = static_cast<uint8_t>(payload.data[0]);
+  if (kind < static_cast<uint8_t>(ChatKind::MESSAGE) ||
+      kind > static_cast<uint8_t>(ChatKind::SESSION_DIRECT))
+    return false;
+  out->kind = static_cast<ChatKind>(kind);
+  size_t pos = 1;
+  if (IsSessionKind(out->kind)) {
+    out->username = {payload.data, 0};
+  } else if (!ReadLengthPrefixed(payload, &pos, &out->username)) {
+    return false;
+  }
+  if (!ReadLengthPrefixed(payload, &pos, &out->topic)) return false;
+  out->body = {payload.data + pos, payload.size - pos};
+  return true;
+}
+
+#endif  // WEBSOCKET_SRC_CHAT_PROTOCOL_H_
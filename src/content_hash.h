@@ -0,0 +1,139 @@
+// Whole-content hash of a monitored file version.
+//
+// Change events often fire without the content changing: touch(1), an editor
+// saving the same bytes, a metadata flush. Comparing one 64-bit hash of the
+// content with that of the previous version lets the monitor drop those
+// events before building any line or block table.
+//
+// The hash is XXH64. It consumes the input in 32-byte stripes split over four
+// independent 64-bit lanes, so it runs at memory speed rather than at the
+// latency of one multiply per byte like the FNV-1a of the line hashes. It is
+// also streaming: the state after the content can be extended by appended
+// bytes without reading the content again, which is what tail mode does.
+
+#ifndef WEBSOCKET_SRC_CONTENT_HASH_H_
+#define WEBSOCKET_SRC_CONTENT_HASH_H_
+
+#include <cstdint>
+#include <cstring>
+
+class ContentHash {
+ public:
+  ContentHash() { Reset(); }
+
+  // Starts over with no bytes hashed.
+  void Reset() {
+    lanes_[0] = kPrime1 + kPrime2;
+    lanes_[1] = kPrime2;
+    lanes_[2] = 0;
+    lanes_[3] = -kPrime1;
+    total_ = 0;
+    buffered_ = 0;
+  }
+
+  // Hashes len more bytes of data.
+  void Update(const char* data, size_t len) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    total_ += len;
+    if (buffered_ > 0) {
+      size_t n = len < 32 - buffered_ ? len : 32 - buffered_;
+      std::memcpy(buffer_ + buffered_, p, n);
+      buffered_ += n;
+      p += n;
+      len -= n;
+      if (buffered_ < 32) return;
+      Stripe(buffer_);
+      buffered_ = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32) Stripe(p);
+    std::memcpy(buffer_, p, len);
+    buffered_ = len;
+  }
+
+  // The hash of all bytes so far. Hashing can continue afterwards.
+  uint64_t Digest() const {
+    uint64_t hash;
+    if (total_ >= 32) {
+      hash = Rotate(lanes_[0], 1) + Rotate(lanes_[1], 7) +
+             Rotate(lanes_[2], 12) + Rotate(lanes_[3], 18);
+      for (int i = 0; i < 4; i++) {
+        hash ^= Round(0, lanes_[i]);
+        hash = hash * kPrime1 + kPrime4;
+      }
+    } else {
+      hash = kPrime5;
+    }
+    hash += total_;
+    const uint8_t* p = buffer_;
+    size_t len = buffered_;
+    for (; len >= 8; p += 8, len -= 8) {
+      hash ^= Round(0, Read64(p));
+      hash = Rotate(hash, 27) * kPrime1 + kPrime4;
+    }
+    if (len >= 4) {
+      hash ^= Read32(p) * kPrime1;
+      hash = Rotate(hash, 23) * kPrime2 + kPrime3;
+      p += 4;
+      len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+      hash ^= *p * kPrime5;
+      hash = Rotate(hash, 11) * kPrime1;
+    }
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+  uint64_t size() const { return total_; }
+
+ private:
+  static const uint64_t kPrime1 = 11400714785074694791ULL;
+  static const uint64_t kPrime2 = 14029467366897019727ULL;
+  static const uint64_t kPrime3 = 1609587929392839161ULL;
+  static const uint64_t kPrime4 = 9650029242287828579ULL;
+  static const uint64_t kPrime5 = 2870177450012600261ULL;
+
+  static uint64_t Rotate(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+  }
+  static uint64_t Read64(const uint8_t* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));  // little-endian hosts only
+    return value;
+  }
+  static uint64_t Read32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+  static uint64_t Round(uint64_t lane, uint64_t input) {
+    lane += input * kPrime2;
+    return Rotate(lane, 31) * kPrime1;
+  }
+
+  // The four lanes do not depend on each other, so their multiplies overlap.
+  void Stripe(const uint8_t* p) {
+    lanes_[0] = Round(lanes_[0], Read64(p));
+    lanes_[1] = Round(lanes_[1], Read64(p + 8));
+    lanes_[2] = Round(lanes_[2], Read64(p + 16));
+    lanes_[3] = Round(lanes_[3], Read64(p + 24));
+  }
+
+  uint64_t lanes_[4];
+  uint64_t total_;
+  uint8_t buffer_[32];
+  size_t buffered_;
+};
+
+// The hash of len bytes of data.
+inline uint64_t HashContent(const char* data, size_t len) {
+  ContentHash hash;
+  hash.Update(data, len);
+  return hash.Digest();
+}
+
+#endif  // WEBSOCKET_SRC_CONTENT_HASH_H_
@@ -0,0 +1,147 @@
+// WebSocket frame handling: see core.h.
+
+#include "core.h"
+
+std::string ToString(const ByteView& view) {
+  return std::string(view.data, view.size);
+}
+
+size_t WSFrameHeaderSize(size_t len) {
+  if (len < 126) return 2;
+  if (len <= 0xFFFF) return 4;
+  return 10;
+}
+
+void AppendWSFrameHeader(std::vector<uint8_t>* frame, size_t len,
+                         WSOpcode opcode) {
+  frame->push_back(0x80 |
+                   static_cast<uint8_t>(opcode));  // FIN flag set plus opcode
+  if (len < 126) {
+    frame->push_back(static_cast<uint8_t>(len));
+  } else if (len <= 0xFFFF) {
+    frame->push_back(126);
+    frame->push_back((len >> 8) & 0xFF);
+    frame->push_back(len & 0xFF);
+  } else {
+    frame->push_back(127);
+    for (int i = 7; i >= 0; i--) frame->push_back((len >> (i * 8)) & 0xFF);
+  }
+}
+
+std::vector<uint8_t> BuildWSFrame(const std::string& message,
+                                  WSOpcode opcode) {
+  std::vector<uint8_t> frame;
+  frame.reserve(WSFrameHeaderSize(message.size()) + message.size());
+  AppendWSFrameHeader(&frame, message.size(), opcode);
+  frame.insert(frame.end(), message.begin(), message.end());
+  return frame;
+}
+
+std::string ParseWSFrame(const std::vector<uint8_t>& buffer) {
+  if (buffer.size() < 2) return "";
+  // We don't need the first byte here (it contains FIN and opcode)
+  uint8_t byte2 = buffer[1];
+  bool mask = byte2 & 0x80;
+  uint64_t payload_len = byte2 & 0x7F;
+  size_t pos = 2;
+  if (payload_len == 126) {
+    if (buffer.size() < 4) return "";
+    payload_len = (buffer[2] << 8) | buffer[3];
+    pos += 2;
+  } else if (payload_len == 127) {
+    // Not implemented for simplicity.
+    return "";
+  }
+  std::string message;
+  if (mask) {
+    if (buffer.size() < pos + 4 + payload_len) return "";
+    uint8_t mask_key[4];
+    for (int i = 0; i < 4; i++) mask_key[i] = buffer[pos + i];
+    pos += 4;
+    for (uint64_t i = 0; i < payload_len; i++) {
+      message.push_back(buffer[pos + i] ^ mask_key[i % 4]);
+    }
+  } else {
+    if (buffer.size() < pos + payload_len) return "";
+    for (uint64_t i = 0; i < payload_len; i++)
+      message.push_back(buffer[pos + i]);
+  }
+  return message;
+}
+
+std::vector<uint8_t> BuildMaskedWSFrame(const ByteView& payload,
+                                        WSOpcode opcode, uint32_t mask_key) {
+  std::vector<uint8_t> frame;
+  frame.reserve(WSFrameHeaderSize(payload.size) + 4 + payload.size);
+  AppendWSFrameHeader(&frame, payload.size, opcode);
+  frame[1] |= 0x80;  // MASK flag
+  uint8_t key[4];
+  memcpy(key, &mask_key, sizeof(key));
+  frame.insert(frame.end(), key, key + 4);
+  for (size_t i = 0; i < payload.size; i++)
+    frame.push_back(static_cast<uint8_t>(payload.data[i]) ^ key[i & 3]);
+  return frame;
+}
+
+ByteView WSFrameBuffer::Finish(WSOpcode opcode) {
+  size_t len = buffer_.size() - kMaxHeaderSize;
+  uint8_t header[kMaxHeaderSize];
+  size_t header_len = WSFrameHeaderSize(len);
+  header[0] = 0x80 | static_cast<uint8_t>(opcode);
+  if (len < 126) {
+    header[1] = static_cast<uint8_t>(len);
+  } else if (len <= 0xFFFF) {
+    header[1] = 126;
+    header[2] = (len >> 8) & 0xFF;
+    header[3] = len & 0xFF;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) header[2 + i] = (len >> ((7 - i) * 8)) & 0xFF;
+  }
+  size_t start = kMaxHeaderSize - header_len;
+  memcpy(buffer_.data() + start, header, header_len);
+  return {reinterpret_cast<const char*>(buffer_.data()) + start,
+          header_len + len};
+}
+
+size_t ParseWSFrameInPlace(uint8_t* buffer, size_t len, WSOpcode* opcode,
+                           ByteView* payload) {
+  if (len < 2) return 0;
+  *opcode = static_cast<WSOpcode>(buffer[0] & 0x0F);
+  bool mask = buffer[1] & 0x80;
+  uint64_t payload_len = buffer[1] & 0x7F;
+  size_t pos = 2;
+  if (payload_len == 126) {
+    if (len < 4) return 0;
+    payload_len = (buffer[2] << 8) | buffer[3];
+    pos = 4;
+  } else if (payload_len == 127) {
+    if (len < 10) return 0;
+    payload_len = 0;
+    for (int i = 0; i < 8; i++)
+      payload_len = (payload_len << 8) | buffer[2 + i];
+    pos = 10;
+  }
+  const uint8_t* mask_key = buffer + pos;
+  if (mask) pos += 4;
+  if (len < pos || len - pos < payload_len) return 0;
+  if (mask) {
+    // XOR eight bytes at a time with the key repeated twice, then the tail.
+    uint8_t* data = buffer + pos;
+    uint8_t key8[8];
+    for (int i = 0; i < 8; i++) key8[i] = mask_key[i & 3];
+    uint64_t key64;
+    memcpy(&key64, key8, sizeof(key64));
+    uint64_t i = 0;
+    for (; i + 8 <= payload_len; i += 8) {
+      uint64_t word;
+      memcpy(&word, data + i, sizeof(word));
+      word ^= key64;
+      memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < payload_len; i++) data[i] ^= mask_key[i & 3];
+  }
+  payload->data = reinterpret_cast<const char*>(buffer + pos);
+  payload->size = payload_len;
+  return pos + payload_len;
+}
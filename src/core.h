@@ -1,11 +1,14 @@
 // WebSocket frame handling functions: constructing frames and parsing frames.
 // not handle all edge cases, but working with smaller messages. will be updated
 // soon.
+//
+// The definitions are in core.cc, part of libws.
 
 #ifndef WEBSOCKET_SRC_CORE_H_
 #define WEBSOCKET_SRC_CORE_H_
 
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -19,59 +22,77 @@ enum class WSOpcode : uint8_t {
   PONG = 0xA
 };
 
+// --- Non-owning view of bytes, e.g. a payload inside a receive buffer ---
+struct ByteView {
+  const char* data;
+  size_t size;
+};
+
+std::string ToString(const ByteView& view);
+
+// --- WebSocket frame header (server to client) ---
+// Returns the size of an unmasked frame header for a payload of len bytes.
+size_t WSFrameHeaderSize(size_t len);
+
+// Appends an unmasked frame header for a payload of len bytes. Callers that
+// know the payload size up front reserve WSFrameHeaderSize(len) + len and
+// append the payload pieces right after, so the frame is built in one buffer
+// without intermediate strings.
+void AppendWSFrameHeader(std::vector<uint8_t>* frame, size_t len,
+                         WSOpcode opcode = WSOpcode::TEXT);
+
 // --- Build a WebSocket frame (server to client) ---
 // For server frames, masking is not applied.
-// assuming message sizes don’t exceed 0xFFFF
 std::vector<uint8_t> BuildWSFrame(const std::string& message,
-                                  WSOpcode opcode = WSOpcode::TEXT) {
-  std::vector<uint8_t> frame;
-  frame.push_back(0x80 |
-                  static_cast<uint8_t>(opcode));  // FIN flag set plus opcode
-  size_t len = message.size();
-  if (len < 126) {
-    frame.push_back(static_cast<uint8_t>(len));
-  } else if (len <= 0xFFFF) {
-    frame.push_back(126);
-    frame.push_back((len >> 8) & 0xFF);
-    frame.push_back(len & 0xFF);
-  }
-  frame.insert(frame.end(), message.begin(), message.end());
-  return frame;
-}
+                                  WSOpcode opcode = WSOpcode::TEXT);
 
 // --- Parse a WebSocket frame received from the client ---
 // Client-to-server frames must be masked.
 // assuming message sizes don’t exceed 0xFFFF
-std::string ParseWSFrame(const std::vector<uint8_t>& buffer) {
-  if (buffer.size() < 2) return "";
-  // We don't need the first byte here (it contains FIN and opcode)
-  uint8_t byte2 = buffer[1];
-  bool mask = byte2 & 0x80;
-  uint64_t payload_len = byte2 & 0x7F;
-  size_t pos = 2;
-  if (payload_len == 126) {
-    if (buffer.size() < 4) return "";
-    payload_len = (buffer[2] << 8) | buffer[3];
-    pos += 2;
-  } else if (payload_len == 127) {
-    // Not implemented for simplicity.
-    return "";
+std::string ParseWSFrame(const std::vector<uint8_t>& buffer);
+
+// --- Build a masked WebSocket frame (client to server) ---
+// Clients mask every frame with a fresh, unpredictable key.
+std::vector<uint8_t> BuildMaskedWSFrame(const ByteView& payload,
+                                        WSOpcode opcode, uint32_t mask_key);
+
+// --- Reusable outbound frame buffer ---
+// The payload is appended after room reserved for the largest frame header;
+// Finish() then writes the real header right in front of the payload. One
+// buffer reused for every send keeps the steady-state send path free of heap
+// allocations once it has grown to the largest message.
+class WSFrameBuffer {
+ public:
+  static const size_t kMaxHeaderSize = 10;
+
+  // Starts a new frame, keeping the capacity of the previous one.
+  void Reset() { buffer_.resize(kMaxHeaderSize); }
+
+  void Append(const char* data, size_t len) {
+    buffer_.insert(buffer_.end(), data, data + len);
   }
-  std::string message;
-  if (mask) {
-    if (buffer.size() < pos + 4 + payload_len) return "";
-    uint8_t mask_key[4];
-    for (int i = 0; i < 4; i++) mask_key[i] = buffer[pos + i];
-    pos += 4;
-    for (uint64_t i = 0; i < payload_len; i++) {
-      message.push_back(buffer[pos + i] ^ mask_key[i % 4]);
-    }
-  } else {
-    if (buffer.size() < pos + payload_len) return "";
-    for (uint64_t i = 0; i < payload_len; i++)
-      message.push_back(buffer[pos + i]);
+  void Append(const ByteView& view) { Append(view.data, view.size); }
+  void Append(const std::string& str) { Append(str.data(), str.size()); }
+
+  // Payload bytes appended since Reset().
+  ByteView Payload() const {
+    return {reinterpret_cast<const char*>(buffer_.data()) + kMaxHeaderSize,
+            buffer_.size() - kMaxHeaderSize};
   }
-  return message;
-}
+
+  // Writes the header and returns the complete frame.
+  ByteView Finish(WSOpcode opcode = WSOpcode::TEXT);
+
+ private:
+  std::vector<uint8_t> buffer_ = std::vector<uint8_t>(kMaxHeaderSize);
+};
+
+// --- Parse a WebSocket frame in place ---
+// Parses the frame at the start of buffer and unmasks its payload in place,
+// so no copy is made. On success sets opcode and payload (pointing into
+// buffer) and returns the number of bytes the frame occupies. Returns 0 if
+// buffer does not hold a complete frame.
+size_t ParseWSFrameInPlace(uint8_t* buffer, size_t len, WSOpcode* opcode,
+                           ByteView* payload);
 
 #endif  // WEBSOCKET_SRC_CORE_H_
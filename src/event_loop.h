@@ -0,0 +1,349 @@
+// Event loop shared by the chat server, the chat client and the file monitor.
+//
+// Descriptors are registered once with the events they wait for and a
+// handler, instead of every loop iteration rebuilding its fd_sets. What the
+// kernel is asked is up to a backend: epoll, which costs nothing per idle
+// descriptor, or select, which works everywhere but is limited to
+// FD_SETSIZE descriptors. EVENT_LOOP_BACKEND=select in the environment picks
+// select; otherwise epoll is used where the kernel has it.
+//
+// Readiness is level-triggered, as with select: a handler that leaves data
+// unread is called again on the next iteration. Handlers may watch and
+// unwatch descriptors, including their own, from inside a callback; events
+// that were reported for a descriptor unwatched meanwhile are dropped, even
+// if its number has been reused.
+//
+// Besides descriptors the loop runs timers and deferred tasks. Deferred
+// tasks run after the current batch of handlers, before the loop waits
+// again.
+
+#ifndef WEBSOCKET_SRC_EVENT_LOOP_H_
+#define WEBSOCKET_SRC_EVENT_LOOP_H_
+
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// --- Readiness a descriptor is watched for, and reported with ---
+enum EventMask : uint32_t { kReadable = 1, kWritable = 2 };
+
+// --- What the kernel is asked through ---
+class PollBackend {
+ public:
+  struct Ready {
+    int fd;
+    uint32_t events;
+  };
+
+  virtual ~PollBackend() {}
+  // Starts watching fd. Fails with errno set, EPERM for descriptors the
+  // backend cannot wait on (such as regular files with epoll).
+  virtual bool Add(int fd, uint32_t events) = 0;
+  virtual bool Modify(int fd, uint32_t events) = 0;
+  virtual void Remove(int fd) = 0;
+  // Waits up to timeout_ms, or forever if it is -1, and appends the ready
+  // descriptors to ready. Returns false with errno set on failure.
+  virtual bool Wait(int timeout_ms, std::vector<Ready>* ready) = 0;
+  virtual const char* name() const = 0;
+};
+
+class EpollBackend : public PollBackend {
+ public:
+  EpollBackend() : fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+  ~EpollBackend() override {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool ok() const { return fd_ >= 0; }
+
+  bool Add(int fd, uint32_t events) override {
+    return Control(EPOLL_CTL_ADD, fd, events);
+  }
+  bool Modify(int fd, uint32_t events) override {
+    return Control(EPOLL_CTL_MOD, fd, events);
+  }
+  void Remove(int fd) override { epoll_ctl(fd_, EPOLL_CTL_DEL, fd, nullptr); }
+
+  bool Wait(int timeout_ms, std::vector<Ready>* ready) override {
+    struct epoll_event events[64];
+    int count = epoll_wait(fd_, events, 64, timeout_ms);
+    if (count < 0) return false;
+    for (int i = 0; i < count; i++) {
+      uint32_t got = events[i].events;
+      uint32_t mask = 0;
+      // Errors and hangups are reported as whatever is watched, so the
+      // handler finds out by reading or writing, as it would with select.
+      if (got & (EPOLLERR | EPOLLHUP)) mask = kReadable | kWritable;
+      if (got & EPOLLIN) mask |= kReadable;
+      if (got & EPOLLOUT) mask |= kWritable;
+      ready->push_back({events[i].data.fd, mask});
+    }
+    return true;
+  }
+
+  const char* name() const override { return "epoll_wait"; }
+
+ private:
+  bool Control(int op, int fd, uint32_t events) {
+    struct epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    if (events & kReadable) event.events |= EPOLLIN;
+    if (events & kWritable) event.events |= EPOLLOUT;
+    event.data.fd = fd;
+    return epoll_ctl(fd_, op, fd, &event) == 0;
+  }
+
+  int fd_;
+};
+
+class SelectBackend : public PollBackend {
+ public:
+  bool Add(int fd, uint32_t events) override {
+    if (fd >= FD_SETSIZE) {
+      errno = EINVAL;
+      return false;
+    }
+    events_[fd] = events;
+    return true;
+  }
+  bool Modify(int fd, uint32_t events) override {
+    events_[fd] = events;
+    return true;
+  }
+  void Remove(int fd) override { events_.erase(fd); }
+
+  bool Wait(int timeout_ms, std::vector<Ready>* ready) override {
+    fd_set read_fds, write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    int max_fd = -1;
+    for (const auto& entry : events_) {
+      if (entry.second & kReadable) FD_SET(entry.first, &read_fds);
+      if (entry.second & kWritable) FD_SET(entry.first, &write_fds);
+      if (entry.first > max_fd) max_fd = entry.first;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    int count = select(max_fd + 1, &read_fds, &write_fds, nullptr,
+                       timeout_ms < 0 ? nullptr : &timeout);
+    if (count < 0) return false;
+    for (const auto& entry : events_) {
+      if (count == 0) break;
+      uint32_t mask = 0;
+      if (FD_ISSET(entry.first, &read_fds)) mask |= kReadable;
+      if (FD_ISSET(entry.first, &write_fds)) mask |= kWritable;
+      if (mask == 0) continue;
+      ready->push_back({entry.first, mask});
+      count--;
+    }
+    return true;
+  }
+
+  const char* name() const override { return "select"; }
+
+ private:
+  std::map<int, uint32_t> events_;
+};
+
+// --- The loop ---
+class EventLoop {
+ public:
+  typedef std::function<void(uint32_t events)> Handler;
+  typedef std::function<void()> Task;
+  typedef uint64_t TimerId;  // 0 is never a timer
+
+  EventLoop() {
+    const char* choice = std::getenv("EVENT_LOOP_BACKEND");
+    if (choice == nullptr || std::strcmp(choice, "select") != 0) {
+      std::unique_ptr<EpollBackend> epoll(new EpollBackend());
+      if (epoll->ok()) backend_ = std::move(epoll);
+    }
+    if (!backend_) backend_.reset(new SelectBackend());
+  }
+  explicit EventLoop(std::unique_ptr<PollBackend> backend)
+      : backend_(std::move(backend)) {}
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // Calls handler with the ready events whenever fd is ready for any of
+  // events (a mask of kReadable and kWritable). Returns false, with errno
+  // set, if fd cannot be watched.
+  bool Watch(int fd, uint32_t events, Handler handler) {
+    Unwatch(fd);
+    Watcher watcher;
+    watcher.events = events;
+    watcher.serial = ++serial_;
+    watcher.handler = std::make_shared<Handler>(std::move(handler));
+    if (!backend_->Add(fd, events)) {
+      // Regular files are always ready; select and poll say so too.
+      if (errno != EPERM) return false;
+      watcher.always_ready = true;
+      always_ready_++;
+    }
+    watchers_[fd] = std::move(watcher);
+    return true;
+  }
+
+  // Changes what a watched fd waits for. Cheap when nothing changes.
+  void SetEvents(int fd, uint32_t events) {
+    auto it = watchers_.find(fd);
+    if (it == watchers_.end() || it->second.events == events) return;
+    it->second.events = events;
+    if (!it->second.always_ready) backend_->Modify(fd, events);
+  }
+
+  // Stops watching fd. Call before closing it.
+  void Unwatch(int fd) {
+    auto it = watchers_.find(fd);
+    if (it == watchers_.end()) return;
+    if (it->second.always_ready)
+      always_ready_--;
+    else
+      backend_->Remove(fd);
+    watchers_.erase(it);
+  }
+
+  // Runs task once, delay_ms from now.
+  TimerId RunAfter(uint64_t delay_ms, Task task) {
+    TimerId id = ++last_timer_;
+    uint64_t due = NowMs() + delay_ms;
+    timers_[std::make_pair(due, id)] = std::move(task);
+    timer_due_[id] = due;
+    return id;
+  }
+
+  // Cancels a timer that has not run yet.
+  void Cancel(TimerId id) {
+    auto it = timer_due_.find(id);
+    if (it == timer_due_.end()) return;
+    timers_.erase(std::make_pair(it->second, id));
+    timer_due_.erase(it);
+  }
+
+  // Runs task after the handlers of the current iteration.
+  void Defer(Task task) { deferred_.push_back(std::move(task)); }
+
+  // Runs until Stop() is called. Returns false, with errno set, if waiting
+  // failed.
+  bool Run() {
+    running_ = true;
+    std::vector<Task> tasks;
+    std::vector<std::pair<PollBackend::Ready, uint64_t>> batch;
+    while (running_) {
+      tasks.swap(deferred_);
+      for (Task& task : tasks) task();
+      tasks.clear();
+      if (!running_) break;
+
+      ready_.clear();
+      int timeout_ms = deferred_.empty() && always_ready_ == 0 ? TimeoutMs()
+                                                                : 0;
+      if (!backend_->Wait(timeout_ms, &ready_)) {
+        if (errno == EINTR) continue;
+        perror(backend_->name());
+        return false;
+      }
+      // Remember which registration each event belongs to before any
+      // handler can unwatch it.
+      batch.clear();
+      for (const PollBackend::Ready& ready : ready_) {
+        auto it = watchers_.find(ready.fd);
+        if (it != watchers_.end()) batch.push_back({ready, it->second.serial});
+      }
+      for (auto& entry : watchers_) {
+        if (entry.second.always_ready && entry.second.events != 0)
+          batch.push_back({{entry.first, entry.second.events},
+                           entry.second.serial});
+      }
+      for (const auto& entry : batch) {
+        auto it = watchers_.find(entry.first.fd);
+        if (it == watchers_.end() || it->second.serial != entry.second)
+          continue;
+        uint32_t events = entry.first.events & it->second.events;
+        if (events == 0) continue;
+        // The handler may unwatch fd, which destroys its registration.
+        std::shared_ptr<Handler> handler = it->second.handler;
+        (*handler)(events);
+        if (!running_) return true;
+      }
+      RunTimers();
+    }
+    return true;
+  }
+
+  // Makes Run() return once the current handler or task is done.
+  void Stop() { running_ = false; }
+
+ private:
+  struct Watcher {
+    uint32_t events = 0;
+    uint64_t serial = 0;
+    bool always_ready = false;
+    std::shared_ptr<Handler> handler;
+  };
+
+  static uint64_t NowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  // Milliseconds until the next timer is due, or -1 without timers.
+  int TimeoutMs() const {
+    if (timers_.empty()) return -1;
+    uint64_t due = timers_.begin()->first.first;
+    uint64_t now = NowMs();
+    if (due <= now) return 0;
+    return static_cast<int>(std::min<uint64_t>(due - now, INT_MAX));
+  }
+
+  // Runs the timers that are due. Timers they add wait for the next
+  // iteration, even with no delay.
+  void RunTimers() {
+    uint64_t now = NowMs();
+    std::vector<TimerId> due;
+    for (const auto& entry : timers_) {
+      if (entry.first.first > now) break;
+      due.push_back(entry.first.second);
+    }
+    for (TimerId id : due) {
+      auto it = timer_due_.find(id);
+      if (it == timer_due_.end()) continue;  // Cancelled by an earlier one.
+      auto timer = timers_.find(std::make_pair(it->second, id));
+      Task task = std::move(timer->second);
+      timers_.erase(timer);
+      timer_due_.erase(it);
+      task();
+      if (!running_) return;
+    }
+  }
+
+  std::unique_ptr<PollBackend> backend_;
+  std::unordered_map<int, Watcher> watchers_;
+  uint64_t serial_ = 0;
+  int always_ready_ = 0;
+  std::vector<PollBackend::Ready> ready_;
+  std::map<std::pair<uint64_t, TimerId>, Task> timers_;
+  std::unordered_map<TimerId, uint64_t> timer_due_;
+  TimerId last_timer_ = 0;
+  std::vector<Task> deferred_;
+  bool running_ = false;
+};
+
+#endif  // WEBSOCKET_SRC_EVENT_LOOP_H_
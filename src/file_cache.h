@@ -0,0 +1,238 @@
+// Per-file state of the file monitor and the cache that bounds its memory.
+//
+// Every file a browser has asked for gets a MonitoredFile; it is small. The
+// expensive part, the file content and its line table, is only resident while
+// the file is in the cache. The cache evicts the least recently used content
+// once it holds more than a byte or file budget, but never content that has
+// subscribers, here or in sibling monitors: their pages are patched against
+// it. Once a file is evicted and nothing refers to it any more, its
+// MonitoredFile goes too, so asking for many paths does not grow the monitor.
+
+#ifndef WEBSOCKET_SRC_FILE_CACHE_H_
+#define WEBSOCKET_SRC_FILE_CACHE_H_
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "block_diff.h"
+#include "content_hash.h"
+#include "file_snapshot.h"
+#include "fragment_render.h"
+#include "line_diff.h"
+#include "shared_snapshot.h"
+
+// --- State of one monitored file ---
+struct MonitoredFile {
+  ~MonitoredFile() {
+    if (tail_fd >= 0) close(tail_fd);
+    if (shared_fd >= 0) close(shared_fd);
+  }
+
+  std::string path;  // on disk
+  std::string key;   // path relative to the monitored directory
+
+  // Resident only while cached.
+  bool loaded = false;
+  FileSnapshot content;
+  // Line hashes of content; the base for diffing the next version.
+  LineTable lines;
+  // Binary content is diffed by blocks instead, and lines stays empty.
+  bool binary = false;
+  BlockTable blocks;
+  // With --render, Markdown and source files are also kept as HTML
+  // fragments, and pages are patched with those instead of lines.
+  RenderKind render = RenderKind::kNone;
+  RenderedDoc rendered;
+  // Hash of content. In tail mode it is extended by the appended bytes, so it
+  // covers what pages hold even while the mapping is stale.
+  ContentHash hash;
+  // Bytes of deltas recorded in the history since its last checkpoint.
+  size_t history_bytes = 0;
+
+  // Bumped every time content changes, and when it is loaded again after an
+  // eviction. Patches name the version they apply to, so a page that missed
+  // one can ask for a snapshot instead.
+  uint64_t version = 1;
+  // Set when the file was written while content was being hashed or sent,
+  // so pages may hold text that matches no version. The next update is then
+  // sent as a snapshot; the write that caused it always produces one.
+  bool torn = false;
+
+  // The HTTP response for version page_version, rendered on first request:
+  // the headers and the page. The page is shared with the compressor.
+  std::string page_head;
+  std::shared_ptr<const std::string> page;
+  uint64_t page_version = 0;
+  // The same response gzip-compressed, once the compressor has finished it.
+  std::string page_gzip_head;
+  std::string page_gzip;
+  uint64_t page_gzip_version = 0;
+
+  // The most recent changes, oldest first: journal[i] is the message taking
+  // version journal_base + i to the next one. A page that reconnects is sent
+  // the ones it missed instead of a snapshot.
+  std::deque<std::string> journal;
+  uint64_t journal_base = 0;
+  size_t journal_bytes = 0;
+
+  // WebSocket clients showing this file, and when the last one left.
+  std::vector<int> subscribers;
+  uint64_t unsubscribed_ms = 0;
+
+  // In a broker monitor, the shared region content is published to and the
+  // sibling monitors to tell when it changes. In a sibling, the region
+  // content is mapped from; it stays attached after an eviction.
+  std::unique_ptr<SharedRegion> shared;
+  std::vector<int> siblings;
+  int shared_fd = -1;
+
+  // Tail mode: the open file, the offset read up to, and the identity of the
+  // file so truncation and rotation can be told apart from appends.
+  int tail_fd = -1;
+  off_t tail_offset = 0;
+  dev_t tail_device = 0;
+  ino_t tail_inode = 0;
+  // Set when bytes were appended since content was last mapped. The mapping
+  // is only extended when a snapshot is actually served.
+  bool tail_stale = false;
+
+  // A change seen but not yet published: when it was first seen and when the
+  // file was last touched.
+  bool change_pending = false;
+  uint64_t first_change_ms = 0;
+  uint64_t last_change_ms = 0;
+
+  // Cache bookkeeping.
+  size_t charged_bytes = 0;
+  std::list<MonitoredFile*>::iterator lru_pos;
+};
+
+class FileCache {
+ public:
+  FileCache(size_t max_bytes, size_t max_files)
+      : max_bytes_(max_bytes), max_files_(max_files) {}
+
+  // Returns the file stored under key, or nullptr.
+  MonitoredFile* Find(const std::string& key) const {
+    auto it = files_.find(key);
+    return it == files_.end() ? nullptr : it->second.get();
+  }
+
+  // Returns the file stored under key, creating an unloaded one for path.
+  MonitoredFile* Get(const std::string& key, const std::string& path) {
+    std::unique_ptr<MonitoredFile>& file = files_[key];
+    if (!file) {
+      file.reset(new MonitoredFile());
+      file->key = key;
+      file->path = path;
+      file->version = first_version_;
+    }
+    return file.get();
+  }
+
+  // Erases file unless it is loaded or something still refers to it:
+  // subscribers, siblings or a change waiting to be published. Its journal
+  // went with its content. file must not be used afterwards if it was erased.
+  void Forget(MonitoredFile* file) {
+    if (file->loaded || !file->subscribers.empty() ||
+        !file->siblings.empty() || file->change_pending)
+      return;
+    // A page still showing some version of it must not take a file created
+    // again under the same key for current.
+    first_version_ = std::max(first_version_, file->version + 1);
+    files_.erase(file->key);
+  }
+
+  // Call after (re)loading the content of file: charges its current size and
+  // marks it most recently used. Call Trim() once it has been served.
+  void Loaded(MonitoredFile* file) {
+    bytes_ -= file->charged_bytes;
+    file->charged_bytes = Footprint(*file);
+    bytes_ += file->charged_bytes;
+    if (file->loaded) {
+      lru_.splice(lru_.begin(), lru_, file->lru_pos);
+    } else {
+      file->loaded = true;
+      lru_.push_front(file);
+      file->lru_pos = lru_.begin();
+    }
+  }
+
+  // Marks file most recently used.
+  void Touch(MonitoredFile* file) {
+    if (file->loaded) lru_.splice(lru_.begin(), lru_, file->lru_pos);
+  }
+
+  // Drops the content of file.
+  void Unload(MonitoredFile* file) {
+    if (!file->loaded) return;
+    lru_.erase(file->lru_pos);
+    bytes_ -= file->charged_bytes;
+    file->charged_bytes = 0;
+    file->loaded = false;
+    file->content.Clear();
+    file->lines = LineTable();
+    file->blocks = BlockTable();
+    file->render = RenderKind::kNone;
+    file->rendered = RenderedDoc();
+    file->hash.Reset();
+    file->page.reset();
+    file->page_version = 0;
+    std::string().swap(file->page_gzip);
+    file->page_gzip_version = 0;
+    file->journal.clear();
+    file->journal_bytes = 0;
+    if (file->tail_fd >= 0) close(file->tail_fd);
+    file->tail_fd = -1;
+  }
+
+  // Evicts least recently used content without subscribers until the cache
+  // is within budget, and forgets the files evicted.
+  void Trim() {
+    auto it = lru_.end();
+    while ((bytes_ > max_bytes_ || lru_.size() > max_files_) &&
+           it != lru_.begin()) {
+      MonitoredFile* file = *--it;
+      if (!file->subscribers.empty() || !file->siblings.empty()) continue;
+      ++it;  // Unload erases the element it points at.
+      Unload(file);
+      Forget(file);
+    }
+  }
+
+  size_t ResidentBytes() const { return bytes_; }
+  void set_max_bytes(size_t max_bytes) { max_bytes_ = max_bytes; }
+
+ private:
+  static size_t Footprint(const MonitoredFile& file) {
+    return file.content.size() +
+           (file.page ? file.page->capacity() : 0) +
+           file.page_gzip.capacity() + file.journal_bytes +
+           file.lines.hashes.capacity() * sizeof(uint64_t) +
+           file.lines.offsets.capacity() * sizeof(size_t) +
+           file.blocks.weak.capacity() * sizeof(uint32_t) +
+           file.blocks.strong.capacity() * sizeof(uint64_t) +
+           file.rendered.bytes +
+           file.rendered.keys.capacity() * sizeof(uint64_t);
+  }
+
+  size_t max_bytes_;
+  size_t max_files_;
+  size_t bytes_ = 0;
+  // Version of files created from now on: above that of every file erased.
+  uint64_t first_version_ = 1;
+  std::unordered_map<std::string, std::unique_ptr<MonitoredFile>> files_;
+  // Loaded files, most recently used first.
+  std::list<MonitoredFile*> lru_;
+};
+
+#endif  // WEBSOCKET_SRC_FILE_CACHE_H_
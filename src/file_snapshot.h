@@ -0,0 +1,331 @@
+// Read-only in-memory view of a file for the file monitor.
+//
+// Regular files are mapped with mmap and MAP_POPULATE, so loading a new
+// version costs a page table walk over pages that are usually already in the
+// page cache instead of copying the whole file through a stream. Files that
+// cannot be mapped (e.g. /proc entries, which report a size of zero) are read
+// with pread into a buffer the snapshot owns.
+//
+// A mapping is not a copy: writes to the file show through it, and accessing
+// pages past a later truncation raises SIGBUS. Mappings are registered with
+// a SIGBUS handler that swaps such pages for zero pages, so a file truncated
+// while it is read (logrotate's copytruncate, an editor rewriting in place)
+// reads as zeros from there on instead of killing the monitor. The snapshot
+// keeps the file open so callers can ask, before serving the view, whether
+// the file has changed or shrunk since it was taken; it has once any of its
+// pages were swapped.
+//
+// A sibling of a broker monitor maps the broker's shared region instead (see
+// shared_snapshot.h); there the sequence lock tells whether it changed.
+
+#ifndef WEBSOCKET_SRC_FILE_SNAPSHOT_H_
+#define WEBSOCKET_SRC_FILE_SNAPSHOT_H_
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "core.h"
+#include "shared_snapshot.h"
+
+// --- Guard against truncation under a mapping ---
+// A fixed table of the live mappings, which the SIGBUS handler can search
+// without locks or allocation. A file that finds the table full is read
+// into memory instead of mapped.
+class MappingGuard {
+ public:
+  static const int kSlots = 4096;
+
+  // Registers the mapping [start, start + size) and returns its slot, or -1
+  // if every slot is taken. Installs the handler on first use.
+  static int Register(const char* start, size_t size) {
+    static bool installed = Install();
+    if (!installed) return -1;
+    Slot* slots = Slots();
+    for (int i = 0; i < kSlots; i++) {
+      bool expected = false;
+      if (!slots[i].used.compare_exchange_strong(expected, true)) continue;
+      slots[i].size.store(size, std::memory_order_relaxed);
+      slots[i].zeroed.store(false, std::memory_order_relaxed);
+      slots[i].start.store(reinterpret_cast<uintptr_t>(start),
+                           std::memory_order_release);
+      return i;
+    }
+    return -1;
+  }
+
+  // Call before unmapping.
+  static void Unregister(int slot) {
+    Slot& entry = Slots()[slot];
+    entry.start.store(0, std::memory_order_release);
+    entry.used.store(false, std::memory_order_release);
+  }
+
+  // True once pages of the mapping in slot were replaced by zero pages.
+  static bool Zeroed(int slot) {
+    return Slots()[slot].zeroed.load(std::memory_order_acquire);
+  }
+
+ private:
+  struct Slot {
+    std::atomic<bool> used{false};
+    std::atomic<uintptr_t> start{0};
+    std::atomic<size_t> size{0};
+    std::atomic<bool> zeroed{false};
+  };
+
+  static Slot* Slots() {
+    static Slot slots[kSlots];
+    return slots;
+  }
+
+  static uintptr_t& PageMask() {
+    static uintptr_t mask = 0;
+    return mask;
+  }
+
+  static bool Install() {
+    Slots();
+    PageMask() = ~static_cast<uintptr_t>(sysconf(_SC_PAGESIZE) - 1);
+    struct sigaction action = {};
+    action.sa_sigaction = HandleSigbus;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO;
+    return sigaction(SIGBUS, &action, nullptr) == 0;
+  }
+
+  // Maps zero pages over a registered mapping from the faulting page to its
+  // end, and returns so the read is retried. Any other SIGBUS gets the
+  // default action once the faulting access is retried.
+  static void HandleSigbus(int, siginfo_t* info, void*) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    Slot* slots = Slots();
+    for (int i = 0; i < kSlots; i++) {
+      uintptr_t start = slots[i].start.load(std::memory_order_acquire);
+      if (start == 0 || addr < start) continue;
+      uintptr_t end = start + slots[i].size.load(std::memory_order_relaxed);
+      if (addr >= end) continue;
+      uintptr_t page = addr & PageMask();
+      void* zero = mmap(reinterpret_cast<void*>(page), end - page, PROT_READ,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+      if (zero == MAP_FAILED) break;
+      slots[i].zeroed.store(true, std::memory_order_release);
+      return;
+    }
+    signal(SIGBUS, SIG_DFL);
+  }
+};
+
+class FileSnapshot {
+ public:
+  FileSnapshot() = default;
+  FileSnapshot(const FileSnapshot&) = delete;
+  FileSnapshot& operator=(const FileSnapshot&) = delete;
+  ~FileSnapshot() { Release(); }
+
+  // Replaces the snapshot with the current content of path. On failure the
+  // previous snapshot is kept and false is returned.
+  bool Load(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      close(fd);
+      return false;
+    }
+    // Files under /proc are regular but report a size of zero.
+    bool sized = S_ISREG(st.st_mode) && st.st_size > 0;
+    return Take(fd, st, sized ? st.st_size : 0, !sized);
+  }
+
+  // Replaces the snapshot with the first size bytes of the regular file fd.
+  // The caller keeps ownership of fd.
+  bool LoadPrefix(int fd, size_t size) {
+    int own_fd = dup(fd);
+    if (own_fd < 0) return false;
+    struct stat st;
+    if (fstat(own_fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        static_cast<size_t>(st.st_size) < size) {
+      close(own_fd);
+      return false;
+    }
+    return Take(own_fd, st, size, false);
+  }
+
+  // Replaces the snapshot with the content of the shared region fd, mapped
+  // read-only and used in place. The caller keeps ownership of fd. Fails if
+  // the broker stays in the middle of a write.
+  bool LoadShared(int fd) {
+    int own_fd = dup(fd);
+    if (own_fd < 0) return false;
+    const int kAttempts = 1000;
+    char* map = nullptr;
+    size_t map_size = 0;
+    for (int attempt = 0; attempt < kAttempts; attempt++) {
+      struct stat st;
+      if (fstat(own_fd, &st) < 0) break;
+      if (map == nullptr || map_size != static_cast<size_t>(st.st_size)) {
+        if (map != nullptr) munmap(map, map_size);
+        map_size = st.st_size;
+        void* mapped = map_size < sizeof(SharedSnapshotHeader)
+                           ? MAP_FAILED
+                           : mmap(nullptr, map_size, PROT_READ, MAP_SHARED,
+                                  own_fd, 0);
+        map = mapped == MAP_FAILED ? nullptr : static_cast<char*>(mapped);
+        if (map == nullptr) break;
+      }
+      const SharedSnapshotHeader* header =
+          reinterpret_cast<const SharedSnapshotHeader*>(map);
+      uint64_t sequence = header->sequence.load(std::memory_order_acquire);
+      size_t size = header->size;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ((sequence & 1) != 0 ||
+          header->sequence.load(std::memory_order_relaxed) != sequence) {
+        sched_yield();
+        continue;
+      }
+      if (sizeof(SharedSnapshotHeader) + size > map_size) continue;  // Grown.
+      Release();
+      fd_ = own_fd;
+      shared_map_ = map;
+      shared_map_size_ = map_size;
+      shared_sequence_ = sequence;
+      data_ = map + sizeof(SharedSnapshotHeader);
+      size_ = size;
+      return true;
+    }
+    if (map != nullptr) munmap(map, map_size);
+    close(own_fd);
+    return false;
+  }
+
+  // Drops the content and closes the file.
+  void Clear() { Release(); }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  ByteView View() const { return {data_, size_}; }
+
+  // True if the file was written to or resized since the snapshot was taken.
+  bool Changed() const {
+    if (guard_slot_ >= 0 && MappingGuard::Zeroed(guard_slot_)) return true;
+    if (shared_map_ != nullptr) {
+      return reinterpret_cast<const SharedSnapshotHeader*>(shared_map_)
+                 ->sequence.load(std::memory_order_acquire) !=
+             shared_sequence_;
+    }
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) < 0) return false;
+    return st.st_size != size_at_load_ ||
+           st.st_mtim.tv_sec != mtime_.tv_sec ||
+           st.st_mtim.tv_nsec != mtime_.tv_nsec;
+  }
+
+  // True if the file is now shorter than the snapshot, so part of a mapping
+  // is no longer backed by the file.
+  bool Shrunk() const {
+    struct stat st;
+    if (!mapped_) return false;
+    if (MappingGuard::Zeroed(guard_slot_)) return true;
+    if (fstat(fd_, &st) < 0) return false;
+    return static_cast<size_t>(st.st_size) < size_;
+  }
+
+ private:
+  // Takes ownership of fd and snapshots its first size bytes, or with to_eof
+  // everything that can be read from it.
+  bool Take(int fd, const struct stat& st, size_t size, bool to_eof) {
+    const char* data = nullptr;
+    bool mapped = false;
+    int guard_slot = -1;
+    std::string buffer;
+    if (!to_eof && size > 0) {
+      void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                       fd, 0);
+      if (map != MAP_FAILED) {
+        data = static_cast<const char*>(map);
+        guard_slot = MappingGuard::Register(data, size);
+        // Unguarded, a truncation would be fatal: read it instead.
+        mapped = guard_slot >= 0;
+        if (!mapped) munmap(map, size);
+      }
+    }
+    if (!mapped && (to_eof || size > 0) &&
+        !ReadAll(fd, to_eof ? 0 : size, &buffer)) {
+      close(fd);
+      return false;
+    }
+
+    Release();
+    fd_ = fd;
+    mapped_ = mapped;
+    guard_slot_ = guard_slot;
+    size_at_load_ = st.st_size;
+    mtime_ = st.st_mtim;
+    if (mapped) {
+      data_ = data;
+      size_ = size;
+    } else {
+      buffer_.swap(buffer);
+      data_ = buffer_.data();
+      size_ = buffer_.size();
+    }
+    return true;
+  }
+
+  // Reads size bytes, or everything for a size of zero, with pread.
+  static bool ReadAll(int fd, size_t size, std::string* out) {
+    out->resize(size > 0 ? size : 4096);
+    size_t got = 0;
+    while (true) {
+      if (got == out->size()) {
+        if (size > 0) break;
+        out->resize(out->size() * 2);
+      }
+      ssize_t n = pread(fd, &(*out)[got], out->size() - got, got);
+      if (n < 0) return false;
+      if (n == 0) break;
+      got += n;
+    }
+    out->resize(got);
+    return true;
+  }
+
+  void Release() {
+    if (mapped_) {
+      MappingGuard::Unregister(guard_slot_);
+      munmap(const_cast<char*>(data_), size_);
+    }
+    if (shared_map_ != nullptr) munmap(shared_map_, shared_map_size_);
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+    mapped_ = false;
+    guard_slot_ = -1;
+    shared_map_ = nullptr;
+    data_ = "";
+    size_ = 0;
+    buffer_.clear();
+  }
+
+  int fd_ = -1;
+  bool mapped_ = false;
+  // The mapping's slot in MappingGuard, or -1.
+  int guard_slot_ = -1;
+  const char* data_ = "";
+  size_t size_ = 0;
+  std::string buffer_;
+  off_t size_at_load_ = 0;
+  struct timespec mtime_ = {0, 0};
+  // The whole shared region, when the snapshot is of one.
+  char* shared_map_ = nullptr;
+  size_t shared_map_size_ = 0;
+  uint64_t shared_sequence_ = 0;
+};
+
+#endif  // WEBSOCKET_SRC_FILE_SNAPSHOT_H_
@@ -0,0 +1,609 @@
+// Server-side rendering of Markdown and source files for the file monitor.
+//
+// A rendered file is a list of HTML fragments, one top-level element each:
+// a block (paragraph, heading, list, code fence, ...) of a Markdown file, or
+// a line of a source file with its syntax highlighted. Each fragment has a
+// key, a hash of its source text and of anything else its HTML depends on,
+// and rendered fragments are cached by key. Rendering a new version only
+// renders the fragments whose key was not seen before; the rest come from
+// the cache. The keys of two versions are diffed like line hashes, and the
+// page is sent the changed fragments.
+//
+// Fragments never contain '\n' (newlines in code blocks are written as
+// "&#10;"), so a list of fragments travels in the same format as a list of
+// lines.
+
+#ifndef WEBSOCKET_SRC_FRAGMENT_RENDER_H_
+#define WEBSOCKET_SRC_FRAGMENT_RENDER_H_
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "line_diff.h"
+#include "monitor_page.h"
+
+enum class RenderKind { kNone, kMarkdown, kCCode, kHashCode };
+
+// --- Renderer for a file, chosen by its name ---
+// kCCode covers languages with // and /* */ comments, kHashCode those with
+// # comments.
+inline RenderKind RenderKindFor(const std::string& path) {
+  size_t slash = path.rfind('/');
+  std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  if (name == "Makefile" || name == "CMakeLists.txt" || name == "Dockerfile")
+    return RenderKind::kHashCode;
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos) return RenderKind::kNone;
+  std::string ext = name.substr(dot + 1);
+  for (char& c : ext) c = std::tolower(static_cast<unsigned char>(c));
+  static const std::unordered_map<std::string, RenderKind> kKinds = {
+      {"md", RenderKind::kMarkdown},     {"markdown", RenderKind::kMarkdown},
+      {"c", RenderKind::kCCode},         {"h", RenderKind::kCCode},
+      {"cc", RenderKind::kCCode},        {"cpp", RenderKind::kCCode},
+      {"cxx", RenderKind::kCCode},       {"hh", RenderKind::kCCode},
+      {"hpp", RenderKind::kCCode},       {"java", RenderKind::kCCode},
+      {"js", RenderKind::kCCode},        {"mjs", RenderKind::kCCode},
+      {"ts", RenderKind::kCCode},        {"go", RenderKind::kCCode},
+      {"rs", RenderKind::kCCode},        {"cs", RenderKind::kCCode},
+      {"kt", RenderKind::kCCode},        {"swift", RenderKind::kCCode},
+      {"scala", RenderKind::kCCode},     {"py", RenderKind::kHashCode},
+      {"sh", RenderKind::kHashCode},     {"bash", RenderKind::kHashCode},
+      {"rb", RenderKind::kHashCode},     {"pl", RenderKind::kHashCode},
+      {"yaml", RenderKind::kHashCode},   {"yml", RenderKind::kHashCode},
+      {"toml", RenderKind::kHashCode},   {"cmake", RenderKind::kHashCode},
+      {"conf", RenderKind::kHashCode},
+  };
+  auto it = kKinds.find(ext);
+  return it == kKinds.end() ? RenderKind::kNone : it->second;
+}
+
+// The class of the element holding the fragments; the page styles by it.
+inline const char* RenderClass(RenderKind kind) {
+  return kind == RenderKind::kMarkdown ? "markdown" : "code";
+}
+
+// --- Syntax highlighting of one line ---
+// Lines are highlighted on their own, knowing only whether they start inside
+// a block comment: *state is 1 if so, and is updated to the state at the end
+// of the line. Keywords of the supported languages are lumped together.
+inline bool IsKeyword(RenderKind kind, const char* word, size_t len) {
+  static const std::unordered_set<std::string> kCKeywords = {
+      "auto", "bool", "break", "case", "catch", "char", "class", "const",
+      "constexpr", "continue", "default", "delete", "do", "double", "else",
+      "enum", "explicit", "extends", "extern", "false", "final", "float",
+      "fn", "for", "func", "function", "go", "if", "impl", "implements",
+      "import", "include", "inline", "int", "interface", "let", "long",
+      "match", "mod", "mut", "namespace", "new", "null", "nullptr",
+      "override", "package", "private", "protected", "pub", "public",
+      "return", "self", "short", "signed", "sizeof", "static", "struct",
+      "super", "switch", "template", "this", "throw", "throws", "trait",
+      "true", "try", "type", "typedef", "typename", "union", "unsigned",
+      "use", "using", "var", "virtual", "void", "volatile", "while",
+      "define", "ifdef", "ifndef", "endif", "async", "await", "yield"};
+  static const std::unordered_set<std::string> kHashKeywords = {
+      "and", "as", "assert", "async", "await", "break", "case", "class",
+      "continue", "def", "del", "do", "done", "elif", "else", "end",
+      "esac", "except", "export", "False", "fi", "finally", "for", "from",
+      "function", "global", "if", "import", "in", "is", "lambda", "local",
+      "module", "None", "nonlocal", "not", "or", "pass", "raise",
+      "require", "return", "then", "True", "try", "unless", "until",
+      "while", "with", "yield"};
+  const std::unordered_set<std::string>& keywords =
+      kind == RenderKind::kCCode ? kCKeywords : kHashKeywords;
+  return keywords.count(std::string(word, len)) != 0;
+}
+
+inline void AppendSpan(std::string* out, const char* cls, const char* data,
+                       size_t len) {
+  out->append("<span class=\"");
+  out->append(cls);
+  out->append("\">");
+  AppendHtmlEscaped(out, data, len);
+  out->append("</span>");
+}
+
+inline void HighlightLine(RenderKind kind, const char* data, size_t len,
+                          int* state, std::string* out) {
+  bool c_like = kind == RenderKind::kCCode;
+  out->append("<div>");
+  size_t i = 0;
+  while (i < len) {
+    if (*state == 1) {
+      // Inside a block comment; it was opened at i or on an earlier line.
+      size_t from = len - i >= 2 && std::memcmp(data + i, "/*", 2) == 0
+                        ? i + 2
+                        : i;
+      size_t end = len;
+      for (size_t j = from; j + 1 < len; j++) {
+        if (data[j] == '*' && data[j + 1] == '/') {
+          end = j + 2;
+          *state = 0;
+          break;
+        }
+      }
+      AppendSpan(out, "c", data + i, end - i);
+      i = end;
+      continue;
+    }
+    char c = data[i];
+    char next = i + 1 < len ? data[i + 1] : '\0';
+    if (c_like && c == '/' && next == '*') {
+      *state = 1;
+      continue;
+    }
+    if ((c_like && c == '/' && next == '/') || (!c_like && c == '#')) {
+      AppendSpan(out, "c", data + i, len - i);
+      break;
+    }
+    if (c == '"' || c == '\'' || (c == '`' && c_like)) {
+      size_t j = i + 1;
+      while (j < len && data[j] != c) j += data[j] == '\\' ? 2 : 1;
+      j = j < len ? j + 1 : len;
+      AppendSpan(out, "s", data + i, j - i);
+      i = j;
+      continue;
+    }
+    bool number = std::isdigit(static_cast<unsigned char>(c));
+    if (number || std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+      size_t j = i;
+      while (j < len && (std::isalnum(static_cast<unsigned char>(data[j])) ||
+                         data[j] == '_' || (number && data[j] == '.')))
+        j++;
+      if (number)
+        AppendSpan(out, "n", data + i, j - i);
+      else if (IsKeyword(kind, data + i, j - i))
+        AppendSpan(out, "k", data + i, j - i);
+      else
+        AppendHtmlEscaped(out, data + i, j - i);
+      i = j;
+      continue;
+    }
+    AppendHtmlEscaped(out, data + i, 1);
+    i++;
+  }
+  out->append("</div>");
+}
+
+// --- Markdown ---
+// A practical subset: ATX headings, paragraphs, lists, block quotes, fenced
+// code blocks and rules, with code spans, emphasis, links and images inline.
+// Raw HTML in the source is escaped, not passed through.
+
+inline bool IsBlankLine(const char* data, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    if (data[i] != ' ' && data[i] != '\t' && data[i] != '\r') return false;
+  return true;
+}
+
+// Returns the fence character ('`' or '~') if the line opens or closes a
+// fenced code block, else 0.
+inline char FenceOf(const char* data, size_t len) {
+  size_t i = 0;
+  while (i < len && i < 3 && data[i] == ' ') i++;
+  if (len - i < 3 || (data[i] != '`' && data[i] != '~')) return 0;
+  return data[i + 1] == data[i] && data[i + 2] == data[i] ? data[i] : 0;
+}
+
+inline bool IsRule(const char* data, size_t len) {
+  char mark = 0;
+  int count = 0;
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    if (c == ' ' || c == '\t' || c == '\r') continue;
+    if ((c != '-' && c != '*' && c != '_') || (mark && c != mark))
+      return false;
+    mark = c;
+    count++;
+  }
+  return count >= 3;
+}
+
+inline bool IsHeading(const char* data, size_t len) {
+  size_t i = 0;
+  while (i < len && i < 7 && data[i] == '#') i++;
+  return i >= 1 && i <= 6 && (i == len || data[i] == ' ');
+}
+
+// Length of the list marker ("- ", "* ", "+ ", "12. ") the line starts
+// with after its indentation, or 0. *ordered tells which kind it is.
+inline size_t ListMarker(const char* data, size_t len, bool* ordered) {
+  size_t i = 0;
+  while (i < len && data[i] == ' ') i++;
+  if (i + 1 < len && (data[i] == '-' || data[i] == '*' || data[i] == '+') &&
+      data[i + 1] == ' ') {
+    *ordered = false;
+    return i + 2;
+  }
+  size_t j = i;
+  while (j < len && std::isdigit(static_cast<unsigned char>(data[j]))) j++;
+  if (j > i && j + 1 < len && data[j] == '.' && data[j + 1] == ' ') {
+    *ordered = true;
+    return j + 2;
+  }
+  return 0;
+}
+
+// Splits the source into blocks, as [begin, end) ranges without the final
+// '\n': runs of lines separated by blank lines, except that a fenced code
+// block is one block up to its closing fence, and headings and rules are
+// blocks of their own.
+inline void SplitMarkdownBlocks(
+    const char* data, size_t len,
+    std::vector<std::pair<size_t, size_t>>* blocks) {
+  blocks->clear();
+  const size_t kNone = static_cast<size_t>(-1);
+  size_t begin = kNone, end = 0;
+  char fence = 0;
+  auto flush = [&]() {
+    if (begin != kNone) blocks->push_back(std::make_pair(begin, end));
+    begin = kNone;
+  };
+  size_t start = 0;
+  while (start <= len) {
+    const void* nl = std::memchr(data + start, '\n', len - start);
+    size_t line_end = nl ? static_cast<const char*>(nl) - data : len;
+    const char* line = data + start;
+    size_t line_len = line_end - start;
+    if (fence) {
+      end = line_end;
+      if (FenceOf(line, line_len) == fence) {
+        fence = 0;
+        flush();
+      }
+    } else if (FenceOf(line, line_len)) {
+      flush();
+      fence = FenceOf(line, line_len);
+      begin = start;
+      end = line_end;
+    } else if (IsBlankLine(line, line_len)) {
+      flush();
+    } else if (IsHeading(line, line_len) || IsRule(line, line_len)) {
+      flush();
+      blocks->push_back(std::make_pair(start, line_end));
+    } else {
+      if (begin == kNone) begin = start;
+      end = line_end;
+    }
+    if (nl == nullptr) break;
+    start = line_end + 1;
+  }
+  flush();
+}
+
+// URLs that would run script are dropped from links and images.
+inline bool IsSafeUrl(const std::string& url) {
+  size_t colon = url.find(':');
+  if (colon == std::string::npos || url.find('/') < colon) return true;
+  std::string scheme = url.substr(0, colon);
+  for (char& c : scheme) c = std::tolower(static_cast<unsigned char>(c));
+  return scheme == "http" || scheme == "https" || scheme == "mailto";
+}
+
+inline void AppendMarkdownInline(const char* s, size_t n, std::string* out) {
+  size_t i = 0;
+  while (i < n) {
+    char c = s[i];
+    if (c == '\\' && i + 1 < n && std::ispunct(static_cast<unsigned char>(
+                                      s[i + 1]))) {
+      AppendHtmlEscaped(out, s + i + 1, 1);
+      i += 2;
+      continue;
+    }
+    if (c == '`') {
+      const void* close = std::memchr(s + i + 1, '`', n - i - 1);
+      if (close != nullptr) {
+        size_t end = static_cast<const char*>(close) - s;
+        out->append("<code>");
+        AppendHtmlEscaped(out, s + i + 1, end - i - 1);
+        out->append("</code>");
+        i = end + 1;
+        continue;
+      }
+    }
+    if ((c == '*' || c == '_') && i + 1 < n && s[i + 1] == c) {
+      const char marker[3] = {c, c, '\0'};
+      size_t end = std::string(s + i + 2, n - i - 2).find(marker);
+      if (end != std::string::npos && end > 0) {
+        out->append("<strong>");
+        AppendMarkdownInline(s + i + 2, end, out);
+        out->append("</strong>");
+        i += end + 4;
+        continue;
+      }
+    }
+    if ((c == '*' || c == '_') && i + 1 < n && s[i + 1] != ' ') {
+      const void* close = std::memchr(s + i + 1, c, n - i - 1);
+      if (close != nullptr) {
+        size_t end = static_cast<const char*>(close) - s;
+        out->append("<em>");
+        AppendMarkdownInline(s + i + 1, end - i - 1, out);
+        out->append("</em>");
+        i = end + 1;
+        continue;
+      }
+    }
+    bool image = c == '!' && i + 1 < n && s[i + 1] == '[';
+    if (c == '[' || image) {
+      size_t open = image ? i + 1 : i;
+      const void* bracket = std::memchr(s + open, ']', n - open);
+      size_t close = bracket ? static_cast<const char*>(bracket) - s : n;
+      // The URL runs to the parenthesis that balances the opening one.
+      size_t end = n;
+      if (close + 1 < n && s[close + 1] == '(') {
+        int depth = 0;
+        for (size_t j = close + 1; j < n && end == n; j++) {
+          if (s[j] == '(') depth++;
+          if (s[j] == ')' && --depth == 0) end = j;
+        }
+      }
+      if (end < n) {
+        std::string url(s + close + 2, end - close - 2);
+        const char* text = s + open + 1;
+        size_t text_len = close - open - 1;
+        if (!IsSafeUrl(url)) {
+          AppendHtmlEscaped(out, text, text_len);
+        } else if (image) {
+          out->append("<img src=\"");
+          AppendHtmlEscaped(out, url.data(), url.size());
+          out->append("\" alt=\"");
+          AppendHtmlEscaped(out, text, text_len);
+          out->append("\">");
+        } else {
+          out->append("<a href=\"");
+          AppendHtmlEscaped(out, url.data(), url.size());
+          out->append("\">");
+          AppendMarkdownInline(text, text_len, out);
+          out->append("</a>");
+        }
+        i = end + 1;
+        continue;
+      }
+    }
+    AppendHtmlEscaped(out, s + i, 1);
+    i++;
+  }
+}
+
+// Appends text with every '\n' written as "&#10;", as fragments require.
+inline void AppendCodeText(std::string* out, const char* data, size_t len) {
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i < len && data[i] != '\n') continue;
+    AppendHtmlEscaped(out, data + start, i - start);
+    if (i < len) out->append("&#10;");
+    start = i + 1;
+  }
+}
+
+inline void RenderMarkdownBlock(const char* data, size_t len,
+                                std::string* out) {
+  // The lines of the block, without any '\r'.
+  std::vector<std::string> lines;
+  size_t start = 0;
+  while (start <= len) {
+    const void* nl = std::memchr(data + start, '\n', len - start);
+    size_t end = nl ? static_cast<const char*>(nl) - data : len;
+    std::string line(data + start, end - start);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    lines.push_back(line);
+    if (nl == nullptr) break;
+    start = end + 1;
+  }
+  const std::string& first = lines[0];
+  char fence = FenceOf(first.data(), first.size());
+  if (fence) {
+    size_t count = lines.size();
+    if (count > 1 && FenceOf(lines.back().data(), lines.back().size()))
+      count--;
+    std::string code;
+    for (size_t i = 1; i < count; i++) {
+      if (i > 1) code.push_back('\n');
+      code += lines[i];
+    }
+    out->append("<pre><code>");
+    AppendCodeText(out, code.data(), code.size());
+    out->append("</code></pre>");
+    return;
+  }
+  if (IsHeading(first.data(), first.size())) {
+    size_t level = first.find_first_not_of('#');
+    if (level == std::string::npos) level = first.size();
+    size_t begin = first.find_first_not_of(' ', level);
+    size_t end = first.find_last_not_of("# ");
+    std::string text = begin == std::string::npos || end < begin
+                           ? ""
+                           : first.substr(begin, end - begin + 1);
+    std::string tag = "h" + std::to_string(level);
+    out->append("<" + tag + ">");
+    AppendMarkdownInline(text.data(), text.size(), out);
+    out->append("</" + tag + ">");
+    return;
+  }
+  if (IsRule(first.data(), first.size())) {
+    out->append("<hr>");
+    return;
+  }
+  bool ordered;
+  if (ListMarker(first.data(), first.size(), &ordered)) {
+    out->append(ordered ? "<ol>" : "<ul>");
+    std::string item;
+    bool open = false;
+    auto close_item = [&]() {
+      if (!open) return;
+      out->append("<li>");
+      AppendMarkdownInline(item.data(), item.size(), out);
+      out->append("</li>");
+    };
+    for (const std::string& line : lines) {
+      bool line_ordered;
+      size_t marker = ListMarker(line.data(), line.size(), &line_ordered);
+      if (marker) {
+        close_item();
+        item = line.substr(marker);
+        open = true;
+      } else {
+        size_t text = line.find_first_not_of(' ');
+        if (text != std::string::npos) item += " " + line.substr(text);
+      }
+    }
+    close_item();
+    out->append(ordered ? "</ol>" : "</ul>");
+    return;
+  }
+  bool quote = true;
+  for (const std::string& line : lines) {
+    if (line.compare(0, 1, ">") != 0) quote = false;
+  }
+  std::string text;
+  for (const std::string& line : lines) {
+    std::string part = line;
+    if (quote) part.erase(0, part.compare(0, 2, "> ") == 0 ? 2 : 1);
+    if (!text.empty()) text.push_back(' ');
+    text += part;
+  }
+  out->append(quote ? "<blockquote><p>" : "<p>");
+  AppendMarkdownInline(text.data(), text.size(), out);
+  out->append(quote ? "</p></blockquote>" : "</p>");
+}
+
+// --- Cache of rendered fragments by key ---
+// Bounded in bytes, least recently used first out. Fragments are shared, so
+// the ones a file currently shows stay alive even when evicted here.
+class FragmentCache {
+ public:
+  struct Fragment {
+    std::shared_ptr<const std::string> html;
+    int end_state;  // highlighter state after the line
+  };
+
+  explicit FragmentCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  const Fragment* Find(uint64_t key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) return nullptr;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return &it->second->second;
+  }
+
+  void Insert(uint64_t key, const Fragment& fragment) {
+    if (index_.count(key)) return;
+    lru_.push_front(std::make_pair(key, fragment));
+    index_[key] = lru_.begin();
+    bytes_ += fragment.html->size();
+    while (bytes_ > max_bytes_ && lru_.size() > 1) {
+      bytes_ -= lru_.back().second.html->size();
+      index_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+  }
+
+ private:
+  typedef std::list<std::pair<uint64_t, Fragment>> List;
+  size_t max_bytes_;
+  size_t bytes_ = 0;
+  List lru_;
+  std::unordered_map<uint64_t, List::iterator> index_;
+};
+
+// --- A rendered file version ---
+struct RenderedDoc {
+  std::vector<uint64_t> keys;
+  std::vector<std::shared_ptr<const std::string>> html;
+  size_t bytes = 0;  // of the fragments joined by '\n'
+};
+
+// Key of a fragment: the hash of its source, mixed with the renderer and
+// the state it starts in.
+inline uint64_t FragmentKey(RenderKind kind, int state, uint64_t source_hash) {
+  uint64_t key = source_hash ^ (static_cast<uint64_t>(kind) << 56) ^
+                 (static_cast<uint64_t>(state) << 48);
+  key *= 0x9e3779b97f4a7c15ULL;
+  return key ^ (key >> 29);
+}
+
+// Renders data into doc, taking every fragment it can from the cache. lines
+// must be the line table of data; source files are keyed by its hashes.
+// Returns the number of fragments that had to be rendered.
+inline size_t RenderDocument(RenderKind kind, const char* data, size_t len,
+                             const LineTable& lines, FragmentCache* cache,
+                             RenderedDoc* doc) {
+  doc->keys.clear();
+  doc->html.clear();
+  doc->bytes = 0;
+  size_t rendered = 0;
+  auto add = [&](uint64_t key, const std::shared_ptr<const std::string>& h) {
+    doc->keys.push_back(key);
+    doc->html.push_back(h);
+    doc->bytes += h->size() + 1;
+  };
+  if (kind == RenderKind::kMarkdown) {
+    std::vector<std::pair<size_t, size_t>> blocks;
+    SplitMarkdownBlocks(data, len, &blocks);
+    for (const auto& block : blocks) {
+      const char* text = data + block.first;
+      size_t text_len = block.second - block.first;
+      uint64_t key = FragmentKey(kind, 0, HashLine(text, text_len));
+      const FragmentCache::Fragment* cached = cache->Find(key);
+      if (cached == nullptr) {
+        std::shared_ptr<std::string> html(new std::string());
+        RenderMarkdownBlock(text, text_len, html.get());
+        cache->Insert(key, FragmentCache::Fragment{html, 0});
+        add(key, html);
+        rendered++;
+      } else {
+        add(key, cached->html);
+      }
+    }
+    return rendered;
+  }
+  int state = 0;
+  for (size_t i = 0; i < lines.LineCount(); i++) {
+    uint64_t key = FragmentKey(kind, state, lines.hashes[i]);
+    const FragmentCache::Fragment* cached = cache->Find(key);
+    if (cached == nullptr) {
+      std::shared_ptr<std::string> html(new std::string());
+      HighlightLine(kind, data + lines.offsets[i],
+                    lines.offsets[i + 1] - 1 - lines.offsets[i], &state,
+                    html.get());
+      cache->Insert(key, FragmentCache::Fragment{html, state});
+      add(key, html);
+      rendered++;
+    } else {
+      state = cached->end_state;
+      add(key, cached->html);
+    }
+  }
+  return rendered;
+}
+
+// --- Encode a fragment patch message ---
+// The line patch format over fragments instead of lines, with 'H' for 'P':
+// "H<base> <version>\n", then for every edit "<old_start> <old_count>
+// <new_count>\n" and the new fragments, each followed by '\n'.
+inline std::string EncodeFragmentPatch(uint64_t base, uint64_t version,
+                                       const std::vector<LineEdit>& edits,
+                                       const RenderedDoc& doc) {
+  std::string patch =
+      "H" + std::to_string(base) + " " + std::to_string(version) + "\n";
+  for (const LineEdit& edit : edits) {
+    patch += std::to_string(edit.old_start) + " " +
+             std::to_string(edit.old_count) + " " +
+             std::to_string(edit.new_count) + "\n";
+    for (size_t i = edit.new_start; i < edit.new_start + edit.new_count;
+         i++) {
+      patch += *doc.html[i];
+      patch.push_back('\n');
+    }
+  }
+  return patch;
+}
+
+#endif  // WEBSOCKET_SRC_FRAGMENT_RENDER_H_
@@ -0,0 +1,382 @@
+// Persistent history of the versions of monitored files.
+//
+// Every version the monitor publishes is appended to a log on disk, either as
+// the message that made it from the previous version (a line patch, an append
+// or a block delta), or as a checkpoint holding the whole content. Each file
+// has two files in the history directory: <name>.log with the records back to
+// back, and <name>.idx with one fixed-size entry per record in time order, so
+// the version current at any moment is found by a binary search. A past
+// version is rebuilt from the checkpoint before it plus the deltas after
+// that checkpoint.
+//
+// Records are written by a background thread, which commits everything queued
+// in one write per file and one fdatasync, at most once per commit interval.
+// The event loop only hands records over. The log is synced before the index
+// is written, so the index never refers to data that is not on disk.
+
+#ifndef WEBSOCKET_SRC_HISTORY_LOG_H_
+#define WEBSOCKET_SRC_HISTORY_LOG_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "block_diff.h"
+#include "content_hash.h"
+#include "line_diff.h"
+
+// --- One record of the history, as stored in the index ---
+// In host byte order; the history is not meant to move between machines.
+struct HistoryEntry {
+  uint64_t time_ms;  // wall clock, never decreasing within one file
+  uint64_t version;  // as numbered by the monitor run that recorded it
+  uint64_t offset;   // of the record in the log
+  uint64_t length;
+  uint64_t hash;     // ContentHash digest of the version
+  // 'C' for a checkpoint, otherwise the message type: 'P', 'A' or 'D'.
+  uint8_t kind;
+  uint8_t padding[7];
+};
+
+class HistoryLog {
+ public:
+  HistoryLog() = default;
+  HistoryLog(const HistoryLog&) = delete;
+  HistoryLog& operator=(const HistoryLog&) = delete;
+  ~HistoryLog() { Stop(); }
+
+  // Keeps the history in dir, creating it if needed, and starts the writer
+  // thread.
+  bool Start(const std::string& dir, uint64_t commit_ms) {
+    if (worker_.joinable()) return true;
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+      perror(dir.c_str());
+      return false;
+    }
+    dir_ = dir;
+    commit_ms_ = commit_ms;
+    stopping_ = false;
+    worker_ = std::thread(&HistoryLog::Run, this);
+    return true;
+  }
+
+  // Commits what is queued, joins the writer and closes the files.
+  void Stop() {
+    if (!worker_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    worker_.join();
+    for (auto& file : files_) {
+      close(file.second->log_fd);
+      close(file.second->index_fd);
+    }
+    files_.clear();
+  }
+
+  bool enabled() const { return worker_.joinable(); }
+
+  // Queues a record of version of the file stored under key. kind is 'C'
+  // with the content as data, or the message type with the message.
+  void Append(const std::string& key, uint64_t version, uint64_t hash,
+              char kind, std::string data) {
+    Newest& newest = NewestOf(key);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t time_ms = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+    newest.time_ms = std::max(newest.time_ms, time_ms);
+    newest.hash = hash;
+    newest.empty = false;
+    Job job;
+    job.key = key;
+    std::memset(&job.entry, 0, sizeof(job.entry));
+    job.entry.time_ms = newest.time_ms;
+    job.entry.version = version;
+    job.entry.length = data.size();
+    job.entry.hash = hash;
+    job.entry.kind = kind;
+    job.data = std::move(data);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(job));
+    }
+    wakeup_.notify_one();
+  }
+
+  // True if the newest version recorded for key, committed or not, has the
+  // given hash, so a file loaded again can continue its history without a
+  // checkpoint.
+  bool IsNewest(const std::string& key, uint64_t hash) {
+    const Newest& newest = NewestOf(key);
+    return !newest.empty && newest.hash == hash;
+  }
+
+  // The oldest and newest committed records of key and their count.
+  bool Extent(const std::string& key, HistoryEntry* first,
+              HistoryEntry* last, size_t* count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    File* file = OpenFile(key);
+    if (file == nullptr || file->entries.empty()) return false;
+    *first = file->entries.front();
+    *last = file->entries.back();
+    *count = file->entries.size();
+    return true;
+  }
+
+  // Rebuilds the version of key that was current at time_ms into content,
+  // and stores its record in entry. Returns false if there is no such
+  // version or it cannot be rebuilt.
+  bool Rebuild(const std::string& key, uint64_t time_ms, std::string* content,
+               HistoryEntry* entry) {
+    std::vector<HistoryEntry> chain;
+    int log_fd;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      File* file = OpenFile(key);
+      if (file == nullptr) return false;
+      const std::vector<HistoryEntry>& entries = file->entries;
+      auto after = std::upper_bound(
+          entries.begin(), entries.end(), time_ms,
+          [](uint64_t t, const HistoryEntry& e) { return t < e.time_ms; });
+      if (after == entries.begin()) return false;
+      auto start = after;
+      do {
+        --start;
+      } while (start != entries.begin() && start->kind != 'C');
+      if (start->kind != 'C') return false;
+      chain.assign(start, after);
+      log_fd = file->log_fd;
+    }
+
+    // The records of one file are contiguous in its log.
+    uint64_t begin = chain.front().offset;
+    std::string records(chain.back().offset + chain.back().length - begin,
+                        '\0');
+    if (!ReadFully(log_fd, &records[0], records.size(), begin)) return false;
+    std::string next;
+    for (const HistoryEntry& record : chain) {
+      std::string data = records.substr(record.offset - begin, record.length);
+      bool ok = true;
+      switch (record.kind) {
+        case 'C':
+          content->swap(data);
+          break;
+        case 'P':
+          ok = ApplyLinePatch(data, *content, &next);
+          content->swap(next);
+          break;
+        case 'A':
+          content->append(data, data.find('\n') + 1, std::string::npos);
+          break;
+        case 'D':
+          ok = ApplyBlockDelta(data, *content, &next);
+          content->swap(next);
+          break;
+        default:
+          ok = false;
+      }
+      if (!ok) return false;
+    }
+    *entry = chain.back();
+    return HashContent(content->data(), content->size()) == entry->hash;
+  }
+
+ private:
+  struct File {
+    int log_fd = -1;
+    int index_fd = -1;
+    uint64_t log_size = 0;
+    std::vector<HistoryEntry> entries;  // committed, oldest first
+  };
+  struct Job {
+    std::string key;
+    HistoryEntry entry;
+    std::string data;
+  };
+  // The newest record queued for a file, kept by the event loop.
+  struct Newest {
+    bool loaded = false;
+    bool empty = true;
+    uint64_t time_ms = 0;
+    uint64_t hash = 0;
+  };
+
+  static bool ReadFully(int fd, char* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+      ssize_t n = pread(fd, data, len, offset);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) continue;
+        return false;
+      }
+      data += n;
+      len -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  static bool WriteFully(int fd, const char* data, size_t len,
+                         uint64_t offset) {
+    while (len > 0) {
+      ssize_t n = pwrite(fd, data, len, offset);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += n;
+      len -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  // Keys may hold '/', so they are escaped into one file name.
+  std::string PathOf(const std::string& key, const char* suffix) const {
+    std::string name;
+    for (char c : key) {
+      if (c == '%')
+        name += "%25";
+      else if (c == '/')
+        name += "%2F";
+      else
+        name.push_back(c);
+    }
+    return dir_ + "/" + name + suffix;
+  }
+
+  // Opens the history of key, reading its index, or returns nullptr. Index
+  // entries past the end of the log, left by a crash, are dropped. Call
+  // with mutex_ held.
+  File* OpenFile(const std::string& key) {
+    std::unique_ptr<File>& file = files_[key];
+    if (file) return file.get();
+    std::unique_ptr<File> opened(new File());
+    opened->log_fd = open(PathOf(key, ".log").c_str(),
+                          O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    opened->index_fd = open(PathOf(key, ".idx").c_str(),
+                            O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat log_st, index_st;
+    if (opened->log_fd < 0 || opened->index_fd < 0 ||
+        fstat(opened->log_fd, &log_st) < 0 ||
+        fstat(opened->index_fd, &index_st) < 0) {
+      perror(PathOf(key, "").c_str());
+      if (opened->log_fd >= 0) close(opened->log_fd);
+      if (opened->index_fd >= 0) close(opened->index_fd);
+      files_.erase(key);
+      return nullptr;
+    }
+    opened->log_size = log_st.st_size;
+    std::vector<HistoryEntry>& entries = opened->entries;
+    entries.resize(index_st.st_size / sizeof(HistoryEntry));
+    if (!ReadFully(opened->index_fd, reinterpret_cast<char*>(entries.data()),
+                   entries.size() * sizeof(HistoryEntry), 0))
+      entries.clear();
+    while (!entries.empty() && entries.back().offset + entries.back().length >
+                                   opened->log_size)
+      entries.pop_back();
+    if (ftruncate(opened->index_fd, entries.size() * sizeof(HistoryEntry)) <
+        0) {
+      // Harmless: the stray bytes are overwritten by the next commit.
+    }
+    file = std::move(opened);
+    return file.get();
+  }
+
+  Newest& NewestOf(const std::string& key) {
+    Newest& newest = newest_[key];
+    if (newest.loaded) return newest;
+    newest.loaded = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    File* file = OpenFile(key);
+    if (file != nullptr && !file->entries.empty()) {
+      newest.empty = false;
+      newest.time_ms = file->entries.back().time_ms;
+      newest.hash = file->entries.back().hash;
+    }
+    return newest;
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wakeup_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      if (jobs_.empty()) return;
+      // Let more records arrive, so they share one sync.
+      if (!stopping_)
+        wakeup_.wait_for(lock, std::chrono::milliseconds(commit_ms_),
+                         [this] { return stopping_; });
+      std::vector<Job> jobs;
+      jobs.swap(jobs_);
+      // Group the records by file, in order.
+      std::vector<File*> order;
+      std::unordered_map<File*, std::pair<std::string,
+                                          std::vector<HistoryEntry>>>
+          batches;
+      for (Job& job : jobs) {
+        File* file = OpenFile(job.key);
+        if (file == nullptr) continue;
+        auto& batch = batches[file];
+        if (batch.second.empty()) order.push_back(file);
+        job.entry.offset = file->log_size + batch.first.size();
+        batch.first += job.data;
+        batch.second.push_back(job.entry);
+      }
+      lock.unlock();
+      std::vector<bool> committed;
+      for (File* file : order) {
+        auto& batch = batches[file];
+        const std::vector<HistoryEntry>& entries = batch.second;
+        // Only this thread writes, so the sizes can be read unlocked.
+        bool ok = WriteFully(file->log_fd, batch.first.data(),
+                             batch.first.size(), file->log_size) &&
+                  fdatasync(file->log_fd) == 0 &&
+                  WriteFully(file->index_fd,
+                             reinterpret_cast<const char*>(entries.data()),
+                             entries.size() * sizeof(HistoryEntry),
+                             file->entries.size() * sizeof(HistoryEntry)) &&
+                  fdatasync(file->index_fd) == 0;
+        if (!ok) perror("history");
+        committed.push_back(ok);
+      }
+      lock.lock();
+      for (size_t i = 0; i < order.size(); i++) {
+        if (!committed[i]) continue;
+        auto& batch = batches[order[i]];
+        order[i]->log_size += batch.first.size();
+        order[i]->entries.insert(order[i]->entries.end(),
+                                 batch.second.begin(), batch.second.end());
+      }
+    }
+  }
+
+  std::string dir_;
+  uint64_t commit_ms_ = 0;
+  std::thread worker_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stopping_ = false;
+  std::vector<Job> jobs_;
+  // Guarded by mutex_, as are the entries of every File.
+  std::unordered_map<std::string, std::unique_ptr<File>> files_;
+  // Only used by the event loop.
+  std::unordered_map<std::string, Newest> newest_;
+};
+
+#endif  // WEBSOCKET_SRC_HISTORY_LOG_H_
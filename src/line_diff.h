@@ -0,0 +1,381 @@
+// Line-based diff between two versions of a monitored file.
+//
+// The previous version is kept only as one 64-bit hash per line, so the
+// monitor does not have to hold on to old content in order to diff it. The
+// new version is compared against those hashes with the linear-space form
+// of Myers' O(ND) algorithm, after trimming the common prefix and suffix,
+// and the edits are encoded as a patch message for the page script.
+//
+// A file is a sequence of lines split at '\n'. The last line is whatever
+// follows the final '\n' (possibly empty), so joining the lines with '\n'
+// gives back the content exactly. This is also what String.split('\n') does
+// in the page script.
+
+#ifndef WEBSOCKET_SRC_LINE_DIFF_H_
+#define WEBSOCKET_SRC_LINE_DIFF_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// --- Per-line hashes and offsets of one file version ---
+// Files that are only appended to keep the offsets alone, as a line index.
+struct LineTable {
+  std::vector<uint64_t> hashes;
+  // offsets[i] is where line i starts; offsets[LineCount()] is one past the
+  // end of the content plus one, so line i always spans
+  // [offsets[i], offsets[i + 1] - 1).
+  std::vector<size_t> offsets;
+
+  size_t LineCount() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+  // Length of the content the table was built from.
+  size_t ContentSize() const {
+    return offsets.empty() ? 0 : offsets.back() - 1;
+  }
+};
+
+// Replaces old lines [old_start, old_start + old_count) with new lines
+// [new_start, new_start + new_count).
+struct LineEdit {
+  size_t old_start;
+  size_t old_count;
+  size_t new_start;
+  size_t new_count;
+};
+
+// 64-bit FNV-1a of one line.
+inline uint64_t HashLine(const char* data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// --- Build the line table of a file version ---
+inline void BuildLineTable(const char* data, size_t len, LineTable* table) {
+  table->hashes.clear();
+  table->offsets.clear();
+  size_t start = 0;
+  while (true) {
+    const void* nl = memchr(data + start, '\n', len - start);
+    size_t end = nl ? static_cast<const char*>(nl) - data : len;
+    table->offsets.push_back(start);
+    table->hashes.push_back(HashLine(data + start, end - start));
+    if (nl == nullptr) break;
+    start = end + 1;
+  }
+  table->offsets.push_back(len + 1);
+}
+
+// --- Build only the line offsets of a file version ---
+inline void BuildLineOffsets(const char* data, size_t len, LineTable* table) {
+  table->hashes.clear();
+  table->offsets.clear();
+  table->offsets.push_back(0);
+  const char* end = data + len;
+  for (const char* p = data;
+       (p = static_cast<const char*>(memchr(p, '\n', end - p))) != nullptr;) {
+    p++;
+    table->offsets.push_back(p - data);
+  }
+  table->offsets.push_back(len + 1);
+}
+
+// --- Extend the line offsets after an append ---
+// appended holds the len bytes added at the end of the content. Only the
+// offsets are kept up to date.
+inline void AppendLineOffsets(const char* appended, size_t len,
+                              LineTable* table) {
+  size_t old_len = table->ContentSize();
+  if (table->offsets.empty())
+    table->offsets.push_back(0);
+  else
+    table->offsets.pop_back();  // The end marker.
+  const char* end = appended + len;
+  for (const char* p = appended;
+       (p = static_cast<const char*>(memchr(p, '\n', end - p))) != nullptr;) {
+    p++;
+    table->offsets.push_back(old_len + (p - appended));
+  }
+  table->offsets.push_back(old_len + len + 1);
+}
+
+// --- Diff two line tables ---
+// Scratch space of the middle snake search, sized once per diff: the
+// furthest x reached on every diagonal, forward and backward.
+struct MyersScratch {
+  long max_half_d;
+  std::vector<long> forward;
+  std::vector<long> backward;
+};
+
+// Appends the edit replacing old lines [old_start, old_start + old_count)
+// with new lines [new_start, new_start + new_count), merged into the last
+// edit if that one ends right where this one starts.
+inline void AppendLineEdit(size_t old_start, size_t old_count, size_t new_start,
+                           size_t new_count, std::vector<LineEdit>* edits) {
+  if (!edits->empty()) {
+    LineEdit& last = edits->back();
+    if (last.old_start + last.old_count == old_start &&
+        last.new_start + last.new_count == new_start) {
+      last.old_count += old_count;
+      last.new_count += new_count;
+      return;
+    }
+  }
+  edits->push_back({old_start, old_count, new_start, new_count});
+}
+
+// Finds the middle snake of a shortest edit script from a[0, n) to b[0, m),
+// walking from both ends at once, and sets (*split_x, *split_y) to a point
+// on it, or *split_x to -1 if a and b have no line in common. Returns false
+// if the script needs more than about 2 * scratch->max_half_d edits.
+inline bool FindMiddleSnake(const uint64_t* a, long n, const uint64_t* b,
+                            long m, MyersScratch* scratch, long* split_x,
+                            long* split_y) {
+  long max_d = (n + m + 1) / 2;
+  bool capped = max_d > scratch->max_half_d;
+  if (capped) max_d = scratch->max_half_d;
+  const long offset = max_d;
+  const long length = 2 * max_d + 2;
+  // forward[offset + k] is the furthest x on diagonal k = x - y from the
+  // start; backward[offset + k] the same measured from the end.
+  long* v1 = scratch->forward.data();
+  long* v2 = scratch->backward.data();
+  std::fill(v1, v1 + length, -1);
+  std::fill(v2, v2 + length, -1);
+  v1[offset + 1] = 0;
+  v2[offset + 1] = 0;
+  const long delta = n - m;
+  // With an odd delta the paths can only meet after a forward step.
+  const bool front = (delta & 1) != 0;
+  long k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+  for (long d = 0; d < max_d; d++) {
+    for (long k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+      long k1_offset = offset + k1;
+      long x1;
+      if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+        x1 = v1[k1_offset + 1];
+      else
+        x1 = v1[k1_offset - 1] + 1;
+      long y1 = x1 - k1;
+      while (x1 < n && y1 < m && a[x1] == b[y1]) {
+        x1++;
+        y1++;
+      }
+      v1[k1_offset] = x1;
+      if (x1 > n) {
+        k1_end += 2;  // Ran off the right edge.
+      } else if (y1 > m) {
+        k1_start += 2;  // Ran off the bottom edge.
+      } else if (front) {
+        long k2_offset = offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < length && v2[k2_offset] != -1 &&
+            x1 >= n - v2[k2_offset]) {
+          *split_x = x1;
+          *split_y = y1;
+          return true;
+        }
+      }
+    }
+    for (long k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+      long k2_offset = offset + k2;
+      long x2;
+      if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+        x2 = v2[k2_offset + 1];
+      else
+        x2 = v2[k2_offset - 1] + 1;
+      long y2 = x2 - k2;
+      while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+        x2++;
+        y2++;
+      }
+      v2[k2_offset] = x2;
+      if (x2 > n) {
+        k2_end += 2;
+      } else if (y2 > m) {
+        k2_start += 2;
+      } else if (!front) {
+        long k1_offset = offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < length && v1[k1_offset] != -1) {
+          long x1 = v1[k1_offset];
+          if (x1 >= n - x2) {
+            *split_x = x1;
+            *split_y = offset + x1 - k1_offset;
+            return true;
+          }
+        }
+      }
+    }
+  }
+  // Only a script that replaces everything is that long.
+  *split_x = -1;
+  return !capped;
+}
+
+// Appends the edits turning a[0, n) into b[0, m), whose first lines are
+// old_start and new_start of the whole files. Splits at the middle snake
+// and recurses, so memory stays linear in the number of edits.
+inline bool DiffLineRange(const uint64_t* a, long n, const uint64_t* b,
+                          long m, size_t old_start, size_t new_start,
+                          MyersScratch* scratch,
+                          std::vector<LineEdit>* edits) {
+  while (n > 0 && m > 0 && *a == *b) {
+    a++;
+    b++;
+    n--;
+    m--;
+    old_start++;
+    new_start++;
+  }
+  while (n > 0 && m > 0 && a[n - 1] == b[m - 1]) {
+    n--;
+    m--;
+  }
+  if (n == 0 || m == 0) {
+    if (n + m > 0) AppendLineEdit(old_start, n, new_start, m, edits);
+    return true;
+  }
+  long x, y;
+  if (!FindMiddleSnake(a, n, b, m, scratch, &x, &y)) return false;
+  if (x < 0) {
+    AppendLineEdit(old_start, n, new_start, m, edits);
+    return true;
+  }
+  return DiffLineRange(a, x, b, y, old_start, new_start, scratch, edits) &&
+         DiffLineRange(a + x, n - x, b + y, m - y, old_start + x,
+                       new_start + y, scratch, edits);
+}
+
+// Computes the edits that turn old_lines into new_lines. Gives up and returns
+// false when the diff would need more than max_edits inserted plus deleted
+// lines, or more than max_work comparisons; the caller then falls back to a
+// full snapshot.
+inline bool DiffLines(const std::vector<uint64_t>& old_lines,
+                      const std::vector<uint64_t>& new_lines, size_t max_edits,
+                      size_t max_work, std::vector<LineEdit>* edits) {
+  edits->clear();
+  size_t prefix = 0;
+  while (prefix < old_lines.size() && prefix < new_lines.size() &&
+         old_lines[prefix] == new_lines[prefix])
+    prefix++;
+  size_t suffix = 0;
+  while (suffix < old_lines.size() - prefix &&
+         suffix < new_lines.size() - prefix &&
+         old_lines[old_lines.size() - 1 - suffix] ==
+             new_lines[new_lines.size() - 1 - suffix])
+    suffix++;
+  const long n = old_lines.size() - prefix - suffix;
+  const long m = new_lines.size() - prefix - suffix;
+  if (n == 0 && m == 0) return true;
+  if (n == 0 || m == 0) {
+    if (static_cast<size_t>(n + m) > max_edits) return false;
+    edits->push_back({prefix, static_cast<size_t>(n), prefix,
+                      static_cast<size_t>(m)});
+    return true;
+  }
+
+  // Linear-space Myers: the search is bounded by the edit budget, and only
+  // keeps one row of diagonals per direction.
+  long max_d = n + m;
+  if (static_cast<size_t>(max_d) > max_edits) max_d = max_edits;
+  if (static_cast<size_t>(max_d) > max_work / (n + m))
+    max_d = max_work / (n + m);
+  MyersScratch scratch;
+  scratch.max_half_d = (max_d + 1) / 2 + 1;
+  scratch.forward.resize(2 * scratch.max_half_d + 2);
+  scratch.backward.resize(2 * scratch.max_half_d + 2);
+  if (!DiffLineRange(old_lines.data() + prefix, n, new_lines.data() + prefix,
+                     m, prefix, prefix, &scratch, edits)) {
+    edits->clear();
+    return false;
+  }
+  size_t changed = 0;
+  for (const LineEdit& edit : *edits)
+    changed += edit.old_count + edit.new_count;
+  if (changed > max_edits) {
+    edits->clear();
+    return false;
+  }
+  return true;
+}
+
+// --- Encode a patch message ---
+// "P<base> <version>\n" followed, for every edit, by the line
+// "<old_start> <old_count> <new_count>\n" and the new_count inserted lines,
+// each terminated by '\n'. The page applies the edits back to front so the
+// old line numbers stay valid.
+inline std::string EncodeLinePatch(uint64_t base, uint64_t version,
+                                   const std::vector<LineEdit>& edits,
+                                   const LineTable& new_table,
+                                   const char* new_data) {
+  std::string patch =
+      "P" + std::to_string(base) + " " + std::to_string(version) + "\n";
+  for (const LineEdit& edit : edits) {
+    patch += std::to_string(edit.old_start) + " " +
+             std::to_string(edit.old_count) + " " +
+             std::to_string(edit.new_count) + "\n";
+    size_t begin = new_table.offsets[edit.new_start];
+    size_t end = new_table.offsets[edit.new_start + edit.new_count];
+    // The inserted lines plus one '\n' each. The last line of the file has
+    // no '\n' of its own, so the terminator is added explicitly.
+    if (end > begin) {
+      patch.append(new_data + begin, end - begin - 1);
+      patch.push_back('\n');
+    }
+  }
+  return patch;
+}
+
+// --- Apply a patch message ---
+// What the page script does, for rebuilding past versions: writes the
+// version patch makes from old to out. Returns false if the patch does not
+// fit old.
+inline bool ApplyLinePatch(const std::string& patch, const std::string& old,
+                           std::string* out) {
+  LineTable table;
+  BuildLineOffsets(old.data(), old.size(), &table);
+  out->clear();
+  bool empty = true;
+  auto put_line = [&](const char* data, size_t len) {
+    if (!empty) out->push_back('\n');
+    out->append(data, len);
+    empty = false;
+  };
+  auto put_old_lines = [&](size_t from, size_t to) {
+    for (size_t i = from; i < to; i++)
+      put_line(old.data() + table.offsets[i],
+               table.offsets[i + 1] - 1 - table.offsets[i]);
+  };
+  size_t pos = patch.find('\n');
+  if (pos == std::string::npos) return false;
+  pos++;
+  size_t copied = 0;  // old lines before this one are done
+  while (pos < patch.size()) {
+    char* end;
+    size_t old_start = std::strtoull(patch.c_str() + pos, &end, 10);
+    size_t old_count = std::strtoull(end, &end, 10);
+    size_t new_count = std::strtoull(end, &end, 10);
+    if (*end != '\n' || old_start < copied ||
+        old_start + old_count > table.LineCount())
+      return false;
+    pos = end - patch.c_str() + 1;
+    put_old_lines(copied, old_start);
+    copied = old_start + old_count;
+    for (size_t i = 0; i < new_count; i++) {
+      size_t nl = patch.find('\n', pos);
+      if (nl == std::string::npos) return false;
+      put_line(patch.data() + pos, nl - pos);
+      pos = nl + 1;
+    }
+  }
+  put_old_lines(copied, table.LineCount());
+  return true;
+}
+
+#endif  // WEBSOCKET_SRC_LINE_DIFF_H_
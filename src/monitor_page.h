@@ -0,0 +1,602 @@
+// HTML pages served by the file monitor.
+//
+// The page text lives here as raw string literals so the script reads as
+// JavaScript. Rendering is plain appends into one preallocated string: the
+// file content is HTML-escaped in runs between special characters, so a
+// page costs about one pass over the file.
+
+#ifndef WEBSOCKET_SRC_MONITOR_PAGE_H_
+#define WEBSOCKET_SRC_MONITOR_PAGE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// --- Page embedding the whole file ---
+// The content goes between kFullPageHead and kFullPageScript, the version
+// between kFullPageScript and kFullPageInstance, the instance of the monitor
+// between kFullPageInstance and kFullPageHistory, and the URL of the history
+// of the file, or nothing, between kFullPageHistory and kFullPageTail.
+// kFullPageHead ends in a newline after <pre>: the HTML parser drops the
+// first one there, which would otherwise be the content's own.
+const char kFullPageHead[] = R"(<html>
+<head>
+  <meta charset="UTF-8">
+  <title>File Monitor</title>
+  <style>
+    body {
+      margin: 0; padding: 0; display: flex; align-items: center;
+      justify-content: center; height: 100vh; background-color: #f7f7f7;
+      font-family: Arial, sans-serif;
+    }
+    .container { width: 80%; max-width: 800px; text-align: center; }
+    pre {
+      background: #eee; padding: 20px; border: 1px solid #ccc;
+      overflow: auto; text-align: left;
+    }
+    #slider { width: 70%; vertical-align: middle; }
+  </style>
+</head>
+<body>
+  <div class="container">
+    <h1>File Monitor</h1>
+    <div id="history" hidden>
+      <input type="range" id="slider"> <span id="when">live</span>
+    </div>
+    <pre id="content">
+)";
+
+const char kFullPageScript[] = R"(</pre>
+  </div>
+  <script>
+    // Version of the text in #content. Patches name the version they
+    // apply to; on a mismatch the page asks for a fresh snapshot.
+    let version = )";
+
+const char kFullPageInstance[] = R"(;
+    // Versions start over when the monitor restarts, so a page resumes from
+    // its version within this run of the monitor.
+    const instance = ')";
+
+const char kFullPageHistory[] = R"(';
+    // Where past versions are fetched from; empty without a history.
+    const historyUrl = ')";
+
+const char kFullPageTail[] = R"(';
+    let lines = null;
+    let syncing = false;
+    const pre = document.getElementById('content');
+    let ws, retries = 0;
+    // The server answers ?since with the changes made after that version,
+    // or a snapshot if it no longer has them all or has restarted since.
+    // Reconnects back off with jitter so pages that lost their connection
+    // together spread out.
+    function connect() {
+      ws = new WebSocket('ws://' + location.host + location.pathname +
+                         '?since=' + instance + '-' + version);
+      ws.onopen = () => { retries = 0; syncing = false; };
+      ws.onmessage = receive;
+      ws.onclose = () => setTimeout(connect,
+          Math.min(30000, 500 * 2 ** retries++) * (0.5 + Math.random()));
+    }
+    function receive(e) {
+      if (live !== null) return;  // Caught up on reconnect.
+      const nl = e.data.indexOf('\n');
+      const head = e.data.substring(0, nl).split(' ');
+      if (head[0] === 'R') return location.reload();
+      if (head[0][0] === 'S') {
+        version = +head[0].substring(1);
+        lines = null;
+        syncing = false;
+        pre.textContent = e.data.substring(nl + 1);
+        return;
+      }
+      if (+head[0].substring(1) !== version) {
+        if (!syncing) ws.send('sync ' + version);
+        syncing = true;
+        return;
+      }
+      version = +head[1];
+      if (head[0][0] === 'A') {
+        // Append: new bytes at the end of the file.
+        lines = null;
+        pre.appendChild(document.createTextNode(e.data.substring(nl + 1)));
+        return;
+      }
+      // Patch: '<old_start> <old_count> <new_count>' lines, each
+      // followed by the new lines; applied back to front.
+      if (lines === null) lines = pre.textContent.split('\n');
+      const parts = e.data.substring(nl + 1).split('\n');
+      const edits = [];
+      for (let i = 0; i + 1 < parts.length;) {
+        const op = parts[i++].split(' ').map(Number);
+        edits.push([op[0], op[1], parts.slice(i, i + op[2])]);
+        i += op[2];
+      }
+      for (let j = edits.length - 1; j >= 0; j--)
+        lines.splice(edits[j][0], edits[j][1], ...edits[j][2]);
+      pre.textContent = lines.join('\n');
+    }
+    // History: the slider runs over the time the history covers, with the
+    // live file one step past its end. While a past version is shown the
+    // page disconnects and keeps the live text aside; back at the end it
+    // reconnects and catches up from the version it had.
+    const slider = document.getElementById('slider');
+    const when = document.getElementById('when');
+    let live = null, timer = null;
+    function extent() {
+      return fetch(historyUrl).then(r => r.json()).then(h => {
+        if (!h.count) return;
+        document.getElementById('history').hidden = false;
+        slider.min = h.first;
+        slider.max = h.last + 1;
+        if (live === null) slider.value = slider.max;
+      });
+    }
+    function showLive() {
+      when.textContent = 'live';
+      if (live === null) return;
+      pre.textContent = live;
+      live = null;
+      lines = null;
+      connect();
+    }
+    function showPast(at) {
+      fetch(historyUrl + '?at=' + at).then(r => {
+        if (!r.ok) return;
+        const time = +r.headers.get('X-History-Time');
+        return r.text().then(text => {
+          // Back to live meanwhile.
+          if (+slider.value > +slider.max - 1) return;
+          if (live === null) {
+            live = pre.textContent;
+            ws.onclose = null;
+            ws.close();
+          }
+          pre.textContent = text;
+          when.textContent = new Date(time).toLocaleString();
+        });
+      });
+    }
+    if (historyUrl) {
+      extent();
+      slider.addEventListener('pointerdown', extent);
+      slider.addEventListener('input', () => {
+        clearTimeout(timer);
+        timer = setTimeout(() => {
+          if (+slider.value >= +slider.max) showLive();
+          else showPast(slider.value);
+        }, 100);
+      });
+    }
+    connect();
+  </script>
+</body>
+</html>
+)";
+
+// --- Page showing a window of a large file ---
+// It holds no content; the script sizes a spacer to the line count and asks
+// for the lines in view (plus a margin) whenever scrolling leaves the window
+// it has. While scrolled to the bottom it follows the end of the file. The
+// version and line count go after kWindowedPageHead, separated by
+// kWindowedPageTotal.
+const char kWindowedPageHead[] = R"(<html>
+<head>
+  <meta charset="UTF-8">
+  <title>File Monitor</title>
+  <style>
+    body {
+      margin: 0; padding: 0; background-color: #f7f7f7;
+      font-family: Arial, sans-serif; text-align: center;
+    }
+    #box {
+      position: relative; width: 80%; height: 80vh; margin: 0 auto;
+      overflow: auto; background: #eee; border: 1px solid #ccc;
+      text-align: left;
+    }
+    #content {
+      position: absolute; left: 0; margin: 0; padding: 0 20px;
+      font-size: 13px; line-height: 16px; white-space: pre;
+    }
+  </style>
+</head>
+<body>
+  <h1>File Monitor</h1>
+  <div id="box"><div id="spacer"></div><pre id="content"></pre></div>
+  <script>
+    const LINE = 16, MARGIN = 200;
+    let version = )";
+
+const char kWindowedPageTotal[] = R"(, total = )";
+
+const char kWindowedPageTail[] = R"(;
+    let first = 0, count = 0;
+    let following = true, inflight = false, again = false;
+    const box = document.getElementById('box');
+    const spacer = document.getElementById('spacer');
+    const pre = document.getElementById('content');
+    spacer.style.height = total * LINE + 'px';
+    let ws, retries = 0;
+    function connect() {
+      ws = new WebSocket('ws://' + location.host + location.pathname);
+      ws.onopen = () => {
+        retries = 0;
+        inflight = again = false;
+        resize(total);
+        request(true);
+      };
+      ws.onmessage = receive;
+      ws.onclose = () => setTimeout(connect,
+          Math.min(30000, 500 * 2 ** retries++) * (0.5 + Math.random()));
+    }
+    function request(force) {
+      const top = Math.floor(box.scrollTop / LINE);
+      const rows = Math.ceil(box.clientHeight / LINE) + 1;
+      if (!force && count > 0 && top >= first &&
+          Math.min(top + rows, total) <= first + count) return;
+      if (inflight) { again = true; return; }
+      inflight = true;
+      const start = Math.max(0, top - MARGIN);
+      ws.send('view ' + start + ' ' + (top + rows + MARGIN - start));
+    }
+    function resize(lines) {
+      total = lines;
+      spacer.style.height = total * LINE + 'px';
+      if (following) box.scrollTop = total * LINE;
+    }
+    box.onscroll = () => {
+      following = box.scrollTop + box.clientHeight >= box.scrollHeight - LINE;
+      request(false);
+    };
+    function receive(e) {
+      const nl = e.data.indexOf('\n');
+      const head = e.data.substring(0, nl).split(' ');
+      if (head[0] === 'R') return location.reload();
+      version = +head[0].substring(1);
+      if (head[0][0] === 'T') {
+        // Only the line count changed.
+        resize(+head[1]);
+        request(false);
+        return;
+      }
+      // 'W<version> <first> <count> <total>' and the lines.
+      first = +head[1];
+      count = +head[2];
+      pre.textContent = e.data.substring(nl + 1);
+      pre.style.top = first * LINE + 'px';
+      resize(+head[3]);
+      inflight = false;
+      if (again) { again = false; request(true); }
+      else request(false);
+    }
+    connect();
+  </script>
+</body>
+</html>
+)";
+
+// --- Page showing a binary file ---
+// The page keeps its own copy of the file, received as a binary snapshot
+// over the WebSocket and then patched with block deltas (see block_diff.h),
+// and shows a hex dump of its start. The version goes after
+// kBinaryPageHead and the instance of the monitor after kBinaryPageInstance.
+const char kBinaryPageHead[] = R"(<html>
+<head>
+  <meta charset="UTF-8">
+  <title>File Monitor</title>
+  <style>
+    body {
+      margin: 0; padding: 0; background-color: #f7f7f7;
+      font-family: Arial, sans-serif; text-align: center;
+    }
+    #info { margin: 8px; }
+    #content {
+      width: 80%; margin: 0 auto; padding: 20px; background: #eee;
+      border: 1px solid #ccc; overflow: auto; text-align: left;
+      font-size: 13px;
+    }
+  </style>
+</head>
+<body>
+  <h1>File Monitor</h1>
+  <div id="info"></div>
+  <pre id="content"></pre>
+  <script>
+    const DUMP_BYTES = 4096;
+    let version = )";
+
+const char kBinaryPageInstance[] = R"(, instance = ')";
+
+const char kBinaryPageTail[] = R"(';
+    let data = null;
+    let syncing = false;
+    const info = document.getElementById('info');
+    const pre = document.getElementById('content');
+    function hex(n, width) { return n.toString(16).padStart(width, '0'); }
+    function render(changed) {
+      let text = '';
+      const end = Math.min(data.length, DUMP_BYTES);
+      for (let row = 0; row < end; row += 16) {
+        let bytes = '', chars = '';
+        for (let i = row; i < row + 16; i++) {
+          bytes += i < end ? hex(data[i], 2) + ' ' : '   ';
+          if (i < end)
+            chars += data[i] >= 32 && data[i] < 127 ?
+                String.fromCharCode(data[i]) : '.';
+        }
+        text += hex(row, 8) + '  ' + bytes + ' ' + chars + '\n';
+      }
+      pre.textContent = text;
+      info.textContent = data.length + ' bytes, version ' + version +
+          (changed.length ? '; changed: ' + changed.map(
+              c => hex(c[0], 1) + '+' + c[1]).join(', ') : '');
+    }
+    let ws, retries = 0;
+    // A page without a copy asks for everything with ?since=0.
+    function connect() {
+      ws = new WebSocket('ws://' + location.host + location.pathname +
+                         '?since=' + (data ? instance + '-' + version : 0));
+      ws.binaryType = 'arraybuffer';
+      ws.onopen = () => { retries = 0; syncing = false; };
+      ws.onmessage = receive;
+      ws.onclose = () => setTimeout(connect,
+          Math.min(30000, 500 * 2 ** retries++) * (0.5 + Math.random()));
+    }
+    function receive(e) {
+      if (typeof e.data === 'string') {
+        if (e.data[0] === 'R') location.reload();
+        return;
+      }
+      const view = new DataView(e.data);
+      const kind = String.fromCharCode(view.getUint8(0));
+      if (kind === 'B') {
+        // Snapshot: 'B' u64 version, then the content.
+        version = Number(view.getBigUint64(1, true));
+        data = new Uint8Array(e.data.slice(9));
+        syncing = false;
+        render([]);
+        return;
+      }
+      // Delta: 'D' u64 base, u64 version, u64 size, u32 block size, then
+      // copy (1 u32 first u32 count) and literal (2 u32 length bytes) ops.
+      if (data === null || Number(view.getBigUint64(1, true)) !== version) {
+        if (!syncing) ws.send('sync ' + (data ? version : 0));
+        syncing = true;
+        return;
+      }
+      const next = Number(view.getBigUint64(9, true));
+      const out = new Uint8Array(Number(view.getBigUint64(17, true)));
+      const block = view.getUint32(25, true);
+      const changed = [];
+      let pos = 29, at = 0;
+      while (pos < view.byteLength) {
+        if (view.getUint8(pos) === 1) {
+          const first = view.getUint32(pos + 1, true);
+          const count = view.getUint32(pos + 5, true);
+          const from = data.subarray(first * block, (first + count) * block);
+          out.set(from, at);
+          at += from.length;
+          pos += 9;
+        } else {
+          const length = view.getUint32(pos + 1, true);
+          out.set(new Uint8Array(e.data, pos + 5, length), at);
+          changed.push([at, length]);
+          at += length;
+          pos += 5 + length;
+        }
+      }
+      data = out;
+      version = next;
+      render(changed);
+    }
+    connect();
+  </script>
+</body>
+</html>
+)";
+
+// --- Page showing a rendered file ---
+// The server renders Markdown and source files to HTML fragments (see
+// fragment_render.h); each fragment is one child element of #rendered.
+// Updates replace ranges of children, in the line patch format with
+// fragments for lines. The class of #rendered goes after kRenderedPageHead,
+// the fragments after kRenderedPageBody, the version after
+// kRenderedPageScript and the instance of the monitor after
+// kRenderedPageInstance.
+const char kRenderedPageHead[] = R"(<html>
+<head>
+  <meta charset="UTF-8">
+  <title>File Monitor</title>
+  <style>
+    body {
+      margin: 0; padding: 0; background-color: #f7f7f7;
+      font-family: Arial, sans-serif;
+    }
+    h1 { text-align: center; }
+    #rendered {
+      width: 80%; max-width: 860px; margin: 0 auto 20px; padding: 20px;
+      background: #fff; border: 1px solid #ccc; overflow: auto;
+    }
+    .markdown pre { background: #eee; padding: 10px; overflow: auto; }
+    .markdown code { background: #eee; }
+    .markdown blockquote { color: #555; border-left: 4px solid #ccc;
+                           margin-left: 0; padding-left: 12px; }
+    .markdown img { max-width: 100%; }
+    .code { font-family: monospace; font-size: 13px; white-space: pre; }
+    .code div { min-height: 1.2em; }
+    .code .k { color: #00c; font-weight: bold; }
+    .code .s { color: #a31515; }
+    .code .c { color: #080; }
+    .code .n { color: #905; }
+  </style>
+</head>
+<body>
+  <h1>File Monitor</h1>
+  <div id="rendered" class=")";
+
+const char kRenderedPageBody[] = R"(">)";
+
+const char kRenderedPageScript[] = R"(</div>
+  <script>
+    let version = )";
+
+const char kRenderedPageInstance[] = R"(, instance = ')";
+
+const char kRenderedPageTail[] = R"(';
+    let syncing = false;
+    const box = document.getElementById('rendered');
+    let ws, retries = 0;
+    function connect() {
+      ws = new WebSocket('ws://' + location.host + location.pathname +
+                         '?since=' + instance + '-' + version);
+      ws.onopen = () => { retries = 0; syncing = false; };
+      ws.onmessage = receive;
+      ws.onclose = () => setTimeout(connect,
+          Math.min(30000, 500 * 2 ** retries++) * (0.5 + Math.random()));
+    }
+    // Turns '\n'-separated fragments into elements.
+    function elements(fragments) {
+      const t = document.createElement('template');
+      t.innerHTML = fragments.join('');
+      return Array.from(t.content.children);
+    }
+    function receive(e) {
+      const nl = e.data.indexOf('\n');
+      const head = e.data.substring(0, nl).split(' ');
+      if (head[0] === 'R') return location.reload();
+      if (head[0][0] === 'M') {
+        // All fragments of a version.
+        version = +head[0].substring(1);
+        syncing = false;
+        box.replaceChildren(...elements(e.data.substring(nl + 1).split('\n')));
+        return;
+      }
+      if (+head[0].substring(1) !== version) {
+        if (!syncing) ws.send('sync ' + version);
+        syncing = true;
+        return;
+      }
+      version = +head[1];
+      // 'H': '<old_start> <old_count> <new_count>' lines, each followed
+      // by the new fragments; applied back to front.
+      const parts = e.data.substring(nl + 1).split('\n');
+      const edits = [];
+      for (let i = 0; i + 1 < parts.length;) {
+        const op = parts[i++].split(' ').map(Number);
+        edits.push([op[0], op[1], parts.slice(i, i + op[2])]);
+        i += op[2];
+      }
+      for (let j = edits.length - 1; j >= 0; j--) {
+        const [start, count, fragments] = edits[j];
+        for (let k = 0; k < count; k++) box.children[start].remove();
+        const next = box.children[start] || null;
+        for (const el of elements(fragments)) box.insertBefore(el, next);
+      }
+    }
+    connect();
+  </script>
+</body>
+</html>
+)";
+
+// --- Escape text for HTML ---
+// Appends data to out with &, <, >, " and ' replaced by entities, so it is
+// safe in element content and in attribute values.
+inline void AppendHtmlEscaped(std::string* out, const char* data, size_t len) {
+  size_t run = 0;
+  for (size_t i = 0; i < len; i++) {
+    const char* entity;
+    switch (data[i]) {
+      case '&':
+        entity = "&amp;";
+        break;
+      case '<':
+        entity = "&lt;";
+        break;
+      case '>':
+        entity = "&gt;";
+        break;
+      case '"':
+        entity = "&quot;";
+        break;
+      case '\'':
+        entity = "&#39;";
+        break;
+      default:
+        continue;
+    }
+    out->append(data + run, i - run);
+    out->append(entity);
+    run = i + 1;
+  }
+  out->append(data + run, len - run);
+}
+
+inline std::string HtmlEscape(const char* data, size_t len) {
+  std::string out;
+  AppendHtmlEscaped(&out, data, len);
+  return out;
+}
+
+// --- Render the page embedding the whole file ---
+// instance and history_url must not need escaping in a JavaScript string;
+// a hex tag and a percent-encoded path do not.
+inline void RenderFullPage(const char* content, size_t len, uint64_t version,
+                           const std::string& instance,
+                           const std::string& history_url, std::string* out) {
+  // Escaping rarely grows text by much; one reserve covers most files.
+  out->reserve(out->size() + sizeof(kFullPageHead) + len + len / 16 +
+               sizeof(kFullPageScript) + 20 + sizeof(kFullPageInstance) +
+               instance.size() + sizeof(kFullPageHistory) +
+               history_url.size() + sizeof(kFullPageTail));
+  out->append(kFullPageHead);
+  AppendHtmlEscaped(out, content, len);
+  out->append(kFullPageScript);
+  out->append(std::to_string(version));
+  out->append(kFullPageInstance);
+  out->append(instance);
+  out->append(kFullPageHistory);
+  out->append(history_url);
+  out->append(kFullPageTail);
+}
+
+// --- Render the page showing a window of a large file ---
+inline void RenderWindowedPage(uint64_t version, size_t total_lines,
+                               std::string* out) {
+  out->append(kWindowedPageHead);
+  out->append(std::to_string(version));
+  out->append(kWindowedPageTotal);
+  out->append(std::to_string(total_lines));
+  out->append(kWindowedPageTail);
+}
+
+// --- Render the page showing a binary file ---
+inline void RenderBinaryPage(uint64_t version, const std::string& instance,
+                             std::string* out) {
+  out->append(kBinaryPageHead);
+  out->append(std::to_string(version));
+  out->append(kBinaryPageInstance);
+  out->append(instance);
+  out->append(kBinaryPageTail);
+}
+
+// --- Render the page showing a rendered file ---
+// style_class is the class of #rendered; fragments are its children.
+inline void RenderRenderedPage(
+    uint64_t version, const std::string& instance, const char* style_class,
+    const std::vector<std::shared_ptr<const std::string>>& fragments,
+    std::string* out) {
+  out->append(kRenderedPageHead);
+  out->append(style_class);
+  out->append(kRenderedPageBody);
+  for (const auto& fragment : fragments) out->append(*fragment);
+  out->append(kRenderedPageScript);
+  out->append(std::to_string(version));
+  out->append(kRenderedPageInstance);
+  out->append(instance);
+  out->append(kRenderedPageTail);
+}
+
+#endif  // WEBSOCKET_SRC_MONITOR_PAGE_H_
@@ -0,0 +1,166 @@
+// Background gzip compression of rendered pages for the file monitor.
+//
+// Compressing the page of a large file takes milliseconds, which the event
+// loop cannot spend without holding back WebSocket updates. Pages are handed
+// to a worker thread instead. Finished pages are collected by the event
+// loop, which learns about them by selecting on fd(). A job still queued for
+// a file is replaced when a newer version of its page is submitted, so a
+// quickly changing file does not build up a backlog.
+
+#ifndef WEBSOCKET_SRC_PAGE_COMPRESSOR_H_
+#define WEBSOCKET_SRC_PAGE_COMPRESSOR_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// --- Compress data into out as a gzip stream ---
+inline bool GzipCompress(const std::string& data, int level, std::string* out) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  // 16 added to the window bits selects the gzip wrapper.
+  if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  out->resize(deflateBound(&stream, data.size()));
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  stream.avail_out = out->size();
+  int result = deflate(&stream, Z_FINISH);
+  out->resize(stream.total_out);
+  deflateEnd(&stream);
+  return result == Z_STREAM_END;
+}
+
+class PageCompressor {
+ public:
+  struct Result {
+    std::string key;
+    uint64_t version;
+    std::string gzip;
+  };
+
+  PageCompressor() = default;
+  PageCompressor(const PageCompressor&) = delete;
+  PageCompressor& operator=(const PageCompressor&) = delete;
+  ~PageCompressor() { Stop(); }
+
+  // Starts the worker thread. Returns false if it cannot be signalled.
+  bool Start(int level) {
+    if (worker_.joinable()) return true;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) return false;
+    wake_read_ = fds[0];
+    wake_write_ = fds[1];
+    level_ = level;
+    stopping_ = false;
+    worker_ = std::thread(&PageCompressor::Run, this);
+    return true;
+  }
+
+  // Finishes the job in progress, drops the queued ones and joins the
+  // worker thread.
+  void Stop() {
+    if (!worker_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      jobs_.clear();
+    }
+    wakeup_.notify_one();
+    worker_.join();
+    close(wake_read_);
+    close(wake_write_);
+    wake_read_ = wake_write_ = -1;
+  }
+
+  // Readable while finished pages are waiting to be collected.
+  int fd() const { return wake_read_; }
+
+  // Queues version of the page stored under key for compression.
+  void Submit(const std::string& key, uint64_t version,
+              const std::shared_ptr<const std::string>& page) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      bool replaced = false;
+      for (Job& job : jobs_) {
+        if (job.key != key) continue;
+        job.version = version;
+        job.page = page;
+        replaced = true;
+        break;
+      }
+      if (!replaced) jobs_.push_back(Job{key, version, page});
+    }
+    wakeup_.notify_one();
+  }
+
+  // Calls on_done with every page finished since the last call.
+  void Collect(const std::function<void(Result*)>& on_done) {
+    char drain[64];
+    while (read(wake_read_, drain, sizeof(drain)) > 0) {
+    }
+    std::vector<Result> results;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      results.swap(results_);
+    }
+    for (Result& result : results) on_done(&result);
+  }
+
+ private:
+  struct Job {
+    std::string key;
+    uint64_t version;
+    std::shared_ptr<const std::string> page;
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wakeup_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      if (stopping_) return;
+      Job job = std::move(jobs_.front());
+      jobs_.pop_front();
+      lock.unlock();
+      Result result;
+      bool ok = GzipCompress(*job.page, level_, &result.gzip);
+      job.page.reset();
+      lock.lock();
+      if (!ok) continue;
+      result.key = std::move(job.key);
+      result.version = job.version;
+      results_.push_back(std::move(result));
+      char byte = 0;
+      if (write(wake_write_, &byte, 1) < 0) {
+        // The pipe is full, so the event loop has a wakeup pending anyway.
+      }
+    }
+  }
+
+  int wake_read_ = -1;
+  int wake_write_ = -1;
+  int level_ = Z_DEFAULT_COMPRESSION;
+  std::thread worker_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stopping_ = false;
+  std::deque<Job> jobs_;
+  std::vector<Result> results_;
+};
+
+#endif  // WEBSOCKET_SRC_PAGE_COMPRESSOR_H_
@@ -5,245 +5,1714 @@
 // an HTTP server that serves the file content. WebSocket connections are used
 // to push live updates to the webpage.
 //
-// Usage: realtime_file_monitor <file-path>
+// Usage: realtime_file_monitor [--tail] [--poll] [--debounce=<ms>]
+//                               [--max-latency=<ms>] [--cache-mb=<n>]
+//                               [--history=<dir>] [--render] [--port=<n>]
+//                               [--broker=<socket> | --attach=<socket>]
+//                               <path>
+//
+// path is a file or a directory. For a directory, every file below it is
+// served at its relative path (http://host:8080/sub/file.txt), directories
+// get a listing, and each page only receives updates for its own file. The
+// content of files nobody is watching is kept in an LRU cache of at most
+// --cache-mb megabytes (default 256).
+//
+// Files of WINDOWED_PAGE_BYTES or more are not embedded in the page. The page
+// asks for the lines in view over the WebSocket as it scrolls, and is only
+// sent updates that touch those lines.
+//
+// With --tail the file is treated as an append-only log: only the bytes
+// appended since the last read are sent to the page.
+//
+// Change events are coalesced: the file is reloaded once it has been quiet
+// for the debounce window (default 30 ms), but never later than the max
+// latency (default 250 ms) after the first unprocessed event.
+//
+// On network and FUSE filesystems, where inotify does not see changes made
+// elsewhere, or with --poll, files are polled with stat() instead.
+//
+// With --history every published version is also recorded in dir, and the
+// page gets a slider to look at past versions.
+//
+// With --render, Markdown files are shown as HTML and source files with their
+// syntax highlighted, rendered on the server. Only the blocks or lines that
+// changed are rendered again, and pages are sent just those.
+//
+// Monitors on one host can share the files they watch: one started with
+// --broker listens on a Unix socket, and others started with --attach take
+// file content from it through shared memory (see shared_snapshot.h) instead
+// of watching and reading the files themselves.
 
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
-#include <sys/inotify.h>
-#include <sys/select.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <strings.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
+#include <deque>
 #include <iostream>
-#include <list>
-#include <sstream>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
-#define PORT 8080
+#include "block_diff.h"
+#include "core.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "fragment_render.h"
+#include "history_log.h"
+#include "line_diff.h"
+#include "monitor_page.h"
+#include "page_compressor.h"
+#include "shared_snapshot.h"
+#include "stat_poller.h"
+#include "tree_watcher.h"
+#include "util.h"
+
+#define PORT 8080  // unless --port is given
 #define BUFFER_SIZE 1024
-#define EVENT_BUF_LEN (1024 * (sizeof(struct inotify_event) + 16))
+// Requests are read until the end of their headers, up to this size. A
+// connection that has not sent them within REQUEST_TIMEOUT_MS is closed.
+#define MAX_REQUEST_BYTES (16 << 10)
+#define REQUEST_TIMEOUT_MS 10000
+// A page only sends short commands; a client with more than this received
+// but not yet forming whole frames is disconnected.
+#define MAX_CLIENT_INPUT_BYTES (64 << 10)
 #define WEBSOCKET_MAGIC "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+// Patches needing more changed lines, or more diff work, than this are
+// replaced by a full snapshot.
+#define MAX_DIFF_EDITS 4096
+#define MAX_DIFF_WORK 50000000
+#define DEFAULT_DEBOUNCE_MS 30
+#define DEFAULT_MAX_LATENCY_MS 250
+#define DEFAULT_CACHE_MB 256
+// Every cached file keeps a descriptor open, so the cache is also bounded in
+// files to stay well below select's FD_SETSIZE.
+#define MAX_CACHED_FILES 256
+// Files at least this large get the windowed page.
+#define WINDOWED_PAGE_BYTES (1 << 20)
+#define MAX_WINDOW_LINES 2000
+// Updates queued for a client that is not reading beyond this (or beyond
+// the size of the file) are replaced by a snapshot sent when it catches up.
+#define MAX_QUEUED_BYTES (256 << 10)
+// Budget of the per-file journal of recent changes.
+#define MAX_JOURNAL_BYTES (256 << 10)
+#define MAX_JOURNAL_ENTRIES 1024
+// A file keeps its journal this long after its last page disconnected, so
+// the page can catch up when it reconnects.
+#define RESUME_GRACE_MS 60000
+// URLs below this prefix download the file itself rather than the page.
+#define RAW_PREFIX "/raw"
+// Bytes handed to one sendfile call, so one download cannot monopolize the
+// event loop.
+#define RAW_CHUNK_BYTES (1 << 20)
+// Polling intervals without inotify: right after a file changed, and at
+// most, which an idle file backs off to.
+#define POLL_MIN_MS 100
+#define POLL_MAX_MS 2000
+// URLs below this prefix serve past versions of the file.
+#define HISTORY_PREFIX "/history"
+// How long history records wait for others to share their disk sync.
+#define HISTORY_COMMIT_MS 200
+// Deltas are recorded until they add up to the size of the file, or this
+// for small files; then a checkpoint is recorded instead.
+#define HISTORY_CHECKPOINT_BYTES (64 << 10)
+// Rendered fragments kept for reuse, across all files.
+#define FRAGMENT_CACHE_BYTES (16 << 20)
 
 // Global variables
-std::list<int> Clients;
-std::string FileContent;
-
-// SHA-1 context structure
-struct Sha1Ctx {
-  uint32_t state[5];
-  uint32_t count[2];
-  unsigned char buffer[64];
+// Waits for the sockets, files and timers of the monitor and dispatches them.
+EventLoop Loop;
+// What a WebSocket client shows: the whole file, or a window of its lines.
+struct ClientView {
+  MonitoredFile* file = nullptr;
+  bool windowed = false;
+  size_t first_line = 0;
+  size_t line_count = 0;
+
+  // Received bytes not yet making up a whole frame.
+  std::string input;
+
+  // Output the socket has not taken yet: the rest of the frame being sent
+  // (from unsent_offset on), then whole frames. When more piles up than a
+  // fresh snapshot or window would cost, the queue is dropped and resync
+  // set: the client gets its full state, built from the content of the
+  // moment it has room. A slow client so never holds more than one stale
+  // copy, and never delays the others.
+  std::string unsent;
+  size_t unsent_offset = 0;
+  std::deque<std::string> queued;
+  size_t queued_bytes = 0;
+  bool resync = false;
+
+  bool HasPendingOutput() const {
+    return unsent_offset < unsent.size() || !queued.empty() || resync;
+  }
+};
+// Every connected WebSocket client, by socket.
+std::unordered_map<int, ClientView> ClientViews;
+// A raw download in progress: the socket, the open file and the byte range
+// still to send. end is -1 for files of unknown size, sent up to EOF.
+struct RawTransfer {
+  int sock;
+  int fd;
+  off_t offset;
+  off_t end;
+};
+std::unordered_map<int, RawTransfer> RawTransfers;  // by socket
+// An HTTP response the socket has not taken yet, sent from data[offset].
+struct UnsentResponse {
+  std::string data;
+  size_t offset;
 };
+std::unordered_map<int, UnsentResponse> UnsentResponses;  // by socket
+// A request whose headers have not all arrived yet, and the timer that
+// gives up on it.
+struct PendingRequest {
+  std::string data;
+  EventLoop::TimerId timer;
+};
+std::unordered_map<int, PendingRequest> PendingRequests;  // by socket
+FileCache Cache(static_cast<size_t>(DEFAULT_CACHE_MB) << 20, MAX_CACHED_FILES);
+// Files with a change that has not been published yet.
+std::vector<MonitoredFile*> PendingFiles;
+// The timer publishing them once they are due, or 0.
+EventLoop::TimerId PublishTimer = 0;
+// What is monitored: a directory tree rooted at MonitorRoot, or the single
+// file MonitorFile in the directory MonitorRoot.
+std::string MonitorRoot;
+std::string MonitorRootReal;
+std::string MonitorFile;
+bool TailMode = false;
+// Set when changes are found by polling rather than by inotify.
+bool PollMode = false;
+StatPoller Poller(POLL_MIN_MS, POLL_MAX_MS);
+EventLoop::TimerId PollTimer = 0;
+HistoryLog History;
+bool RenderMode = false;
+FragmentCache Fragments(FRAGMENT_CACHE_BYTES);
+int Port = PORT;
+// As broker: the listening socket, and the attached sibling monitors by
+// socket with the files they watch, and the answers (in order, with the
+// descriptor each carries or -1) and change notices that did not fit in
+// their socket yet.
+int BrokerFd = -1;
+struct SiblingMonitor {
+  std::unordered_map<std::string, std::string> paths;  // by key
+  std::deque<std::pair<std::string, int>> replies;
+  std::set<std::string> unsent;
+};
+std::unordered_map<int, SiblingMonitor> Siblings;
+// As sibling: the connection to the broker, and the keys of the files taken
+// from it by real path.
+int AttachFd = -1;
+std::unordered_map<std::string, std::string> SharedKeys;
+int DebounceMs = DEFAULT_DEBOUNCE_MS;
+int MaxLatencyMs = DEFAULT_MAX_LATENCY_MS;
+// Part of every ETag and resume token, so a restarted monitor, whose
+// versions start over, never revalidates a page cached from an earlier run
+// or resumes one at a version of that run.
+std::string InstanceTag;
+// Compresses pages off the event loop.
+PageCompressor Compressor;
 
 // Function prototypes
+void SendResponse(int sock, struct iovec* iov, int iovcnt);
+void SendResponse(int sock, const std::string& response);
+void ResumeResponse(int sock);
+void SendWsFrame(int sock, uint8_t opcode, const std::string& head,
+                 const char* body, size_t body_len);
+void SendWsMessage(int sock, const std::string& head, const char* body,
+                   size_t body_len);
 void SendWsMessage(int sock, const std::string& data);
+bool DeferFullState(int sock);
+void FlushClient(int sock);
+void UpdateClientEvents(int sock);
+void SendSnapshot(int sock, MonitoredFile* file);
+void SendWindow(int sock, const ClientView& view);
+void UpdateWindow(int sock, const ClientView& view,
+                  const std::vector<LineEdit>* edits, size_t old_lines);
 void HandleHandshake(int sock, const std::string& clientKey);
-std::string Base64Encode(const unsigned char* input, int input_len);
-bool LoadFile(const std::string& path);
-void BroadcastToClients(const std::string& message);
-void AddClient(int sock);
+bool LoadFile(MonitoredFile* file);
+bool EnsureLoaded(MonitoredFile* file);
+void RefreshFileContent(MonitoredFile* file);
+void CheckContentTorn(MonitoredFile* file);
+void RecordChange(MonitoredFile* file, uint64_t base, const std::string& head,
+                  const char* body, size_t body_len);
+bool SendChangesSince(int sock, MonitoredFile* file, uint64_t since);
+uint64_t ResumeVersion(const std::string& token);
+void LogHistory(MonitoredFile* file, const std::string& head,
+                const char* body, size_t body_len);
+void SyncClient(int sock, uint64_t version);
+void BroadcastSnapshot(MonitoredFile* file);
+bool RehashContent(MonitoredFile* file);
+void BuildContentTables(MonitoredFile* file);
+RenderKind RenderKindOf(const MonitoredFile* file);
+void RenderContent(MonitoredFile* file);
+void PublishFileUpdate(MonitoredFile* file);
+void PublishRenderedUpdate(MonitoredFile* file, uint64_t base, bool diffed);
+void PublishBinaryUpdate(MonitoredFile* file, bool binary);
+size_t CompleteUtf8Length(const char* data, size_t len);
+bool OpenTail(MonitoredFile* file);
+void TailFile(MonitoredFile* file);
+uint64_t MonotonicMs();
+bool LoadSharedFile(MonitoredFile* file);
+void HandleBrokerNotice(const std::string& message, int fd);
+void ReadBrokerNotices();
+void BrokerGone();
+void ShareVersion(MonitoredFile* file, const char* appended, size_t len);
+void NotifySibling(int sock, const std::string& path);
+void ReplyToSibling(int sock, const std::string& message, int fd);
+void FlushSibling(int sock);
+void AcceptSibling();
+void HandleSiblingEvents(int sock, uint32_t events);
+void ServeSibling(int sock, const std::string& path);
+void RemoveSibling(int sock);
+void NoteFileChange(const std::string& key);
+void PollFiles();
+void PublishPendingChanges();
+void AddClient(int sock, MonitoredFile* file);
 void RemoveClient(int sock);
-void ProcessNewConnection(int server_fd, const std::string& filePath);
-void ProcessClientMessages(fd_set* fds);
-std::string GenerateHtmlResponse();
+std::string RequestPath(const std::string& request);
+bool RequestQueryValue(const std::string& request, const char* name,
+                       std::string* value);
+bool ResolveRequestPath(const std::string& url_path, std::string* key,
+                        std::string* path, bool* is_directory);
+std::string RequestHeader(const std::string& request, const char* name);
+std::string PercentEncodePath(const std::string& path);
+int ParseByteRange(const std::string& range, off_t size, off_t* first,
+                   off_t* last);
+bool StripPathPrefix(std::string* url_path, const char* prefix);
+void ServeRaw(int sock, const std::string& path, const std::string& request);
+bool ContinueRawTransfer(RawTransfer* transfer);
+void ResumeRawTransfer(int sock);
+void ProcessNewConnection(int server_fd);
+void ReadRequest(int sock);
+void DropRequest(int sock);
+void ServeRequest(int sock, const std::string& request);
+void HandleClientEvents(int sock, uint32_t events);
+bool HandleClientFrames(int sock);
+bool AcceptsGzip(const std::string& accept_encoding);
+std::string PageETag(const MonitoredFile* file, bool gzip);
+void RenderPage(MonitoredFile* file);
+void StoreCompressedPage(PageCompressor::Result* result);
+void ServePage(int sock, MonitoredFile* file, const std::string& request);
+std::string HistoryUrl(const MonitoredFile* file);
+void ServeHistory(int sock, const std::string& key,
+                  const std::string& request);
+std::string GenerateListingResponse(const std::string& key,
+                                    const std::string& path);
+
+// -------------------------------------------------------------------------
+// SendResponse: Sends an HTTP response and closes the connection. What the
+// socket does not take at once is copied and sent from the event loop as it
+// drains, so a slow browser never stalls the others. Takes ownership of
+// sock, which is non-blocking. MSG_NOSIGNAL keeps a browser that went away
+// from killing the process.
+// -------------------------------------------------------------------------
+void SendResponse(int sock, struct iovec* iov, int iovcnt) {
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    close(sock);
+    return;
+  }
+  if (sent < 0) sent = 0;
+  UnsentResponse unsent = {std::string(), 0};
+  for (int i = 0; i < iovcnt; i++) {
+    size_t skip = std::min<size_t>(sent, iov[i].iov_len);
+    sent -= skip;
+    unsent.data.append(static_cast<const char*>(iov[i].iov_base) + skip,
+                       iov[i].iov_len - skip);
+  }
+  if (unsent.data.empty()) {
+    close(sock);
+    return;
+  }
+  UnsentResponses[sock] = std::move(unsent);
+  Loop.Watch(sock, kWritable, [sock](uint32_t) { ResumeResponse(sock); });
+}
 
-// SHA-1 function prototypes
-void Sha1Transform(uint32_t state[5], const unsigned char buffer[64]);
-void Sha1Init(Sha1Ctx* context);
-void Sha1Update(Sha1Ctx* context, const unsigned char* data, uint32_t len);
-void Sha1Final(unsigned char digest[20], Sha1Ctx* context);
+void SendResponse(int sock, const std::string& response) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(response.data());
+  iov.iov_len = response.size();
+  SendResponse(sock, &iov, 1);
+}
 
 // -------------------------------------------------------------------------
-// SendWsMessage: Sends a WebSocket text frame to the given socket.
+// ResumeResponse: Continues a response once its socket can take more data,
+// and closes the connection when it is sent or has failed.
 // -------------------------------------------------------------------------
+void ResumeResponse(int sock) {
+  auto it = UnsentResponses.find(sock);
+  UnsentResponse& unsent = it->second;
+  ssize_t sent = send(sock, unsent.data.data() + unsent.offset,
+                      unsent.data.size() - unsent.offset, MSG_NOSIGNAL);
+  if (sent < 0 && (errno == EAGAIN || errno == EINTR)) return;
+  if (sent > 0) {
+    unsent.offset += sent;
+    if (unsent.offset < unsent.data.size()) return;
+  }
+  Loop.Unwatch(sock);
+  close(sock);
+  UnsentResponses.erase(it);
+}
+
+// -------------------------------------------------------------------------
+// SendWsFrame: Sends a WebSocket frame with the given opcode to the given
+// socket. The payload is head followed by body_len bytes of body, written
+// with a single sendmsg so a large body is never copied into a temporary
+// message.
+// -------------------------------------------------------------------------
+void SendWsFrame(int sock, uint8_t opcode, const std::string& head,
+                 const char* body, size_t body_len) {
+  // Reused for every frame, so building a header never allocates.
+  static std::vector<uint8_t> header;
+  size_t len = head.size() + body_len;
+  header.clear();
+  AppendWSFrameHeader(&header, len, static_cast<WSOpcode>(opcode));
+  size_t headerLen = header.size();
+  auto it = ClientViews.find(sock);
+  if (it == ClientViews.end()) return;
+  ClientView& view = it->second;
+  if (view.resync) return;  // The full state sent next includes this.
+  size_t frame_len = headerLen + len;
+  if (view.HasPendingOutput()) {
+    std::string frame(header.begin(), header.end());
+    frame.append(head);
+    frame.append(body, body_len);
+    view.queued.push_back(std::move(frame));
+    view.queued_bytes += frame_len;
+    size_t limit = MAX_QUEUED_BYTES;
+    if (!view.windowed)
+      limit = std::max<size_t>(limit, view.file->content.size());
+    if (view.queued_bytes > limit) DeferFullState(sock);
+    return;
+  }
+
+  // Nothing queued: write straight from the caller's buffers, and copy only
+  // what the socket does not take.
+  struct iovec iov[3];
+  iov[0].iov_base = header.data();
+  iov[0].iov_len = headerLen;
+  iov[1].iov_base = const_cast<char*>(head.data());
+  iov[1].iov_len = head.size();
+  iov[2].iov_base = const_cast<char*>(body);
+  iov[2].iov_len = body_len;
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0) {
+    // A closed socket is noticed, and the client removed, when reading.
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return;
+    sent = 0;
+  }
+  if (static_cast<size_t>(sent) == frame_len) return;
+  view.unsent.clear();
+  view.unsent_offset = 0;
+  for (int i = 0; i < 3; i++) {
+    size_t skip = std::min<size_t>(sent, iov[i].iov_len);
+    sent -= skip;
+    view.unsent.append(static_cast<const char*>(iov[i].iov_base) + skip,
+                       iov[i].iov_len - skip);
+  }
+  UpdateClientEvents(sock);
+}
+
+// -------------------------------------------------------------------------
+// SendWsMessage: Sends a WebSocket text frame.
+// -------------------------------------------------------------------------
+void SendWsMessage(int sock, const std::string& head, const char* body,
+                   size_t body_len) {
+  SendWsFrame(sock, static_cast<uint8_t>(WSOpcode::TEXT), head, body,
+              body_len);
+}
+
 void SendWsMessage(int sock, const std::string& data) {
-  unsigned char header[4];
-  size_t headerLen = 2;
-  header[0] = 0x81;  // FIN set and text frame opcode
+  SendWsMessage(sock, data, nullptr, 0);
+}
 
-  size_t len = data.size();
-  if (len <= 125) {
-    header[1] = static_cast<unsigned char>(len);
-  } else {
-    header[1] = 126;
-    uint16_t len16 = htons(static_cast<uint16_t>(len));
-    std::memcpy(header + 2, &len16, sizeof(uint16_t));
-    headerLen = 4;
+// -------------------------------------------------------------------------
+// DeferFullState: Call before sending a client its full state (a snapshot
+// or its window). If the client still has output pending, whatever is
+// queued is dropped, the state is sent once the socket has room, and true
+// is returned.
+// -------------------------------------------------------------------------
+bool DeferFullState(int sock) {
+  ClientView& view = ClientViews[sock];
+  if (!view.HasPendingOutput()) return false;
+  view.queued.clear();
+  view.queued_bytes = 0;
+  view.resync = true;
+  return true;
+}
+
+// -------------------------------------------------------------------------
+// FlushClient: Writes as much pending output as the socket takes, and the
+// client's full state once nothing older is left to send.
+// -------------------------------------------------------------------------
+void FlushClient(int sock) {
+  ClientView& view = ClientViews[sock];
+  while (true) {
+    if (view.unsent_offset < view.unsent.size()) {
+      ssize_t sent = send(sock, view.unsent.data() + view.unsent_offset,
+                          view.unsent.size() - view.unsent_offset,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (sent < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      view.unsent_offset += sent;
+      if (view.unsent_offset < view.unsent.size()) return;
+    }
+    std::string().swap(view.unsent);
+    view.unsent_offset = 0;
+    if (!view.queued.empty()) {
+      view.unsent.swap(view.queued.front());
+      view.queued.pop_front();
+      view.queued_bytes -= view.unsent.size();
+      continue;
+    }
+    if (!view.resync) break;
+    // Updates published while refreshing are covered by the state sent
+    // below, so resync stays set until then.
+    MonitoredFile* file = view.file;
+    RefreshFileContent(file);
+    view.resync = false;
+    if (view.windowed)
+      SendWindow(sock, view);
+    else
+      SendSnapshot(sock, file);
+    CheckContentTorn(file);
+    break;
   }
-  send(sock, header, headerLen, 0);
-  send(sock, data.c_str(), len, 0);
+  UpdateClientEvents(sock);
+}
+
+// -------------------------------------------------------------------------
+// UpdateClientEvents: Waits for room in the client's socket exactly while it
+// has output pending.
+// -------------------------------------------------------------------------
+void UpdateClientEvents(int sock) {
+  bool pending = ClientViews[sock].HasPendingOutput();
+  Loop.SetEvents(sock, kReadable | (pending ? kWritable : 0));
 }
 
 // -------------------------------------------------------------------------
-// HandleHandshake: Performs WebSocket handshake using SHA-1 and Base64.
+// SendSnapshot: Sends the full current file as "S<version>\n<content>", or
+// a rendered file as "M<version>\n" and its fragments separated by '\n'. A
+// page showing a file that has grown past WINDOWED_PAGE_BYTES is told to
+// reload ("R") and gets the windowed page instead.
+// -------------------------------------------------------------------------
+void SendSnapshot(int sock, MonitoredFile* file) {
+  if (DeferFullState(sock)) return;
+  if (file->binary) {
+    std::string head = "B";
+    AppendLittleEndian(&head, file->version, 8);
+    SendWsFrame(sock, static_cast<uint8_t>(WSOpcode::BINARY), head,
+                file->content.data(), file->content.size());
+    return;
+  }
+  if (file->render != RenderKind::kNone) {
+    std::string message = "M" + std::to_string(file->version) + "\n";
+    message.reserve(message.size() + file->rendered.bytes);
+    for (size_t i = 0; i < file->rendered.html.size(); i++) {
+      if (i > 0) message.push_back('\n');
+      message += *file->rendered.html[i];
+    }
+    SendWsMessage(sock, message);
+    return;
+  }
+  if (file->lines.ContentSize() >= WINDOWED_PAGE_BYTES) {
+    SendWsMessage(sock, "R\n");
+    return;
+  }
+  SendWsMessage(sock, "S" + std::to_string(file->version) + "\n",
+                file->content.data(), file->content.size());
+}
+
+// -------------------------------------------------------------------------
+// SendWindow: Sends the lines in a client's window as
+// "W<version> <first> <count> <total>\n<lines>". In tail mode the mapping
+// may not cover the latest appends, so the lines are read with pread.
+// -------------------------------------------------------------------------
+void SendWindow(int sock, const ClientView& view) {
+  if (DeferFullState(sock)) return;
+  MonitoredFile* file = view.file;
+  const LineTable& lines = file->lines;
+  size_t total = lines.LineCount();
+  size_t first = std::min(view.first_line, total > 0 ? total - 1 : 0);
+  size_t count = std::min(view.line_count, total - first);
+  size_t begin = lines.offsets[first];
+  size_t end = count > 0 ? lines.offsets[first + count] - 1 : begin;
+  std::string head = "W" + std::to_string(file->version) + " " +
+                     std::to_string(first) + " " + std::to_string(count) +
+                     " " + std::to_string(total) + "\n";
+  if (!TailMode) {
+    SendWsMessage(sock, head, file->content.data() + begin, end - begin);
+    return;
+  }
+  std::string text(end - begin, '\0');
+  size_t got = 0;
+  while (got < text.size()) {
+    ssize_t n =
+        pread(file->tail_fd, &text[got], text.size() - got, begin + got);
+    if (n <= 0) break;
+    got += n;
+  }
+  SendWsMessage(sock, head, text.data(), got);
+}
+
+// -------------------------------------------------------------------------
+// UpdateWindow: Tells a windowed client about a new version. The window is
+// resent if an edit changed or shifted its lines (all of them when edits is
+// null); otherwise only a new line count ("T<version> <total>") is sent.
+// -------------------------------------------------------------------------
+void UpdateWindow(int sock, const ClientView& view,
+                  const std::vector<LineEdit>* edits, size_t old_lines) {
+  size_t window_end = view.first_line + view.line_count;
+  bool affected = edits == nullptr;
+  if (edits != nullptr) {
+    for (const LineEdit& edit : *edits) {
+      if (edit.old_start < window_end &&
+          (edit.old_start + edit.old_count > view.first_line ||
+           edit.old_count != edit.new_count)) {
+        affected = true;
+        break;
+      }
+    }
+  }
+  MonitoredFile* file = view.file;
+  if (affected) {
+    SendWindow(sock, view);
+  } else if (file->lines.LineCount() != old_lines) {
+    SendWsMessage(sock, "T" + std::to_string(file->version) + " " +
+                            std::to_string(file->lines.LineCount()) + "\n");
+  }
+}
+// -------------------------------------------------------------------------
+// HandleHandshake: Accepts a WebSocket upgrade, answering the client key
+// with its SHA-1 and Base64 accept value.
 // -------------------------------------------------------------------------
 void HandleHandshake(int sock, const std::string& clientKey) {
-  std::string combined = clientKey + WEBSOCKET_MAGIC;
-
-  unsigned char sha1Result[20];
-  Sha1Ctx ctx;
-  Sha1Init(&ctx);
-  Sha1Update(&ctx, reinterpret_cast<const unsigned char*>(combined.c_str()),
-             combined.size());
-  Sha1Final(sha1Result, &ctx);
-
-  std::string b64 = Base64Encode(sha1Result, 20);
-
-  char response[256];
-  std::snprintf(response, sizeof(response),
-                "HTTP/1.1 101 Switching Protocols\r\n"
-                "Upgrade: websocket\r\n"
-                "Connection: Upgrade\r\n"
-                "Sec-WebSocket-Accept: %s\r\n\r\n",
-                b64.c_str());
-  send(sock, response, std::strlen(response), 0);
-}
-
-// -------------------------------------------------------------------------
-// Base64Encode: Encodes input bytes into a Base64 string.
-// -------------------------------------------------------------------------
-std::string Base64Encode(const unsigned char* input, int input_len) {
-  const char base64_chars[] =
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  std::string output;
-  int i = 0;
-  unsigned char char_array_3[3], char_array_4[4];
-
-  while (input_len--) {
-    char_array_3[i++] = *(input++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] =
-          ((char_array_3[0] & 0x03) << 4) | ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] =
-          ((char_array_3[1] & 0x0f) << 2) | ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-      for (i = 0; i < 4; i++) output.push_back(base64_chars[char_array_4[i]]);
-      i = 0;
-    }
-  }
-  if (i) {
-    for (int j = i; j < 3; j++) char_array_3[j] = '\0';
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] =
-        ((char_array_3[0] & 0x03) << 4) | ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] =
-        ((char_array_3[1] & 0x0f) << 2) | ((char_array_3[2] & 0xc0) >> 6);
-    for (int j = 0; j < i + 1; j++)
-      output.push_back(base64_chars[char_array_4[j]]);
-    while (i++ < 3) output.push_back('=');
-  }
-  return output;
-}
-
-// -------------------------------------------------------------------------
-// LoadFile: Loads the entire file into memory and updates global FileContent.
-// -------------------------------------------------------------------------
-bool LoadFile(const std::string& path) {
-  std::ifstream file(path, std::ios::binary);
-  if (!file) return false;
-  std::ostringstream oss;
-  oss << file.rdbuf();
-  FileContent = oss.str();
+  std::string response =
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: " +
+      EncodeBase64(ComputeSHA1Hash(clientKey + WEBSOCKET_MAGIC)) +
+      "\r\n\r\n";
+  send(sock, response.data(), response.size(), MSG_NOSIGNAL);
+}
+
+// -------------------------------------------------------------------------
+// LoadFile: Maps the current version of the file.
+// -------------------------------------------------------------------------
+bool LoadFile(MonitoredFile* file) {
+  if (AttachFd >= 0) return LoadSharedFile(file);
+  return file->content.Load(file->path);
+}
+
+// -------------------------------------------------------------------------
+// EnsureLoaded: Brings the file into the cache if it was never loaded or has
+// been evicted. Its version is bumped, since the content may have changed
+// while nobody was watching.
+// -------------------------------------------------------------------------
+bool EnsureLoaded(MonitoredFile* file) {
+  if (file->loaded) {
+    Cache.Touch(file);
+    return true;
+  }
+  // Polled from the state before the load, so a write during it is seen.
+  if (PollMode) {
+    // The new file is due first; polling the others early is harmless.
+    Poller.Watch(file->key, file->path, MonotonicMs());
+    Loop.Cancel(PollTimer);
+    PollTimer = Loop.RunAfter(POLL_MIN_MS, PollFiles);
+  }
+  if (!LoadFile(file)) return false;
+  if (TailMode) {
+    // A character still being written is left for the first append.
+    size_t complete =
+        CompleteUtf8Length(file->content.data(), file->content.size());
+    if (!OpenTail(file) ||
+        (complete < file->content.size() &&
+         !file->content.LoadPrefix(file->tail_fd, complete))) {
+      file->content.Clear();
+      return false;
+    }
+  }
+  RehashContent(file);
+  if (TailMode) {
+    file->tail_offset = file->content.size();
+    file->tail_stale = false;
+    BuildLineOffsets(file->content.data(), file->content.size(),
+                     &file->lines);
+  } else {
+    BuildContentTables(file);
+  }
+  file->version++;
+  file->torn = false;
+  Cache.Loaded(file);
+  LogHistory(file, "", nullptr, 0);
+  ShareVersion(file, nullptr, 0);
   return true;
 }
+// -------------------------------------------------------------------------
+// RefreshFileContent: Makes the content safe to serve as the file's current
+// version. A mapping shows writes made after it was taken, and faults on
+// pages cut off by a truncation, so if the file changed before its change
+// event was processed, the change is published now instead.
+// -------------------------------------------------------------------------
+void RefreshFileContent(MonitoredFile* file) {
+  if (TailMode) {
+    if (file->content.Shrunk()) TailFile(file);
+    if (file->tail_stale &&
+        file->content.LoadPrefix(file->tail_fd, file->tail_offset)) {
+      file->tail_stale = false;
+      Cache.Loaded(file);
+    }
+  } else if (file->content.Changed() && LoadFile(file)) {
+    PublishFileUpdate(file);
+  }
+}
+// -------------------------------------------------------------------------
+// CheckContentTorn: Call after reading the content. Appends in tail mode
+// never touch the mapped prefix, so only a rewritten file can tear.
+// -------------------------------------------------------------------------
+void CheckContentTorn(MonitoredFile* file) {
+  if (!TailMode && file->content.Changed()) file->torn = true;
+}
 
 // -------------------------------------------------------------------------
-// BroadcastToClients: Sends a message to all connected WebSocket clients.
+// RecordChange: Adds the message taking the file from version base to the
+// next one to its journal, dropping the oldest entries beyond the budget.
+// An empty message records a change pages can only get as a snapshot, and
+// empties the journal.
 // -------------------------------------------------------------------------
-void BroadcastToClients(const std::string& message) {
-  for (int sock : Clients) {
-    SendWsMessage(sock, message);
+void RecordChange(MonitoredFile* file, uint64_t base, const std::string& head,
+                  const char* body, size_t body_len) {
+  if (head.empty() ||
+      file->journal_base + file->journal.size() != base ||
+      head.size() + body_len > MAX_JOURNAL_BYTES) {
+    file->journal.clear();
+    file->journal_bytes = 0;
+    file->journal_base = base + 1;
+    if (head.empty() || head.size() + body_len > MAX_JOURNAL_BYTES) return;
+  }
+  if (file->journal.empty()) file->journal_base = base;
+  file->journal.push_back(head);
+  file->journal.back().append(body, body_len);
+  file->journal_bytes += file->journal.back().size();
+  while (file->journal_bytes > MAX_JOURNAL_BYTES ||
+         file->journal.size() > MAX_JOURNAL_ENTRIES) {
+    file->journal_bytes -= file->journal.front().size();
+    file->journal.pop_front();
+    file->journal_base++;
   }
 }
+// -------------------------------------------------------------------------
+// LogHistory: Records the current version of the file in the history: as
+// the message that made it from the previous one, or as a checkpoint of the
+// content when head is empty or the deltas since the last checkpoint have
+// grown as large as the file. In tail mode the mapping may lag behind, so
+// appends never turn into checkpoints. A version the history already ends
+// with, such as a file loaded again unchanged, is not recorded again.
+// -------------------------------------------------------------------------
+void LogHistory(MonitoredFile* file, const std::string& head,
+                const char* body, size_t body_len) {
+  if (!History.enabled()) return;
+  uint64_t hash = file->hash.Digest();
+  if (History.IsNewest(file->key, hash)) return;
+  size_t len = head.size() + body_len;
+  size_t limit = std::max<size_t>(file->content.size(),
+                                  HISTORY_CHECKPOINT_BYTES);
+  if (head.empty() || (!TailMode && file->history_bytes + len > limit)) {
+    History.Append(file->key, file->version, hash, 'C',
+                   std::string(file->content.data(), file->content.size()));
+    file->history_bytes = 0;
+    return;
+  }
+  std::string record = head;
+  record.append(body, body_len);
+  History.Append(file->key, file->version, hash, head[0], std::move(record));
+  file->history_bytes += len;
+}
+// -------------------------------------------------------------------------
+// SendChangesSince: Sends a page at version since the journaled changes
+// that bring it up to date. Returns false, sending nothing, if the journal
+// does not reach back that far or a snapshot would be smaller.
+// -------------------------------------------------------------------------
+bool SendChangesSince(int sock, MonitoredFile* file, uint64_t since) {
+  uint64_t end = file->journal_base + file->journal.size();
+  if (end != file->version || since < file->journal_base || since >= end)
+    return false;
+  size_t first = since - file->journal_base;
+  size_t bytes = 0;
+  for (size_t i = first; i < file->journal.size(); i++)
+    bytes += file->journal[i].size();
+  if (bytes >= file->content.size()) return false;
+  for (size_t i = first; i < file->journal.size(); i++)
+    SendWsMessage(sock, file->journal[i]);
+  return true;
+}
+// -------------------------------------------------------------------------
+// ResumeVersion: Returns the version a page's resume token
+// "<instance>-<version>" names, or 0, which no page holds, if the token is
+// from another run of the monitor. Such a page is sent a snapshot.
+// -------------------------------------------------------------------------
+uint64_t ResumeVersion(const std::string& token) {
+  size_t dash = InstanceTag.size();
+  if (token.size() <= dash + 1 || token[dash] != '-' ||
+      token.compare(0, dash, InstanceTag) != 0)
+    return 0;
+  return std::strtoull(token.c_str() + dash + 1, nullptr, 10);
+}
+// -------------------------------------------------------------------------
+// SyncClient: Brings a page showing the whole file at version up to date,
+// with the changes it missed or else a snapshot.
+// -------------------------------------------------------------------------
+void SyncClient(int sock, uint64_t version) {
+  ClientView& view = ClientViews[sock];
+  MonitoredFile* file = view.file;
+  view.windowed = false;
+  RefreshFileContent(file);
+  if (version == file->version || SendChangesSince(sock, file, version))
+    return;
+  SendSnapshot(sock, file);
+  CheckContentTorn(file);
+}
+
+// -------------------------------------------------------------------------
+// BroadcastSnapshot: Sends the full file, or their window, to every client
+// showing it.
+// -------------------------------------------------------------------------
+void BroadcastSnapshot(MonitoredFile* file) {
+  for (int sock : file->subscribers) {
+    const ClientView& view = ClientViews[sock];
+    if (view.windowed)
+      SendWindow(sock, view);
+    else
+      SendSnapshot(sock, file);
+  }
+}
+// -------------------------------------------------------------------------
+// RehashContent: Hashes the content of the file afresh. Returns true if it is
+// byte for byte the content pages already have, as far as a 64-bit hash can
+// tell, so the change event that caused the reload can be ignored.
+// -------------------------------------------------------------------------
+bool RehashContent(MonitoredFile* file) {
+  ContentHash hash;
+  hash.Update(file->content.data(), file->content.size());
+  bool same = hash.size() == file->hash.size() &&
+              hash.Digest() == file->hash.Digest();
+  file->hash = hash;
+  return same;
+}
 
 // -------------------------------------------------------------------------
-// AddClient: Adds a new client socket to the list.
+// BuildContentTables: Builds the tables the next version of the file is
+// diffed against: block checksums for binary content, line hashes for text.
+// -------------------------------------------------------------------------
+void BuildContentTables(MonitoredFile* file) {
+  const FileSnapshot& content = file->content;
+  file->binary = LooksBinary(content.data(), content.size());
+  if (file->binary) {
+    file->lines = LineTable();
+    BuildBlockTable(content.data(), content.size(), &file->blocks);
+  } else {
+    file->blocks = BlockTable();
+    BuildLineTable(content.data(), content.size(), &file->lines);
+  }
+  file->render = RenderKindOf(file);
+  RenderContent(file);
+}
+// -------------------------------------------------------------------------
+// RenderKindOf: How the file is rendered for its page as it is now: not at
+// all without --render, in tail mode, or when it is binary or shown in a
+// window.
+// -------------------------------------------------------------------------
+RenderKind RenderKindOf(const MonitoredFile* file) {
+  if (!RenderMode || TailMode || file->binary ||
+      file->lines.ContentSize() >= WINDOWED_PAGE_BYTES)
+    return RenderKind::kNone;
+  return RenderKindFor(file->path);
+}
+// -------------------------------------------------------------------------
+// RenderContent: Renders the content of the file as file->render says,
+// reusing cached fragments.
+// -------------------------------------------------------------------------
+void RenderContent(MonitoredFile* file) {
+  if (file->render == RenderKind::kNone) {
+    file->rendered = RenderedDoc();
+    return;
+  }
+  RenderDocument(file->render, file->content.data(), file->content.size(),
+                 file->lines, &Fragments, &file->rendered);
+}
+
+// -------------------------------------------------------------------------
+// PublishFileUpdate: Diffs the freshly loaded content, unless it hashes the
+// same as before, against the line hashes of the previous version and
+// broadcasts a patch, or a full snapshot when the patch would not be smaller
+// than the file. Windowed clients only hear about edits that touch their
+// window.
+// -------------------------------------------------------------------------
+void PublishFileUpdate(MonitoredFile* file) {
+  const FileSnapshot& content = file->content;
+  if (RehashContent(file) && !file->torn) {
+    Cache.Loaded(file);
+    return;  // Same bytes, nothing to send.
+  }
+  bool binary = LooksBinary(content.data(), content.size());
+  if (binary || file->binary) {
+    PublishBinaryUpdate(file, binary);
+    return;
+  }
+  size_t old_lines = file->lines.LineCount();
+  LineTable lines;
+  BuildLineTable(content.data(), content.size(), &lines);
+  std::vector<LineEdit> edits;
+  bool diffed =
+      !file->torn && DiffLines(file->lines.hashes, lines.hashes,
+                               MAX_DIFF_EDITS, MAX_DIFF_WORK, &edits);
+  file->lines = std::move(lines);
+  Cache.Loaded(file);
+  if (diffed && edits.empty()) return;  // Same lines, nothing to send.
+  file->torn = false;
+
+  uint64_t base = file->version++;
+  std::string patch;
+  if (diffed)
+    patch = EncodeLinePatch(base, file->version, edits, file->lines,
+                            content.data());
+  bool send_patch = diffed && patch.size() < content.size();
+  if (file->render != RenderKind::kNone ||
+      RenderKindOf(file) != RenderKind::kNone) {
+    LogHistory(file, send_patch ? patch : "", nullptr, 0);
+    ShareVersion(file, nullptr, 0);
+    PublishRenderedUpdate(file, base, diffed);
+    return;
+  }
+  if (send_patch)
+    RecordChange(file, base, patch, nullptr, 0);
+  else
+    RecordChange(file, base, "", nullptr, 0);
+  LogHistory(file, send_patch ? patch : "", nullptr, 0);
+  ShareVersion(file, nullptr, 0);
+  for (int sock : file->subscribers) {
+    const ClientView& view = ClientViews[sock];
+    if (view.windowed)
+      UpdateWindow(sock, view, diffed ? &edits : nullptr, old_lines);
+    else if (send_patch)
+      SendWsMessage(sock, patch);
+    else
+      SendSnapshot(sock, file);
+  }
+  CheckContentTorn(file);
+}
+// -------------------------------------------------------------------------
+// PublishRenderedUpdate: Renders the new version of a rendered file and
+// broadcasts the fragments that changed as "H<base> <version>\n" and edits
+// in the line patch format, diffed by fragment keys; or all fragments when
+// that would not be smaller, or the page may be out of step (diffed unset).
+// A file that starts or stops being rendered gets its page reloaded.
+// -------------------------------------------------------------------------
+void PublishRenderedUpdate(MonitoredFile* file, uint64_t base, bool diffed) {
+  RenderKind render = RenderKindOf(file);
+  if (render != file->render) {
+    file->render = render;
+    RenderContent(file);
+    Cache.Loaded(file);
+    RecordChange(file, base, "", nullptr, 0);
+    for (int sock : file->subscribers) SendWsMessage(sock, "R\n");
+    CheckContentTorn(file);
+    return;
+  }
+  RenderedDoc rendered;
+  RenderDocument(render, file->content.data(), file->content.size(),
+                 file->lines, &Fragments, &rendered);
+  std::vector<LineEdit> edits;
+  std::string patch;
+  if (diffed && DiffLines(file->rendered.keys, rendered.keys, MAX_DIFF_EDITS,
+                          MAX_DIFF_WORK, &edits))
+    patch = EncodeFragmentPatch(base, file->version, edits, rendered);
+  bool send_patch = !patch.empty() && patch.size() < rendered.bytes;
+  file->rendered = std::move(rendered);
+  Cache.Loaded(file);
+  RecordChange(file, base, send_patch ? patch : "", nullptr, 0);
+  for (int sock : file->subscribers) {
+    if (send_patch)
+      SendWsMessage(sock, patch);
+    else
+      SendSnapshot(sock, file);
+  }
+  CheckContentTorn(file);
+}
+// -------------------------------------------------------------------------
+// PublishBinaryUpdate: Diffs freshly loaded binary content against the block
+// checksums of the previous version and broadcasts the delta as a binary
+// frame, or a snapshot when the delta would not be smaller. A file turning
+// from text into binary or back gets its page reloaded. Binary deltas are not
+// journaled; a page that reconnects is sent a snapshot.
 // -------------------------------------------------------------------------
-void AddClient(int sock) { Clients.push_back(sock); }
+void PublishBinaryUpdate(MonitoredFile* file, bool binary) {
+  const FileSnapshot& content = file->content;
+  if (binary != file->binary) {
+    BuildContentTables(file);
+    file->torn = false;
+    Cache.Loaded(file);
+    RecordChange(file, file->version++, "", nullptr, 0);
+    LogHistory(file, "", nullptr, 0);
+    ShareVersion(file, nullptr, 0);
+    for (int sock : file->subscribers) SendWsMessage(sock, "R\n");
+    CheckContentTorn(file);
+    return;
+  }
+  BlockTable blocks;
+  BuildBlockTable(content.data(), content.size(), &blocks);
+  if (!file->torn && SameBlocks(file->blocks, blocks)) {
+    file->blocks = std::move(blocks);
+    Cache.Loaded(file);
+    return;  // Same blocks, nothing to send.
+  }
 
+  uint64_t base = file->version++;
+  std::string delta;
+  if (!file->torn)
+    delta = EncodeBlockDelta(base, file->version, file->blocks,
+                             content.data(), content.size());
+  bool send_delta = !delta.empty() && delta.size() < content.size();
+  file->blocks = std::move(blocks);
+  file->torn = false;
+  Cache.Loaded(file);
+  RecordChange(file, base, "", nullptr, 0);
+  LogHistory(file, send_delta ? delta : "", nullptr, 0);
+  ShareVersion(file, nullptr, 0);
+  for (int sock : file->subscribers) {
+    if (send_delta)
+      SendWsFrame(sock, static_cast<uint8_t>(WSOpcode::BINARY), delta,
+                  nullptr, 0);
+    else
+      SendSnapshot(sock, file);
+  }
+  CheckContentTorn(file);
+}
 // -------------------------------------------------------------------------
-// RemoveClient: Removes a client socket from the list and closes it.
+// AddClient: Adds a new client socket and subscribes it to file.
+// -------------------------------------------------------------------------
+void AddClient(int sock, MonitoredFile* file) {
+  ClientViews[sock].file = file;
+  file->subscribers.push_back(sock);
+  Loop.Watch(sock, kReadable,
+             [sock](uint32_t events) { HandleClientEvents(sock, events); });
+}
+// -------------------------------------------------------------------------
+// RemoveClient: Unsubscribes a client and closes its socket. A file nobody
+// watches any more becomes evictable.
 // -------------------------------------------------------------------------
 void RemoveClient(int sock) {
-  Clients.remove(sock);
+  auto it = ClientViews.find(sock);
+  if (it != ClientViews.end()) {
+    std::vector<int>& subscribers = it->second.file->subscribers;
+    auto pos = std::find(subscribers.begin(), subscribers.end(), sock);
+    if (pos != subscribers.end()) {
+      *pos = subscribers.back();
+      subscribers.pop_back();
+    }
+    if (subscribers.empty()) it->second.file->unsubscribed_ms = MonotonicMs();
+    ClientViews.erase(it);
+  }
+  Loop.Unwatch(sock);
   close(sock);
+  Cache.Trim();
 }
 
 // -------------------------------------------------------------------------
-// GenerateHtmlResponse: Dynamically generates HTML with current file content.
+// RequestPath: Returns the percent-decoded path of the request line, without
+// the query string.
+// -------------------------------------------------------------------------
+std::string RequestPath(const std::string& request) {
+  size_t start = request.find(' ');
+  if (start == std::string::npos) return "/";
+  start++;
+  size_t end = request.find_first_of(" ?\r\n", start);
+  if (end == std::string::npos) end = request.size();
+  std::string path;
+  for (size_t i = start; i < end; i++) {
+    if (request[i] == '%' && i + 2 < end && isxdigit(request[i + 1]) &&
+        isxdigit(request[i + 2])) {
+      path.push_back(static_cast<char>(
+          std::strtol(request.substr(i + 1, 2).c_str(), nullptr, 16)));
+      i += 2;
+    } else {
+      path.push_back(request[i]);
+    }
+  }
+  return path;
+}
+
+// -------------------------------------------------------------------------
+// RequestQueryValue: Finds the parameter name in the query string of the
+// request line. Values are returned as they are, without decoding.
+// -------------------------------------------------------------------------
+bool RequestQueryValue(const std::string& request, const char* name,
+                       std::string* value) {
+  size_t start = request.find(' ');
+  size_t end = request.find_first_of(" \r\n", start + 1);
+  if (start == std::string::npos || end == std::string::npos) return false;
+  size_t query = request.find('?', start);
+  if (query == std::string::npos || query > end) return false;
+  size_t name_len = std::strlen(name);
+  for (size_t pos = query + 1; pos < end;) {
+    size_t next = request.find('&', pos);
+    if (next == std::string::npos || next > end) next = end;
+    if (next - pos > name_len && request[pos + name_len] == '=' &&
+        request.compare(pos, name_len, name) == 0) {
+      *value = request.substr(pos + name_len + 1, next - pos - name_len - 1);
+      return true;
+    }
+    pos = next + 1;
+  }
+  return false;
+}
+
+// -------------------------------------------------------------------------
+// ResolveRequestPath: Maps a URL path to the file or directory it names.
+// When a single file is monitored, every URL names that file. Otherwise the
+// URL is a path below MonitorRoot; ".." and symlinks leading out of the tree
+// are refused. key is the path relative to MonitorRoot.
+// -------------------------------------------------------------------------
+bool ResolveRequestPath(const std::string& url_path, std::string* key,
+                        std::string* path, bool* is_directory) {
+  *is_directory = false;
+  if (!MonitorFile.empty()) {
+    *key = MonitorFile;
+    *path = MonitorRoot + "/" + MonitorFile;
+    return true;
+  }
+  key->clear();
+  size_t pos = 0;
+  while (pos < url_path.size()) {
+    size_t end = url_path.find('/', pos);
+    if (end == std::string::npos) end = url_path.size();
+    std::string part = url_path.substr(pos, end - pos);
+    pos = end + 1;
+    if (part.empty() || part == ".") continue;
+    if (part == ".." || part.find('\0') != std::string::npos) return false;
+    if (!key->empty()) key->push_back('/');
+    key->append(part);
+  }
+  *path = key->empty() ? MonitorRoot : MonitorRoot + "/" + *key;
+
+  char resolved[PATH_MAX];
+  if (realpath(path->c_str(), resolved) == nullptr) return false;
+  std::string real = resolved;
+  std::string prefix = MonitorRootReal == "/" ? "/" : MonitorRootReal + "/";
+  if (real != MonitorRootReal && real.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  struct stat st;
+  if (stat(path->c_str(), &st) < 0) return false;
+  *is_directory = S_ISDIR(st.st_mode);
+  return *is_directory || S_ISREG(st.st_mode);
+}
+
 // -------------------------------------------------------------------------
-std::string GenerateHtmlResponse() {
-  const char* html_template =
+// RequestHeader: Returns the value of the named header, matched without
+// regard to case, or an empty string.
+// -------------------------------------------------------------------------
+std::string RequestHeader(const std::string& request, const char* name) {
+  size_t name_len = std::strlen(name);
+  size_t pos = request.find("\r\n");
+  while (pos != std::string::npos && pos + 2 < request.size()) {
+    size_t start = pos + 2;
+    size_t end = request.find("\r\n", start);
+    if (end == std::string::npos) end = request.size();
+    if (end == start) break;  // End of the headers.
+    if (end - start > name_len && request[start + name_len] == ':' &&
+        strncasecmp(request.c_str() + start, name, name_len) == 0) {
+      size_t value = request.find_first_not_of(" \t", start + name_len + 1);
+      if (value == std::string::npos || value > end) return "";
+      return request.substr(value, end - value);
+    }
+    pos = end;
+  }
+  return "";
+}
+
+// -------------------------------------------------------------------------
+// PercentEncodePath: Encodes a relative path for use in a URL, keeping '/'.
+// -------------------------------------------------------------------------
+std::string PercentEncodePath(const std::string& path) {
+  static const char kHex[] = "0123456789ABCDEF";
+  std::string out;
+  for (unsigned char c : path) {
+    if (isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' ||
+        c == '~') {
+      out.push_back(c);
+    } else {
+      out.push_back('%');
+      out.push_back(kHex[c >> 4]);
+      out.push_back(kHex[c & 15]);
+    }
+  }
+  return out;
+}
+// -------------------------------------------------------------------------
+// AcceptsGzip: Whether an Accept-Encoding value allows gzip.
+// -------------------------------------------------------------------------
+bool AcceptsGzip(const std::string& accept_encoding) {
+  size_t start = 0;
+  while (start < accept_encoding.size()) {
+    size_t end = accept_encoding.find(',', start);
+    if (end == std::string::npos) end = accept_encoding.size();
+    std::string coding = accept_encoding.substr(start, end - start);
+    start = end + 1;
+    size_t params = coding.find(';');
+    std::string name = coding.substr(0, params);
+    name.erase(0, name.find_first_not_of(" \t"));
+    name.erase(name.find_last_not_of(" \t") + 1);
+    if (strcasecmp(name.c_str(), "gzip") != 0 && name != "*") continue;
+    // "gzip;q=0" refuses it.
+    if (params != std::string::npos) {
+      size_t q = coding.find("q=", params);
+      if (q != std::string::npos && std::strtod(coding.c_str() + q + 2,
+                                                nullptr) == 0)
+        return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+// -------------------------------------------------------------------------
+// PageETag: Returns the strong ETag of the page for the file's current
+// version. The gzip-compressed page is a different representation and gets
+// its own tag.
+// -------------------------------------------------------------------------
+std::string PageETag(const MonitoredFile* file, bool gzip) {
+  return "\"" + InstanceTag + "-" + std::to_string(file->version) +
+         (gzip ? "-gz\"" : "\"");
+}
+
+// -------------------------------------------------------------------------
+// RenderPage: Renders the HTTP response for the current version of file,
+// unless it is already cached, and queues it for compression. The page
+// embeds the HTML-escaped content, or for WINDOWED_PAGE_BYTES and more only
+// the line count.
+// -------------------------------------------------------------------------
+void RenderPage(MonitoredFile* file) {
+  if (file->page_version == file->version) return;
+  std::shared_ptr<std::string> page(new std::string());
+  if (file->binary)
+    RenderBinaryPage(file->version, InstanceTag, page.get());
+  else if (file->render != RenderKind::kNone)
+    RenderRenderedPage(file->version, InstanceTag, RenderClass(file->render),
+                       file->rendered.html, page.get());
+  else if (file->lines.ContentSize() >= WINDOWED_PAGE_BYTES)
+    RenderWindowedPage(file->version, file->lines.LineCount(), page.get());
+  else
+    RenderFullPage(file->content.data(), file->content.size(), file->version,
+                   InstanceTag, HistoryUrl(file), page.get());
+  file->page = page;
+  file->page_head =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/html; charset=utf-8\r\n"
+      "Content-Length: " +
+      std::to_string(page->size()) +
+      "\r\n"
+      "ETag: " +
+      PageETag(file, false) +
+      "\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+  file->page_version = file->version;
+  // A page rendered from a torn read is served once but not kept.
+  CheckContentTorn(file);
+  if (file->torn) {
+    file->page_version = 0;
+  } else {
+    Compressor.Submit(file->key, file->version, file->page);
+  }
+  Cache.Loaded(file);
+}
+
+// -------------------------------------------------------------------------
+// StoreCompressedPage: Keeps a page the compressor finished, unless the file
+// has moved on to another version or was evicted meanwhile.
+// -------------------------------------------------------------------------
+void StoreCompressedPage(PageCompressor::Result* result) {
+  MonitoredFile* file = Cache.Find(result->key);
+  if (file == nullptr || !file->loaded ||
+      file->page_version != result->version ||
+      file->version != result->version)
+    return;
+  file->page_gzip.swap(result->gzip);
+  file->page_gzip.shrink_to_fit();
+  file->page_gzip_head =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/html; charset=utf-8\r\n"
+      "Content-Encoding: gzip\r\n"
+      "Content-Length: " +
+      std::to_string(file->page_gzip.size()) +
+      "\r\n"
+      "ETag: " +
+      PageETag(file, true) +
+      "\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+  file->page_gzip_version = result->version;
+  Cache.Loaded(file);
+}
+
+// -------------------------------------------------------------------------
+// ServePage: Sends the page for file, or 304 Not Modified when the request
+// revalidates the page of the current version. The page is sent compressed
+// when the client accepts gzip and the compressor has finished it; until
+// then it goes out as is rather than making the client wait. Takes
+// ownership of sock.
+// -------------------------------------------------------------------------
+void ServePage(int sock, MonitoredFile* file, const std::string& request) {
+  RefreshFileContent(file);
+  bool gzip = AcceptsGzip(RequestHeader(request, "Accept-Encoding"));
+  std::string if_none_match = RequestHeader(request, "If-None-Match");
+  std::string etag;
+  if (if_none_match.find(PageETag(file, false)) != std::string::npos)
+    etag = PageETag(file, false);
+  else if (gzip && if_none_match.find(PageETag(file, true)) !=
+                       std::string::npos)
+    etag = PageETag(file, true);
+  if (!etag.empty()) {
+    std::string response =
+        "HTTP/1.1 304 Not Modified\r\n"
+        "ETag: " +
+        etag +
+        "\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Vary: Accept-Encoding\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    SendResponse(sock, response);
+    return;
+  }
+  RenderPage(file);
+  struct iovec iov[2];
+  if (gzip && file->page_gzip_version == file->version) {
+    iov[0].iov_base = const_cast<char*>(file->page_gzip_head.data());
+    iov[0].iov_len = file->page_gzip_head.size();
+    iov[1].iov_base = const_cast<char*>(file->page_gzip.data());
+    iov[1].iov_len = file->page_gzip.size();
+  } else {
+    iov[0].iov_base = const_cast<char*>(file->page_head.data());
+    iov[0].iov_len = file->page_head.size();
+    iov[1].iov_base = const_cast<char*>(file->page->data());
+    iov[1].iov_len = file->page->size();
+  }
+  SendResponse(sock, iov, 2);
+}
+// -------------------------------------------------------------------------
+// HistoryUrl: Where the page of the file fetches past versions from, or
+// empty without a history.
+// -------------------------------------------------------------------------
+std::string HistoryUrl(const MonitoredFile* file) {
+  if (!History.enabled()) return "";
+  if (!MonitorFile.empty()) return HISTORY_PREFIX;
+  return HISTORY_PREFIX "/" + PercentEncodePath(file->key);
+}
+
+// -------------------------------------------------------------------------
+// ServeHistory: Answers a request below HISTORY_PREFIX. With "?at=<ms>" it
+// sends the version of the file current at that time (milliseconds since
+// the epoch), with its time and version in X-History-Time and
+// X-History-Version. Without it, it sends the extent of the history as
+// {"first":<ms>,"last":<ms>,"count":<n>}. Takes ownership of sock.
+// -------------------------------------------------------------------------
+void ServeHistory(int sock, const std::string& key,
+                  const std::string& request) {
+  std::string at, head, body;
+  HistoryEntry first, last;
+  size_t count = 0;
+  if (!History.enabled()) {
+    // Not found below.
+  } else if (!RequestQueryValue(request, "at", &at)) {
+    if (!History.Extent(key, &first, &last, &count)) count = 0;
+    body = "{\"first\":" + std::to_string(count ? first.time_ms : 0) +
+           ",\"last\":" + std::to_string(count ? last.time_ms : 0) +
+           ",\"count\":" + std::to_string(count) + "}\n";
+    head = "Content-Type: application/json\r\n";
+  } else if (History.Rebuild(key, std::strtoull(at.c_str(), nullptr, 10),
+                             &body, &last)) {
+    head = std::string("Content-Type: ") +
+           (LooksBinary(body.data(), body.size())
+                ? "application/octet-stream"
+                : "text/plain; charset=utf-8") +
+           "\r\n"
+           "X-History-Time: " +
+           std::to_string(last.time_ms) +
+           "\r\n"
+           "X-History-Version: " +
+           std::to_string(last.version) + "\r\n";
+  }
+  if (head.empty()) {
+    head =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Type: text/plain\r\n";
+    body = "Not found\n";
+  } else {
+    head = "HTTP/1.1 200 OK\r\n" + head;
+  }
+  head += "Content-Length: " + std::to_string(body.size()) +
+          "\r\n"
+          "Cache-Control: no-cache\r\n"
+          "Connection: close\r\n"
+          "\r\n";
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<char*>(head.data());
+  iov[0].iov_len = head.size();
+  iov[1].iov_base = const_cast<char*>(body.data());
+  iov[1].iov_len = body.size();
+  SendResponse(sock, iov, 2);
+}
+
+// -------------------------------------------------------------------------
+// ParseByteRange: Parses a Range header for a file of size bytes. Returns
+// 206 with the inclusive range in first and last, 416 if the range lies
+// outside the file, or 200 with the whole file when there is no range or
+// it is not a single byte range.
+// -------------------------------------------------------------------------
+int ParseByteRange(const std::string& range, off_t size, off_t* first,
+                   off_t* last) {
+  *first = 0;
+  *last = size - 1;
+  if (range.compare(0, 6, "bytes=") != 0 ||
+      range.find(',') != std::string::npos)
+    return 200;
+  const char* spec = range.c_str() + 6;
+  char* end;
+  if (*spec == '-') {
+    // "bytes=-n": the last n bytes.
+    long long suffix = std::strtoll(spec + 1, &end, 10);
+    if (end == spec + 1 || *end != '\0' || suffix < 0) return 200;
+    if (suffix == 0 || size == 0) return 416;
+    *first = suffix < size ? size - suffix : 0;
+    return 206;
+  }
+  if (!isdigit(static_cast<unsigned char>(*spec))) return 200;
+  long long from = std::strtoll(spec, &end, 10);
+  if (*end != '-') return 200;
+  long long to = size - 1;
+  if (end[1] != '\0') {
+    const char* to_spec = end + 1;
+    to = std::strtoll(to_spec, &end, 10);
+    if (!isdigit(static_cast<unsigned char>(*to_spec)) || *end != '\0' ||
+        to < from)
+      return 200;
+  }
+  if (from >= size) return 416;
+  *first = from;
+  *last = std::min<long long>(to, size - 1);
+  return 206;
+}
+
+// -------------------------------------------------------------------------
+// StripPathPrefix: Removes prefix from the front of url_path if it is there
+// as a whole path segment.
+// -------------------------------------------------------------------------
+bool StripPathPrefix(std::string* url_path, const char* prefix) {
+  size_t len = std::strlen(prefix);
+  if (url_path->compare(0, len, prefix) != 0 ||
+      (url_path->size() > len && (*url_path)[len] != '/'))
+    return false;
+  url_path->erase(0, len);
+  return true;
+}
+
+// -------------------------------------------------------------------------
+// ServeRaw: Sends the file at path as it is on disk, or the byte range the
+// request asks for. The bytes go from the file to the socket with sendfile
+// and never pass through the process. What the socket cannot take at once
+// is sent from the event loop as it drains. Takes ownership of sock.
+// -------------------------------------------------------------------------
+void ServeRaw(int sock, const std::string& path, const std::string& request) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    const char* not_found =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Not found\n";
+    if (fd >= 0) close(fd);
+    SendResponse(sock, not_found);
+    return;
+  }
+
+  // Files under /proc report a size of zero; they are sent up to EOF, and
+  // the end of the response is marked by closing the connection.
+  off_t size = st.st_size;
+  bool sized = size > 0;
+  off_t first = 0, last = size - 1;
+  int status = 200;
+  if (sized)
+    status = ParseByteRange(RequestHeader(request, "Range"), size, &first,
+                            &last);
+  std::string head;
+  if (status == 416) {
+    head =
+        "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */" +
+        std::to_string(size) +
+        "\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+  } else {
+    head = status == 206 ? "HTTP/1.1 206 Partial Content\r\n"
+                         : "HTTP/1.1 200 OK\r\n";
+    head += "Content-Type: text/plain; charset=utf-8\r\n";
+    if (sized) {
+      head += "Accept-Ranges: bytes\r\n";
+      head += "Content-Length: " + std::to_string(last - first + 1) + "\r\n";
+    }
+    if (status == 206) {
+      head += "Content-Range: bytes " + std::to_string(first) + "-" +
+              std::to_string(last) + "/" + std::to_string(size) + "\r\n";
+    }
+    head += "Connection: close\r\n\r\n";
+  }
+  bool head_only = request.compare(0, 5, "HEAD ") == 0;
+  if (send(sock, head.data(), head.size(), MSG_NOSIGNAL) !=
+          static_cast<ssize_t>(head.size()) ||
+      status == 416 || head_only || (sized && first > last)) {
+    close(fd);
+    close(sock);
+    return;
+  }
+
+  RawTransfer transfer = {sock, fd, first, sized ? last + 1 : -1};
+  if (ContinueRawTransfer(&transfer)) {
+    RawTransfers[sock] = transfer;
+    Loop.Watch(sock, kWritable, [sock](uint32_t) { ResumeRawTransfer(sock); });
+  } else {
+    close(fd);
+    close(sock);
+  }
+}
+
+// -------------------------------------------------------------------------
+// ContinueRawTransfer: Sends as much of a raw download as the socket takes
+// without blocking. Returns false once it is complete or has failed.
+// -------------------------------------------------------------------------
+bool ContinueRawTransfer(RawTransfer* transfer) {
+  while (transfer->end < 0 || transfer->offset < transfer->end) {
+    size_t count = RAW_CHUNK_BYTES;
+    if (transfer->end >= 0)
+      count = std::min<off_t>(count, transfer->end - transfer->offset);
+    ssize_t sent =
+        sendfile(transfer->sock, transfer->fd, &transfer->offset, count);
+    if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      // The file does not support sendfile; copy it through a buffer.
+      char buffer[64 * 1024];
+      count = std::min(sizeof(buffer), count);
+      ssize_t got = pread(transfer->fd, buffer, count, transfer->offset);
+      if (got <= 0) return false;
+      sent = send(transfer->sock, buffer, got, MSG_NOSIGNAL);
+      if (sent > 0) transfer->offset += sent;
+    }
+    if (sent < 0) return errno == EAGAIN || errno == EINTR;
+    if (sent == 0) return false;  // The file ended early.
+    if (static_cast<size_t>(sent) < count) return true;  // Socket is full.
+  }
+  return false;
+}
+
+// -------------------------------------------------------------------------
+// ResumeRawTransfer: Continues a raw download once its socket can take more
+// data, and ends it when it is complete or has failed.
+// -------------------------------------------------------------------------
+void ResumeRawTransfer(int sock) {
+  auto it = RawTransfers.find(sock);
+  if (ContinueRawTransfer(&it->second)) return;
+  Loop.Unwatch(sock);
+  close(it->second.fd);
+  close(sock);
+  RawTransfers.erase(it);
+}
+
+// -------------------------------------------------------------------------
+// GenerateListingResponse: Lists a monitored directory with links to its
+// files and subdirectories.
+// -------------------------------------------------------------------------
+std::string GenerateListingResponse(const std::string& key,
+                                    const std::string& path) {
+  std::vector<std::string> names;
+  DIR* dir = opendir(path.c_str());
+  if (dir != nullptr) {
+    while (struct dirent* entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..") continue;
+      struct stat st;
+      if (stat((path + "/" + name).c_str(), &st) < 0) continue;
+      if (S_ISDIR(st.st_mode))
+        names.push_back(name + "/");
+      else if (S_ISREG(st.st_mode))
+        names.push_back(name);
+    }
+    closedir(dir);
+  }
+  std::sort(names.begin(), names.end());
+
+  std::string title = HtmlEscape(key.data(), key.size());
+  std::string base = key.empty() ? "/" : "/" + key + "/";
+  std::string response =
       "HTTP/1.1 200 OK\r\n"
       "Content-Type: text/html\r\n"
       "Connection: close\r\n"
       "\r\n"
       "<html>\n"
-      "<head>\n"
-      "  <meta charset=\"UTF-8\">\n"
-      "  <title>File Monitor</title>\n"
-      "  <style>\n"
-      "    body { margin: 0; padding: 0; display: flex; align-items: center; "
-      "justify-content: center; height: 100vh; background-color: #f7f7f7; "
-      "font-family: Arial, sans-serif; }\n"
-      "    .container { width: 80%%; max-width: 800px; text-align: center; }\n"
-      "    pre { background: #eee; padding: 20px; border: 1px solid #ccc; "
-      "overflow: auto; text-align: left; }\n"
-      "  </style>\n"
-      "</head>\n"
+      "<head><meta charset=\"UTF-8\"><title>File Monitor</title></head>\n"
       "<body>\n"
-      "  <div class=\"container\">\n"
-      "    <h1>File Monitor</h1>\n"
-      "    <pre id=\"content\">%s</pre>\n"
-      "  </div>\n"
-      "  <script>\n"
-      "    const ws = new WebSocket('ws://' + location.host);\n"
-      "    ws.onmessage = e => document.getElementById('content').textContent "
-      "= e.data;\n"
-      "  </script>\n"
-      "</body>\n"
-      "</html>\n";
-
-  int size_needed =
-      std::snprintf(nullptr, 0, html_template, FileContent.c_str());
-  std::vector<char> response(size_needed + 1);
-  std::snprintf(response.data(), response.size(), html_template,
-                FileContent.c_str());
-  return std::string(response.data());
-}
-
-// -------------------------------------------------------------------------
-// ProcessNewConnection: Accepts a new connection, performs a WebSocket
-// handshake if requested, or serves the HTML page with file content.
-// -------------------------------------------------------------------------
-void ProcessNewConnection(int server_fd, const std::string& filePath) {
-  struct sockaddr_in client_addr;
-  socklen_t client_len = sizeof(client_addr);
-  int client_fd = accept(
-      server_fd, reinterpret_cast<struct sockaddr*>(&client_addr), &client_len);
+      "  <h1>/" +
+      title + "</h1>\n  <ul>\n";
+  if (!key.empty()) response += "    <li><a href=\"../\">../</a></li>\n";
+  for (const std::string& name : names) {
+    std::string url = PercentEncodePath(base + name);
+    std::string href = HtmlEscape(url.data(), url.size());
+    std::string text = HtmlEscape(name.data(), name.size());
+    response += "    <li><a href=\"" + href + "\">" + text + "</a></li>\n";
+  }
+  response += "  </ul>\n</body>\n</html>\n";
+  return response;
+}
+
+// -------------------------------------------------------------------------
+// ProcessNewConnection: Accepts a new connection and reads its request from
+// the event loop. The connection is non-blocking from here on: it is only
+// read and written to when it is ready.
+// -------------------------------------------------------------------------
+void ProcessNewConnection(int server_fd) {
+  int client_fd =
+      accept4(server_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
   if (client_fd < 0) return;
+  PendingRequest& pending = PendingRequests[client_fd];
+  pending.timer = Loop.RunAfter(REQUEST_TIMEOUT_MS,
+                                [client_fd] { DropRequest(client_fd); });
+  Loop.Watch(client_fd, kReadable,
+             [client_fd](uint32_t) { ReadRequest(client_fd); });
+}
 
+// -------------------------------------------------------------------------
+// ReadRequest: Reads what has arrived of a request, and serves it once its
+// headers are complete. A connection whose request does not end within
+// MAX_REQUEST_BYTES is closed.
+// -------------------------------------------------------------------------
+void ReadRequest(int sock) {
+  PendingRequest& pending = PendingRequests[sock];
   char buffer[BUFFER_SIZE];
-  ssize_t bytes = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+  ssize_t bytes = recv(sock, buffer, sizeof(buffer), 0);
+  if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) return;
   if (bytes <= 0) {
-    close(client_fd);
+    DropRequest(sock);
+    return;
+  }
+  // The end may straddle what was read before.
+  size_t from = pending.data.size() < 3 ? 0 : pending.data.size() - 3;
+  pending.data.append(buffer, bytes);
+  size_t end = pending.data.find("\r\n\r\n", from);
+  if (end == std::string::npos) {
+    if (pending.data.size() >= MAX_REQUEST_BYTES) DropRequest(sock);
+    return;
+  }
+  std::string request = pending.data.substr(0, end + 4);
+  Loop.Cancel(pending.timer);
+  Loop.Unwatch(sock);
+  PendingRequests.erase(sock);
+  ServeRequest(sock, request);
+}
+
+// -------------------------------------------------------------------------
+// DropRequest: Closes a connection whose request was not served.
+// -------------------------------------------------------------------------
+void DropRequest(int sock) {
+  auto it = PendingRequests.find(sock);
+  Loop.Cancel(it->second.timer);
+  Loop.Unwatch(sock);
+  close(sock);
+  PendingRequests.erase(it);
+}
+
+// -------------------------------------------------------------------------
+// ServeRequest: Performs a WebSocket handshake if requested, or serves the
+// HTML page with file content. The request path selects the file, for the
+// page and the WebSocket alike. Takes ownership of sock.
+// -------------------------------------------------------------------------
+void ServeRequest(int client_fd, const std::string& request) {
+  std::string url_path = RequestPath(request);
+  bool raw = StripPathPrefix(&url_path, RAW_PREFIX);
+  bool history = !raw && StripPathPrefix(&url_path, HISTORY_PREFIX);
+  std::string key, path;
+  bool is_directory;
+  MonitoredFile* file = nullptr;
+  if (ResolveRequestPath(url_path, &key, &path, &is_directory) &&
+      !is_directory) {
+    if (raw) {
+      ServeRaw(client_fd, path, request);
+      return;
+    }
+    if (history) {
+      ServeHistory(client_fd, key, request);
+      return;
+    }
+    file = Cache.Get(key, path);
+    if (!EnsureLoaded(file)) {
+      Cache.Forget(file);
+      file = nullptr;
+    }
+  }
+  if (file == nullptr && (!is_directory || raw || history)) {
+    const char* not_found =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Not found\n";
+    SendResponse(client_fd, not_found);
     return;
   }
-  buffer[bytes] = '\0';
 
-  std::string request(buffer);
   // Check if the request is a WebSocket upgrade
-  if (request.find("Upgrade: websocket") != std::string::npos) {
+  if (file != nullptr &&
+      request.find("Upgrade: websocket") != std::string::npos) {
     size_t pos = request.find("Sec-WebSocket-Key: ");
     if (pos != std::string::npos) {
       pos += std::strlen("Sec-WebSocket-Key: ");
@@ -251,134 +1720,588 @@ void ProcessNewConnection(int server_fd, const std::string& filePath) {
       if (end != std::string::npos) {
         std::string key = request.substr(pos, end - pos);
         HandleHandshake(client_fd, key);
-        AddClient(client_fd);
+        AddClient(client_fd, file);
+        // A page reconnecting at a version is sent what it missed.
+        std::string since;
+        if (RequestQueryValue(request, "since", &since))
+          SyncClient(client_fd, ResumeVersion(since));
         return;
       }
     }
   }
-  // Serve the HTML page with initial file content
-  std::string htmlResponse = GenerateHtmlResponse();
-  send(client_fd, htmlResponse.c_str(), htmlResponse.size(), 0);
-  close(client_fd);
+  if (file == nullptr) {
+    SendResponse(client_fd, GenerateListingResponse(key, path));
+  } else {
+    // Serve the HTML page with initial file content
+    ServePage(client_fd, file, request);
+  }
+  Cache.Trim();
+}
+// -------------------------------------------------------------------------
+// CompleteUtf8Length: The length of data without a UTF-8 character cut off
+// at its end. Text frames must be valid UTF-8, and a writer may stop in the
+// middle of a character; its remaining bytes come with the next append.
+// -------------------------------------------------------------------------
+size_t CompleteUtf8Length(const char* data, size_t len) {
+  for (size_t back = 1; back <= 4 && back <= len; back++) {
+    unsigned char c = data[len - back];
+    if ((c & 0xC0) == 0x80) continue;  // Inside a character.
+    size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return need > back && c < 0xF8 ? len - back : len;
+  }
+  return len;
+}
+// -------------------------------------------------------------------------
+// OpenTail: (Re)opens the file for tail mode and records its identity.
+// -------------------------------------------------------------------------
+bool OpenTail(MonitoredFile* file) {
+  if (file->tail_fd >= 0) close(file->tail_fd);
+  file->tail_fd = open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file->tail_fd < 0) return false;
+  struct stat st;
+  if (fstat(file->tail_fd, &st) < 0) return false;
+  file->tail_device = st.st_dev;
+  file->tail_inode = st.st_ino;
+  return true;
+}
+// -------------------------------------------------------------------------
+// TailFile: Reads only the bytes appended since the last read with pread and
+// broadcasts them as "A<base> <version>\n<bytes>", up to the last complete
+// UTF-8 character. The journal, the history and siblings get the same
+// bytes. A different inode at the path (rotation) or a file shorter than
+// what was read (truncation) falls back to a full reload and snapshot.
+// -------------------------------------------------------------------------
+void TailFile(MonitoredFile* file) {
+  struct stat st;
+  // Rotated away, not yet recreated.
+  if (stat(file->path.c_str(), &st) < 0) return;
+  if (st.st_dev != file->tail_device || st.st_ino != file->tail_inode ||
+      st.st_size < file->tail_offset) {
+    if (!OpenTail(file) || fstat(file->tail_fd, &st) < 0 ||
+        !file->content.LoadPrefix(file->tail_fd, st.st_size))
+      return;
+    size_t complete =
+        CompleteUtf8Length(file->content.data(), file->content.size());
+    if (complete < file->content.size() &&
+        !file->content.LoadPrefix(file->tail_fd, complete))
+      return;
+    file->tail_offset = complete;
+    file->tail_stale = false;
+    bool same = RehashContent(file);
+    BuildLineOffsets(file->content.data(), file->content.size(),
+                     &file->lines);
+    Cache.Loaded(file);
+    if (same) return;  // Rewritten with the same bytes.
+    RecordChange(file, file->version++, "", nullptr, 0);
+    LogHistory(file, "", nullptr, 0);
+    ShareVersion(file, nullptr, 0);
+    BroadcastSnapshot(file);
+    return;
+  }
+  if (st.st_size == file->tail_offset) return;
+
+  std::string appended(st.st_size - file->tail_offset, '\0');
+  size_t got = 0;
+  while (got < appended.size()) {
+    ssize_t n = pread(file->tail_fd, &appended[got], appended.size() - got,
+                      file->tail_offset + got);
+    if (n <= 0) break;
+    got += n;
+  }
+  // A character still being written is read again with the rest of it.
+  got = CompleteUtf8Length(appended.data(), got);
+  if (got == 0) return;
+  appended.resize(got);
+  file->tail_offset += got;
+  file->tail_stale = true;
+  file->hash.Update(appended.data(), appended.size());
+  size_t old_lines = file->lines.LineCount();
+  AppendLineOffsets(appended.data(), appended.size(), &file->lines);
+  Cache.Loaded(file);
+
+  // Only the last line and the ones after it change, so a window above them
+  // just needs the new line count.
+  uint64_t base = file->version++;
+  std::string head = "A" + std::to_string(base) + " " +
+                     std::to_string(file->version) + "\n";
+  RecordChange(file, base, head, appended.data(), appended.size());
+  LogHistory(file, head, appended.data(), appended.size());
+  ShareVersion(file, appended.data(), appended.size());
+  for (int sock : file->subscribers) {
+    const ClientView& view = ClientViews[sock];
+    if (!view.windowed) {
+      SendWsMessage(sock, head, appended.data(), appended.size());
+    } else {
+      LineEdit tail_edit = {old_lines - 1, 1, old_lines - 1,
+                            file->lines.LineCount() - old_lines + 1};
+      std::vector<LineEdit> edits(1, tail_edit);
+      UpdateWindow(sock, view, &edits, old_lines);
+    }
+  }
+}
+// -------------------------------------------------------------------------
+// MonotonicMs: Milliseconds on the monotonic clock.
+// -------------------------------------------------------------------------
+uint64_t MonotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
 }
 
 // -------------------------------------------------------------------------
-// ProcessClientMessages: Handles messages from connected clients and removes
-// any that have disconnected.
+// LoadSharedFile: Maps the content of the file from the broker's region of
+// it, asking the broker for the region the first time.
 // -------------------------------------------------------------------------
-void ProcessClientMessages(fd_set* fds) {
-  for (auto it = Clients.begin(); it != Clients.end();) {
-    int sock = *it;
-    if (FD_ISSET(sock, fds)) {
-      char buffer[128];
-      if (recv(sock, buffer, sizeof(buffer), 0) <= 0) {
-        close(sock);
-        it = Clients.erase(it);
-        continue;
+bool LoadSharedFile(MonitoredFile* file) {
+  if (file->shared_fd < 0) {
+    char resolved[PATH_MAX];
+    if (realpath(file->path.c_str(), resolved) == nullptr) return false;
+    std::string path = resolved;
+    if (!SendBrokerMessage(AttachFd, "watch " + path, -1, true)) BrokerGone();
+    // Change notices for other files may come before the answer.
+    while (file->shared_fd < 0) {
+      std::string message;
+      int fd;
+      if (!ReceiveBrokerMessage(AttachFd, &message, &fd, true)) BrokerGone();
+      if (message == "file " + path && fd >= 0) {
+        file->shared_fd = fd;
+        SharedKeys[path] = file->key;
+      } else if (message == "missing " + path) {
+        return false;
+      } else {
+        HandleBrokerNotice(message, fd);
       }
     }
-    ++it;
   }
+  return file->content.LoadShared(file->shared_fd);
 }
-
 // -------------------------------------------------------------------------
-// SHA-1 Implementation
+// HandleBrokerNotice: Takes a change notice from the broker like an inotify
+// event.
 // -------------------------------------------------------------------------
-#define SHA1_ROTL(bits, word) (((word) << (bits)) | ((word) >> (32 - (bits))))
+void HandleBrokerNotice(const std::string& message, int fd) {
+  if (fd >= 0) close(fd);
+  if (message.compare(0, 8, "changed ") != 0) return;
+  auto it = SharedKeys.find(message.substr(8));
+  if (it != SharedKeys.end()) NoteFileChange(it->second);
+}
+// -------------------------------------------------------------------------
+// ReadBrokerNotices: Handles every message queued from the broker.
+// -------------------------------------------------------------------------
+void ReadBrokerNotices() {
+  std::string message;
+  int fd;
+  while (ReceiveBrokerMessage(AttachFd, &message, &fd, false))
+    HandleBrokerNotice(message, fd);
+  if (errno != EAGAIN) BrokerGone();
+}
+// -------------------------------------------------------------------------
+// BrokerGone: A sibling cannot see changes without its broker.
+// -------------------------------------------------------------------------
+void BrokerGone() {
+  std::cerr << "Lost the connection to the broker" << std::endl;
+  exit(1);
+}
 
-void Sha1Transform(uint32_t state[5], const unsigned char buffer[64]) {
-  uint32_t a, b, c, d, e, temp, w[80];
-  int i;
-  for (i = 0; i < 16; i++) {
-    w[i] = ((uint32_t)buffer[i * 4] << 24) |
-           ((uint32_t)buffer[i * 4 + 1] << 16) |
-           ((uint32_t)buffer[i * 4 + 2] << 8) | ((uint32_t)buffer[i * 4 + 3]);
+// -------------------------------------------------------------------------
+// ShareVersion: In a broker, publishes the new version of the file to its
+// shared region, as just the appended bytes in tail mode, and tells the
+// siblings watching it.
+// -------------------------------------------------------------------------
+void ShareVersion(MonitoredFile* file, const char* appended, size_t len) {
+  if (!file->shared) return;
+  if (appended != nullptr)
+    file->shared->Append(appended, len);
+  else
+    file->shared->Publish(file->content.data(), file->content.size());
+  for (int sock : file->siblings)
+    NotifySibling(sock, Siblings[sock].paths[file->key]);
+}
+// -------------------------------------------------------------------------
+// NotifySibling: Sends a change notice without blocking. A notice that does
+// not fit waits until the socket has room; notices for the same file are
+// sent once.
+// -------------------------------------------------------------------------
+void NotifySibling(int sock, const std::string& path) {
+  SiblingMonitor& sibling = Siblings[sock];
+  if (sibling.replies.empty() && sibling.unsent.empty() &&
+      SendBrokerMessage(sock, "changed " + path, -1, false))
+    return;
+  sibling.unsent.insert(path);
+  Loop.SetEvents(sock, kReadable | kWritable);
+}
+// -------------------------------------------------------------------------
+// ReplyToSibling: Sends a sibling the answer to its request, with fd
+// attached unless it is negative, or queues it until the socket has room.
+// Takes ownership of fd.
+// -------------------------------------------------------------------------
+void ReplyToSibling(int sock, const std::string& message, int fd) {
+  SiblingMonitor& sibling = Siblings[sock];
+  if (sibling.replies.empty() && SendBrokerMessage(sock, message, fd, false)) {
+    if (fd >= 0) close(fd);
+    return;
   }
-  for (i = 16; i < 80; i++)
-    w[i] = SHA1_ROTL(1, w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16]);
-
-  a = state[0];
-  b = state[1];
-  c = state[2];
-  d = state[3];
-  e = state[4];
-
-  for (i = 0; i < 80; i++) {
-    if (i < 20)
-      temp = SHA1_ROTL(5, a) + ((b & c) | ((~b) & d)) + e + 0x5A827999 + w[i];
-    else if (i < 40)
-      temp = SHA1_ROTL(5, a) + (b ^ c ^ d) + e + 0x6ED9EBA1 + w[i];
-    else if (i < 60)
-      temp = SHA1_ROTL(5, a) + ((b & c) | (b & d) | (c & d)) + e + 0x8F1BBCDC +
-             w[i];
-    else
-      temp = SHA1_ROTL(5, a) + (b ^ c ^ d) + e + 0xCA62C1D6 + w[i];
-
-    e = d;
-    d = c;
-    c = SHA1_ROTL(30, b);
-    b = a;
-    a = temp;
-  }
-
-  state[0] += a;
-  state[1] += b;
-  state[2] += c;
-  state[3] += d;
-  state[4] += e;
-}
-
-void Sha1Init(Sha1Ctx* context) {
-  context->state[0] = 0x67452301;
-  context->state[1] = 0xEFCDAB89;
-  context->state[2] = 0x98BADCFE;
-  context->state[3] = 0x10325476;
-  context->state[4] = 0xC3D2E1F0;
-  context->count[0] = context->count[1] = 0;
-}
-
-void Sha1Update(Sha1Ctx* context, const unsigned char* data, uint32_t len) {
-  uint32_t i, j = (context->count[0] >> 3) & 63;
-  if ((context->count[0] += len << 3) < (len << 3)) context->count[1]++;
-  context->count[1] += (len >> 29);
-
-  if (j + len > 63) {
-    uint32_t part_len = 64 - j;
-    std::memcpy(&context->buffer[j], data, part_len);
-    Sha1Transform(context->state, context->buffer);
-    for (i = part_len; i + 63 < len; i += 64)
-      Sha1Transform(context->state, &data[i]);
-    j = 0;
-  } else {
-    i = 0;
+  sibling.replies.emplace_back(message, fd);
+  Loop.SetEvents(sock, kReadable | kWritable);
+}
+// -------------------------------------------------------------------------
+// FlushSibling: Sends the waiting answers, then the waiting change notices,
+// of a sibling with room.
+// -------------------------------------------------------------------------
+void FlushSibling(int sock) {
+  SiblingMonitor& sibling = Siblings[sock];
+  while (!sibling.replies.empty() &&
+         SendBrokerMessage(sock, sibling.replies.front().first,
+                           sibling.replies.front().second, false)) {
+    if (sibling.replies.front().second >= 0)
+      close(sibling.replies.front().second);
+    sibling.replies.pop_front();
+  }
+  if (!sibling.replies.empty()) return;
+  std::set<std::string>& unsent = sibling.unsent;
+  while (!unsent.empty() &&
+         SendBrokerMessage(sock, "changed " + *unsent.begin(), -1, false))
+    unsent.erase(unsent.begin());
+  if (unsent.empty()) Loop.SetEvents(sock, kReadable);
+}
+// -------------------------------------------------------------------------
+// AcceptSibling: Accepts a sibling monitor on the broker socket.
+// -------------------------------------------------------------------------
+void AcceptSibling() {
+  int sock = accept4(BrokerFd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (sock < 0) return;
+  Siblings[sock];
+  Loop.Watch(sock, kReadable,
+             [sock](uint32_t events) { HandleSiblingEvents(sock, events); });
+}
+// -------------------------------------------------------------------------
+// HandleSiblingEvents: Answers the requests of a sibling monitor, removes it
+// once it has gone, and sends it the notices that waited for room.
+// -------------------------------------------------------------------------
+void HandleSiblingEvents(int sock, uint32_t events) {
+  if (events & kReadable) {
+    std::string message;
+    int fd;
+    while (ReceiveBrokerMessage(sock, &message, &fd, false)) {
+      if (fd >= 0) close(fd);
+      if (message.compare(0, 6, "watch ") == 0)
+        ServeSibling(sock, message.substr(6));
+    }
+    if (errno != EAGAIN) {
+      RemoveSibling(sock);
+      return;
+    }
+  }
+  if (events & kWritable) FlushSibling(sock);
+}
+// -------------------------------------------------------------------------
+// ServeSibling: Answers a sibling asking for the file at the real path with
+// a read-only descriptor of its shared region, which is created and filled
+// the first time any sibling asks. Only files this monitor watches can be
+// shared: below the tree, the rest of the path is resolved like that of a
+// request, so ".." and symlinks cannot lead out of it.
+// -------------------------------------------------------------------------
+void ServeSibling(int sock, const std::string& path) {
+  std::string key;
+  std::string prefix = MonitorRootReal == "/" ? "/" : MonitorRootReal + "/";
+  if (!MonitorFile.empty()) {
+    char resolved[PATH_MAX];
+    std::string own = MonitorRoot + "/" + MonitorFile;
+    if (realpath(own.c_str(), resolved) != nullptr && path == resolved)
+      key = MonitorFile;
+  } else if (path.compare(0, prefix.size(), prefix) == 0) {
+    std::string file_path;
+    bool is_directory;
+    if (!ResolveRequestPath(path.substr(prefix.size()), &key, &file_path,
+                            &is_directory) ||
+        is_directory)
+      key.clear();
+  }
+  MonitoredFile* file =
+      key.empty() ? nullptr : Cache.Get(key, MonitorRoot + "/" + key);
+  int fd = -1;
+  if (file != nullptr && EnsureLoaded(file)) {
+    RefreshFileContent(file);
+    if (!file->shared) {
+      std::unique_ptr<SharedRegion> region(new SharedRegion());
+      if (region->Create("monitor:" + key) &&
+          region->Publish(file->content.data(), file->content.size()))
+        file->shared = std::move(region);
+    }
+    if (file->shared) fd = file->shared->OpenReadOnly();
+  }
+  if (fd < 0) {
+    ReplyToSibling(sock, "missing " + path, -1);
+    if (file != nullptr) Cache.Forget(file);
+    Cache.Trim();
+    return;
+  }
+  if (std::find(file->siblings.begin(), file->siblings.end(), sock) ==
+      file->siblings.end())
+    file->siblings.push_back(sock);
+  Siblings[sock].paths[key] = path;
+  ReplyToSibling(sock, "file " + path, fd);
+}
+// -------------------------------------------------------------------------
+// RemoveSibling: Forgets a sibling monitor. A file no sibling watches any
+// more drops its shared region.
+// -------------------------------------------------------------------------
+void RemoveSibling(int sock) {
+  auto it = Siblings.find(sock);
+  for (const auto& reply : it->second.replies)
+    if (reply.second >= 0) close(reply.second);
+  for (const auto& entry : it->second.paths) {
+    MonitoredFile* file = Cache.Find(entry.first);
+    if (file == nullptr) continue;
+    file->siblings.erase(
+        std::remove(file->siblings.begin(), file->siblings.end(), sock),
+        file->siblings.end());
+    if (file->siblings.empty()) file->shared.reset();
   }
-  std::memcpy(&context->buffer[j], &data[i], len - i);
+  Siblings.erase(it);
+  Loop.Unwatch(sock);
+  close(sock);
+  Cache.Trim();
 }
 
-void Sha1Final(unsigned char digest[20], Sha1Ctx* context) {
-  unsigned char final_count[8];
-  for (int i = 0; i < 8; i++)
-    final_count[i] = static_cast<unsigned char>(
-        (context->count[(i >= 4 ? 0 : 1)] >> ((3 - (i & 3)) * 8)) & 255);
+// -------------------------------------------------------------------------
+// NoteFileChange: Records a change event for the file at key. Files nobody
+// watches are simply evicted, so they are reloaded fresh when next asked
+// for; watched files, here or by a sibling, and all files with --history,
+// are published once their changes settle.
+// -------------------------------------------------------------------------
+void NoteFileChange(const std::string& key) {
+  MonitoredFile* file = Cache.Find(key);
+  if (file == nullptr || !file->loaded) return;
+  // A page that just disconnected may come back; keep journaling for it.
+  // With a history, every version of a loaded file is recorded, so it stays
+  // loaded until the cache evicts it.
+  bool resumable = file->unsubscribed_ms != 0 &&
+                   MonotonicMs() - file->unsubscribed_ms < RESUME_GRACE_MS;
+  if (file->subscribers.empty() && file->siblings.empty() && !resumable &&
+      !History.enabled()) {
+    Cache.Unload(file);
+    Cache.Forget(file);
+    return;
+  }
+  file->last_change_ms = MonotonicMs();
+  if (!file->change_pending) {
+    file->first_change_ms = file->last_change_ms;
+    file->change_pending = true;
+    PendingFiles.push_back(file);
+    // A timer already set is due no later than this change.
+    if (PublishTimer == 0)
+      PublishTimer = Loop.RunAfter(DebounceMs, PublishPendingChanges);
+  }
+}
 
-  Sha1Update(context, reinterpret_cast<const unsigned char*>("\x80"), 1);
-  while ((context->count[0] & 504) != 448)
-    Sha1Update(context, reinterpret_cast<const unsigned char*>("\0"), 1);
-  Sha1Update(context, final_count, 8);
-  for (int i = 0; i < 20; i++)
-    digest[i] = static_cast<unsigned char>(
-        (context->state[i >> 2] >> ((3 - (i & 3)) * 8)) & 255);
+// -------------------------------------------------------------------------
+// PollFiles: Stats the loaded files that are due to be polled and notes the
+// ones that changed, then sets the timer for the next poll.
+// -------------------------------------------------------------------------
+void PollFiles() {
+  uint64_t wait_ms = Poller.Poll(
+      MonotonicMs(),
+      [](const std::string& key) {
+        MonitoredFile* file = Cache.Find(key);
+        return file != nullptr && file->loaded;
+      },
+      NoteFileChange);
+  PollTimer = wait_ms == UINT64_MAX ? 0 : Loop.RunAfter(wait_ms, PollFiles);
 }
 
+// -------------------------------------------------------------------------
+// PublishPendingChanges: Reloads and publishes every file that has been quiet
+// for the debounce window, or has waited for the max latency, then sets the
+// timer for the next pending change.
+// -------------------------------------------------------------------------
+void PublishPendingChanges() {
+  uint64_t now = MonotonicMs();
+  uint64_t next_ms = UINT64_MAX;
+  for (size_t i = 0; i < PendingFiles.size();) {
+    MonitoredFile* file = PendingFiles[i];
+    uint64_t due = std::min(file->last_change_ms + DebounceMs,
+                            file->first_change_ms + MaxLatencyMs);
+    if (due > now) {
+      next_ms = std::min(next_ms, due - now);
+      i++;
+      continue;
+    }
+    PendingFiles[i] = PendingFiles.back();
+    PendingFiles.pop_back();
+    file->change_pending = false;
+    if (!file->loaded) {  // Evicted meanwhile.
+      Cache.Forget(file);
+      continue;
+    }
+    if (TailMode) {
+      TailFile(file);
+    } else if (LoadFile(file)) {
+      PublishFileUpdate(file);
+    }
+  }
+  Loop.Cancel(PublishTimer);
+  PublishTimer =
+      next_ms == UINT64_MAX ? 0 : Loop.RunAfter(next_ms, PublishPendingChanges);
+}
+// -------------------------------------------------------------------------
+// HandleClientEvents: Handles the messages of a client, removes it once it
+// has disconnected, and continues its output when its socket has room.
+// -------------------------------------------------------------------------
+void HandleClientEvents(int sock, uint32_t events) {
+  if (events & kReadable) {
+    char buffer[BUFFER_SIZE];
+    ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      RemoveClient(sock);
+      return;
+    }
+    if (n > 0) {
+      ClientViews[sock].input.append(buffer, n);
+      if (!HandleClientFrames(sock)) return;
+    }
+  }
+  if ((events & kWritable) && ClientViews.count(sock) != 0) FlushClient(sock);
+}
+// -------------------------------------------------------------------------
+// HandleClientFrames: Handles the whole frames a client has sent, and keeps
+// the start of an incomplete one for later. "sync <version>" asks for a
+// snapshot unless the page already shows the current version; "view
+// <first> <count>" switches the client to a window of lines. A close frame
+// is answered and the client removed. Returns false if the client was
+// removed.
+// -------------------------------------------------------------------------
+bool HandleClientFrames(int sock) {
+  ClientView& view = ClientViews[sock];
+  MonitoredFile* file = view.file;
+  size_t pos = 0;
+  while (pos < view.input.size()) {
+    WSOpcode opcode;
+    ByteView payload;
+    size_t used = ParseWSFrameInPlace(
+        reinterpret_cast<uint8_t*>(&view.input[pos]), view.input.size() - pos,
+        &opcode, &payload);
+    if (used == 0) break;
+    pos += used;
+    if (opcode == WSOpcode::CLOSE) {
+      // Echo the status code, if any, as the closing handshake asks.
+      SendWsFrame(sock, static_cast<uint8_t>(WSOpcode::CLOSE), "",
+                  payload.data, std::min<size_t>(payload.size, 2));
+      RemoveClient(sock);
+      return false;
+    }
+    if (opcode == WSOpcode::PING) {
+      SendWsFrame(sock, static_cast<uint8_t>(WSOpcode::PONG), "",
+                  payload.data, payload.size);
+      continue;
+    }
+    if (opcode != WSOpcode::TEXT) continue;
+    std::string message = ToString(payload);
+    if (message.compare(0, 5, "sync ") == 0) {
+      SyncClient(sock, std::strtoull(message.c_str() + 5, nullptr, 10));
+    } else if (message.compare(0, 5, "view ") == 0 && !file->binary &&
+               file->render == RenderKind::kNone) {
+      char* end;
+      view.first_line = std::strtoull(message.c_str() + 5, &end, 10);
+      view.line_count = std::min<size_t>(std::strtoull(end, nullptr, 10),
+                                         MAX_WINDOW_LINES);
+      view.windowed = true;
+      RefreshFileContent(file);
+      SendWindow(sock, view);
+      CheckContentTorn(file);
+    }
+  }
+  view.input.erase(0, pos);
+  if (view.input.size() > MAX_CLIENT_INPUT_BYTES) {
+    RemoveClient(sock);
+    return false;
+  }
+  return true;
+}
 // -------------------------------------------------------------------------
 // main: Entry point. Initializes server, inotify, and handles events.
 // -------------------------------------------------------------------------
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " <file-path>" << std::endl;
+  std::string monitorPath;
+  std::string historyDir;
+  std::string brokerPath;
+  std::string attachPath;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--tail") == 0) {
+      TailMode = true;
+    } else if (std::strcmp(argv[i], "--poll") == 0) {
+      PollMode = true;
+    } else if (std::strcmp(argv[i], "--render") == 0) {
+      RenderMode = true;
+    } else if (std::strncmp(argv[i], "--port=", 7) == 0) {
+      Port = std::atoi(argv[i] + 7);
+    } else if (std::strncmp(argv[i], "--broker=", 9) == 0) {
+      brokerPath = argv[i] + 9;
+    } else if (std::strncmp(argv[i], "--attach=", 9) == 0) {
+      attachPath = argv[i] + 9;
+    } else if (std::strncmp(argv[i], "--history=", 10) == 0) {
+      historyDir = argv[i] + 10;
+    } else if (std::strncmp(argv[i], "--debounce=", 11) == 0) {
+      DebounceMs = std::atoi(argv[i] + 11);
+    } else if (std::strncmp(argv[i], "--max-latency=", 14) == 0) {
+      MaxLatencyMs = std::atoi(argv[i] + 14);
+    } else if (std::strncmp(argv[i], "--cache-mb=", 11) == 0) {
+      Cache.set_max_bytes(static_cast<size_t>(std::atoi(argv[i] + 11)) << 20);
+    } else if (monitorPath.empty() && argv[i][0] != '-') {
+      monitorPath = argv[i];
+    } else {
+      monitorPath.clear();
+      break;
+    }
+  }
+  // A sibling takes whole versions from the broker, so it cannot tail.
+  if (monitorPath.empty() || (!brokerPath.empty() && !attachPath.empty()) ||
+      (!attachPath.empty() && TailMode)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--tail] [--poll] [--debounce=<ms>] [--max-latency=<ms>]"
+                 " [--cache-mb=<n>] [--history=<dir>] [--render]"
+                 " [--port=<n>] [--broker=<socket> | --attach=<socket>]"
+                 " <path>"
+              << std::endl;
+    return 1;
+  }
+  if (MaxLatencyMs < DebounceMs) MaxLatencyMs = DebounceMs;
+
+  struct stat st;
+  if (stat(monitorPath.c_str(), &st) < 0) {
+    perror(monitorPath.c_str());
+    return 1;
+  }
+  bool directory = S_ISDIR(st.st_mode);
+  if (directory) {
+    MonitorRoot = monitorPath;
+  } else {
+    size_t slash = monitorPath.rfind('/');
+    MonitorRoot = slash == std::string::npos ? "."
+                  : slash == 0              ? "/"
+                                            : monitorPath.substr(0, slash);
+    MonitorFile = slash == std::string::npos ? monitorPath
+                                             : monitorPath.substr(slash + 1);
+  }
+  char resolved[PATH_MAX];
+  if (realpath(MonitorRoot.c_str(), resolved) == nullptr) {
+    perror(MonitorRoot.c_str());
+    return 1;
+  }
+  MonitorRootReal = resolved;
+  char instance[32];
+  std::snprintf(instance, sizeof(instance), "%lx%x",
+                static_cast<unsigned long>(time(nullptr)),
+                static_cast<unsigned>(getpid()));
+  InstanceTag = instance;
+  if (!brokerPath.empty() && (BrokerFd = ListenBroker(brokerPath)) < 0) {
+    perror(brokerPath.c_str());
+    return 1;
+  }
+  if (!attachPath.empty() && (AttachFd = ConnectBroker(attachPath)) < 0) {
+    perror(attachPath.c_str());
     return 1;
   }
-  std::string filePath = argv[1];
 
   // Create server socket
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -392,7 +2315,7 @@ int main(int argc, char* argv[]) {
   struct sockaddr_in addr;
   std::memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
-  addr.sin_port = htons(PORT);
+  addr.sin_port = htons(Port);
   addr.sin_addr.s_addr = INADDR_ANY;
   if (bind(server_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) <
       0) {
@@ -404,64 +2327,66 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  // Initialize inotify for file monitoring
-  int inotify_fd = inotify_init();
-  if (inotify_fd < 0) {
-    perror("inotify_init");
-    return 1;
+  // Initialize inotify for file monitoring. A single file is watched through
+  // its directory; a directory with everything below it. Where inotify
+  // misses changes or cannot be used, the files are polled instead. A
+  // sibling is told of changes by its broker.
+  TreeWatcher watcher;
+  if (AttachFd >= 0) {
+    PollMode = false;
+  } else if (!PollMode && NeedsPolling(MonitorRoot)) {
+    std::cout << MonitorRoot << " is on a network or FUSE filesystem;"
+              << " polling for changes" << std::endl;
+    PollMode = true;
   }
-  int wd = inotify_add_watch(inotify_fd, filePath.c_str(), IN_MODIFY);
-  if (wd < 0) {
-    perror("inotify_add_watch");
-    return 1;
+  if (AttachFd < 0 && !PollMode && !watcher.Watch(MonitorRoot, directory)) {
+    std::cerr << "inotify unavailable; polling for changes" << std::endl;
+    PollMode = true;
   }
-
-  if (!LoadFile(filePath)) {
-    std::cerr << "Error loading file: " << filePath << std::endl;
+  int inotify_fd = PollMode || AttachFd >= 0 ? -1 : watcher.fd();
+  if (!Compressor.Start(Z_DEFAULT_COMPRESSION)) {
+    perror("pipe");
     return 1;
   }
+  int compressor_fd = Compressor.fd();
+  if (!historyDir.empty() &&
+      !History.Start(historyDir, HISTORY_COMMIT_MS))
+    return 1;
 
-  std::cout << "Monitoring " << filePath << " on port " << PORT << std::endl;
-
-  // Main loop: wait for events from the server socket, inotify, or clients.
-  while (true) {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(server_fd, &fds);
-    FD_SET(inotify_fd, &fds);
-    int max_fd = std::max(server_fd, inotify_fd);
-
-    // Add client sockets
-    for (int sock : Clients) {
-      FD_SET(sock, &fds);
-      if (sock > max_fd) max_fd = sock;
-    }
-
-    int ret = select(max_fd + 1, &fds, nullptr, nullptr, nullptr);
-    if (ret < 0) {
-      perror("select");
-      continue;
-    }
-
-    // Process file change events
-    if (FD_ISSET(inotify_fd, &fds)) {
-      char event_buf[EVENT_BUF_LEN];
-      int len = read(inotify_fd, event_buf, EVENT_BUF_LEN);
-      if (len > 0) {
-        if (LoadFile(filePath)) {
-          BroadcastToClients(FileContent);
-        }
-      }
+  if (!directory) {
+    MonitoredFile* file =
+        Cache.Get(MonitorFile, MonitorRoot + "/" + MonitorFile);
+    if (!EnsureLoaded(file)) {
+      std::cerr << "Error loading file: " << monitorPath << std::endl;
+      return 1;
     }
+    RenderPage(file);  // So the first request can get it compressed.
+  }
 
-    // Process new incoming connection
-    if (FD_ISSET(server_fd, &fds)) ProcessNewConnection(server_fd, filePath);
+  std::cout << "Monitoring " << monitorPath << " on port " << Port
+            << std::endl;
 
-    // Process messages from connected clients
-    ProcessClientMessages(&fds);
+  // From here on everything happens in handlers of the event loop: of the
+  // server socket, file changes, the compressor, the broker and, as they
+  // come and go, clients, raw downloads and siblings.
+  Loop.Watch(server_fd, kReadable,
+             [server_fd](uint32_t) { ProcessNewConnection(server_fd); });
+  // Record file change events; the reload happens once they settle.
+  if (inotify_fd >= 0) {
+    Loop.Watch(inotify_fd, kReadable,
+               [&watcher](uint32_t) { watcher.ReadEvents(NoteFileChange); });
   }
+  // Keep pages the compressor has finished.
+  Loop.Watch(compressor_fd, kReadable, [](uint32_t) {
+    Compressor.Collect(StoreCompressedPage);
+    Cache.Trim();
+  });
+  if (BrokerFd >= 0)
+    Loop.Watch(BrokerFd, kReadable, [](uint32_t) { AcceptSibling(); });
+  if (AttachFd >= 0)
+    Loop.Watch(AttachFd, kReadable, [](uint32_t) { ReadBrokerNotices(); });
+  bool ok = Loop.Run();
 
   close(server_fd);
-  close(inotify_fd);
-  return 0;
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,232 @@
+// File content shared between monitor processes on one host.
+//
+// Several monitors watching overlapping files would each read every change
+// and hold their own copy. Instead one of them can act as broker: it watches
+// each file once and publishes its content into a shared-memory region, a
+// memfd, and sibling monitors map that region read-only and serve their
+// pages from it without reading the file themselves.
+//
+// A region is a SharedSnapshotHeader followed by the content. The broker
+// rewrites the content in place under a sequence lock: the sequence is odd
+// while a write is in progress and moves on with every write. A reader takes
+// the content at an even sequence and, like the mapping of a file (see
+// file_snapshot.h), uses it in place; it checks the sequence again after
+// serving it to learn whether the content changed underneath. The region only
+// ever grows, so a reader's mapping never loses its backing.
+//
+// Broker and siblings talk over a Unix SOCK_SEQPACKET socket, one line per
+// message: a sibling sends "watch <path>" for the real path of a file; the
+// broker answers "file <path>" with a read-only descriptor of the region
+// attached (SCM_RIGHTS), or "missing <path>", and later sends
+// "changed <path>" after every new version it publishes.
+
+#ifndef WEBSOCKET_SRC_SHARED_SNAPSHOT_H_
+#define WEBSOCKET_SRC_SHARED_SNAPSHOT_H_
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "the sequence lock needs lock-free 64-bit atomics");
+
+// --- Start of a shared region ---
+struct SharedSnapshotHeader {
+  std::atomic<uint64_t> sequence;  // odd while the content is written
+  uint64_t size;                   // bytes of content
+  char padding[48];
+};
+static_assert(sizeof(SharedSnapshotHeader) == 64,
+              "the content starts on a cache line of its own");
+
+// --- The broker's side of a region ---
+class SharedRegion {
+ public:
+  SharedRegion() = default;
+  SharedRegion(const SharedRegion&) = delete;
+  SharedRegion& operator=(const SharedRegion&) = delete;
+  ~SharedRegion() {
+    if (map_ != nullptr) munmap(map_, map_size_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  // Creates an empty region; name only shows up in /proc.
+  bool Create(const std::string& name) {
+    fd_ = memfd_create(name.c_str(), MFD_CLOEXEC);
+    if (fd_ < 0) return false;
+    if (ftruncate(fd_, sizeof(SharedSnapshotHeader)) < 0) return false;
+    void* map = mmap(nullptr, sizeof(SharedSnapshotHeader),
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) return false;
+    map_ = static_cast<char*>(map);
+    map_size_ = sizeof(SharedSnapshotHeader);
+    return true;
+  }
+
+  // A read-only descriptor of the region for a sibling. The caller closes
+  // it; -1 on failure.
+  int OpenReadOnly() const {
+    char path[32];
+    std::snprintf(path, sizeof(path), "/proc/self/fd/%d", fd_);
+    return open(path, O_RDONLY | O_CLOEXEC);
+  }
+
+  // Replaces the content with len bytes of data.
+  bool Publish(const char* data, size_t len) { return Write(0, data, len); }
+
+  // Adds len bytes of data at the end of the content.
+  bool Append(const char* data, size_t len) {
+    return Write(header()->size, data, len);
+  }
+
+ private:
+  SharedSnapshotHeader* header() const {
+    return reinterpret_cast<SharedSnapshotHeader*>(map_);
+  }
+
+  bool Write(size_t offset, const char* data, size_t len) {
+    if (!Reserve(offset + len)) return false;
+    SharedSnapshotHeader* h = header();
+    uint64_t sequence = h->sequence.load(std::memory_order_relaxed);
+    h->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(map_ + sizeof(SharedSnapshotHeader) + offset, data, len);
+    h->size = offset + len;
+    h->sequence.store(sequence + 2, std::memory_order_release);
+    return true;
+  }
+
+  // Grows the region, at least doubling it, to hold size bytes of content.
+  bool Reserve(size_t size) {
+    size_t capacity = map_size_ - sizeof(SharedSnapshotHeader);
+    if (size <= capacity) return true;
+    capacity = std::max(size, 2 * capacity);
+    size_t map_size = sizeof(SharedSnapshotHeader) + capacity;
+    if (ftruncate(fd_, map_size) < 0) return false;
+    void* map = mremap(map_, map_size_, map_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) return false;
+    map_ = static_cast<char*>(map);
+    map_size_ = map_size;
+    return true;
+  }
+
+  int fd_ = -1;
+  char* map_ = nullptr;
+  size_t map_size_ = 0;
+};
+
+// --- Messages between broker and siblings ---
+
+// Listens on the Unix socket at path, replacing a stale one. Returns the
+// socket or -1.
+inline int ListenBroker(const std::string& path) {
+  struct sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) return -1;
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  unlink(path.c_str());
+  if (bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) <
+          0 ||
+      listen(sock, 16) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Connects to the broker listening at path. Returns the socket or -1.
+inline int ConnectBroker(const std::string& path) {
+  struct sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) return -1;
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Sends text as one message, with fd attached unless it is negative.
+// Without wait, fails with EAGAIN instead of blocking on a full socket.
+inline bool SendBrokerMessage(int sock, const std::string& text, int fd,
+                              bool wait) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(text.data());
+  iov.iov_len = text.size();
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  if (fd >= 0) {
+    std::memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  int flags = MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT);
+  while (sendmsg(sock, &msg, flags) < 0) {
+    if (errno != EINTR) return false;
+  }
+  return true;
+}
+
+// Receives one message into text, and the descriptor attached to it into
+// *fd, or -1. Returns false when the peer is gone, and, without wait, when
+// no message is queued (errno EAGAIN).
+inline bool ReceiveBrokerMessage(int sock, std::string* text, int* fd,
+                                 bool wait) {
+  char buffer[PATH_MAX + 64];
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof(buffer);
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t len;
+  do {
+    len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT));
+  } while (len < 0 && errno == EINTR);
+  if (len <= 0) {
+    if (len == 0) errno = 0;
+    return false;
+  }
+  text->assign(buffer, len);
+  *fd = -1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS)
+    std::memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  return true;
+}
+
+#endif  // WEBSOCKET_SRC_SHARED_SNAPSHOT_H_
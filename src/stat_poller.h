@@ -0,0 +1,136 @@
+// stat(2) polling for the file monitor, where inotify cannot be used.
+//
+// inotify only sees changes made through the local kernel. On NFS, SMB and
+// FUSE mounts a watch can be added but never fires for writes made by other
+// machines or by the FUSE daemon, so pages would silently go stale. There the
+// monitor polls instead: each file is stat()ed, and a change in its inode,
+// size or modification time is reported like an inotify event. No content is
+// read until the change is published.
+//
+// Each file has its own interval. It drops to the minimum when the file
+// changes, since a file being written usually keeps changing, and doubles on
+// every poll that finds it unchanged, up to the maximum. An idle file costs
+// one stat() per maximum interval.
+
+#ifndef WEBSOCKET_SRC_STAT_POLLER_H_
+#define WEBSOCKET_SRC_STAT_POLLER_H_
+
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// True if path is on a filesystem where inotify misses changes: network and
+// FUSE filesystems.
+inline bool NeedsPolling(const std::string& path) {
+  struct statfs fs;
+  if (statfs(path.c_str(), &fs) < 0) return false;
+  switch (static_cast<uint32_t>(fs.f_type)) {
+    case 0x6969:      // NFS
+    case 0x517b:      // SMB
+    case 0xff534d42:  // CIFS
+    case 0xfe534d42:  // SMB2
+    case 0x65735546:  // FUSE
+    case 0x01021997:  // 9P
+    case 0x00c36400:  // Ceph
+    case 0x5346414f:  // AFS
+      return true;
+    default:
+      return false;
+  }
+}
+
+class StatPoller {
+ public:
+  StatPoller(uint64_t min_interval_ms, uint64_t max_interval_ms)
+      : min_interval_ms_(min_interval_ms),
+        max_interval_ms_(max_interval_ms) {}
+
+  // Starts polling path, reported as key, from its current state. Polling a
+  // key again takes its current state as the new baseline.
+  void Watch(const std::string& key, const std::string& path,
+             uint64_t now_ms) {
+    Entry& entry = entries_[key];
+    entry.path = path;
+    entry.stamp = Stamp(path);
+    entry.interval_ms = min_interval_ms_;
+    entry.next_ms = now_ms + entry.interval_ms;
+  }
+
+  // Polls every file that is due. Files for which watched returns false are
+  // dropped without a stat(); on_change is called with the key of every file
+  // that changed. Returns the milliseconds until the next file is due, or
+  // UINT64_MAX if nothing is polled.
+  uint64_t Poll(uint64_t now_ms,
+                const std::function<bool(const std::string&)>& watched,
+                const std::function<void(const std::string&)>& on_change) {
+    std::vector<std::string> changed;
+    uint64_t next_ms = UINT64_MAX;
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      Entry& entry = it->second;
+      if (entry.next_ms <= now_ms) {
+        if (!watched(it->first)) {
+          it = entries_.erase(it);
+          continue;
+        }
+        FileStamp stamp = Stamp(entry.path);
+        if (stamp == entry.stamp) {
+          entry.interval_ms =
+              std::min(2 * entry.interval_ms, max_interval_ms_);
+        } else {
+          entry.stamp = stamp;
+          entry.interval_ms = min_interval_ms_;
+          changed.push_back(it->first);
+        }
+        entry.next_ms = now_ms + entry.interval_ms;
+      }
+      next_ms = std::min(next_ms, entry.next_ms - now_ms);
+      ++it;
+    }
+    for (const std::string& key : changed) on_change(key);
+    return next_ms;
+  }
+
+ private:
+  // What a change is told by. All zero while the file does not exist.
+  struct FileStamp {
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = 0;
+    int64_t mtime_ns = 0;
+
+    bool operator==(const FileStamp& other) const {
+      return device == other.device && inode == other.inode &&
+             size == other.size && mtime_ns == other.mtime_ns;
+    }
+  };
+
+  struct Entry {
+    std::string path;
+    FileStamp stamp;
+    uint64_t interval_ms = 0;
+    uint64_t next_ms = 0;
+  };
+
+  static FileStamp Stamp(const std::string& path) {
+    FileStamp stamp;
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) return stamp;
+    stamp.device = st.st_dev;
+    stamp.inode = st.st_ino;
+    stamp.size = st.st_size;
+    stamp.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return stamp;
+  }
+
+  uint64_t min_interval_ms_;
+  uint64_t max_interval_ms_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+#endif  // WEBSOCKET_SRC_STAT_POLLER_H_
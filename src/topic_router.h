@@ -0,0 +1,78 @@
+// Topic (room) subscription index for the chat server.
+//
+// Keeps, for every topic, a compact vector of subscribed client sockets so a
+// publish only touches the subscribers of that topic. A reverse index from
+// socket to joined topics lets a disconnect clean up without scanning every
+// topic.
+
+#ifndef WEBSOCKET_SRC_TOPIC_ROUTER_H_
+#define WEBSOCKET_SRC_TOPIC_ROUTER_H_
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class TopicRouter {
+ public:
+  // Subscribes sock to topic. Returns false if it was already subscribed.
+  bool Join(const std::string& topic, int sock) {
+    std::vector<int>& subscribers = subscribers_[topic];
+    if (std::find(subscribers.begin(), subscribers.end(), sock) !=
+        subscribers.end())
+      return false;
+    subscribers.push_back(sock);
+    topics_by_socket_[sock].push_back(topic);
+    return true;
+  }
+
+  // Unsubscribes sock from topic. Returns false if it was not subscribed.
+  bool Leave(const std::string& topic, int sock) {
+    if (!RemoveSubscriber(topic, sock)) return false;
+    auto it = topics_by_socket_.find(sock);
+    if (it != topics_by_socket_.end()) {
+      std::vector<std::string>& topics = it->second;
+      auto pos = std::find(topics.begin(), topics.end(), topic);
+      if (pos != topics.end()) {
+        *pos = std::move(topics.back());
+        topics.pop_back();
+      }
+      if (topics.empty()) topics_by_socket_.erase(it);
+    }
+    return true;
+  }
+
+  // Unsubscribes sock from every topic it joined. Call on disconnect.
+  void LeaveAll(int sock) {
+    auto it = topics_by_socket_.find(sock);
+    if (it == topics_by_socket_.end()) return;
+    for (const std::string& topic : it->second) RemoveSubscriber(topic, sock);
+    topics_by_socket_.erase(it);
+  }
+
+  // Returns the subscribers of topic, or nullptr if nobody joined it.
+  const std::vector<int>* Subscribers(const std::string& topic) const {
+    auto it = subscribers_.find(topic);
+    return it == subscribers_.end() ? nullptr : &it->second;
+  }
+
+ private:
+  // Swap-and-pop removal keeps the subscriber list dense. Topics without
+  // subscribers are dropped so idle rooms cost nothing.
+  bool RemoveSubscriber(const std::string& topic, int sock) {
+    auto it = subscribers_.find(topic);
+    if (it == subscribers_.end()) return false;
+    std::vector<int>& subscribers = it->second;
+    auto pos = std::find(subscribers.begin(), subscribers.end(), sock);
+    if (pos == subscribers.end()) return false;
+    *pos = subscribers.back();
+    subscribers.pop_back();
+    if (subscribers.empty()) subscribers_.erase(it);
+    return true;
+  }
+
+  std::unordered_map<std::string, std::vector<int>> subscribers_;
+  std::unordered_map<int, std::vector<std::string>> topics_by_socket_;
+};
+
+#endif  // WEBSOCKET_SRC_TOPIC_ROUTER_H_
@@ -0,0 +1,116 @@
+// inotify watches over a directory tree for the file monitor.
+//
+// Directories are watched rather than files. Editors that save by writing a
+// temporary file and renaming it over the original, and loggers that rotate,
+// replace the inode; a watch on the directory entry survives that without
+// being re-added. Every event is reported as the path of the entry relative
+// to the root directory, and new subdirectories are watched as they appear.
+
+#ifndef WEBSOCKET_SRC_TREE_WATCHER_H_
+#define WEBSOCKET_SRC_TREE_WATCHER_H_
+
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+class TreeWatcher {
+ public:
+  TreeWatcher() = default;
+  TreeWatcher(const TreeWatcher&) = delete;
+  TreeWatcher& operator=(const TreeWatcher&) = delete;
+  ~TreeWatcher() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  // Starts watching root. With recursive, every directory below it is
+  // watched as well. Returns false if root itself cannot be watched.
+  bool Watch(const std::string& root, bool recursive) {
+    if (fd_ < 0) fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) return false;
+    root_ = root;
+    recursive_ = recursive;
+    return WatchDirectory("");
+  }
+
+  int fd() const { return fd_; }
+
+  // Reads the queued events and calls on_change with the relative path of
+  // every entry that was written, created or moved into place.
+  void ReadEvents(const std::function<void(const std::string&)>& on_change) {
+    char buffer[16 * 1024]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+      ssize_t len = read(fd_, buffer, sizeof(buffer));
+      if (len <= 0) return;
+      ssize_t i = 0;
+      while (i < len) {
+        const struct inotify_event* event =
+            reinterpret_cast<const struct inotify_event*>(buffer + i);
+        i += sizeof(struct inotify_event) + event->len;
+        auto dir = directories_.find(event->wd);
+        if (dir == directories_.end()) continue;
+        if (event->mask & IN_IGNORED) {
+          directories_.erase(dir);
+          continue;
+        }
+        if (event->len == 0) continue;
+        std::string rel = Join(dir->second, event->name);
+        if (event->mask & IN_ISDIR) {
+          if (recursive_ && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+            WatchDirectory(rel);
+          continue;
+        }
+        on_change(rel);
+      }
+    }
+  }
+
+ private:
+  static std::string Join(const std::string& dir, const std::string& name) {
+    return dir.empty() ? name : dir + "/" + name;
+  }
+
+  // Watches root_/rel and, when recursive, its subdirectories.
+  bool WatchDirectory(const std::string& rel) {
+    std::string path = rel.empty() ? root_ : root_ + "/" + rel;
+    int wd = inotify_add_watch(fd_, path.c_str(),
+                               IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                                   IN_CREATE | IN_ONLYDIR);
+    if (wd < 0) {
+      perror(("inotify_add_watch " + path).c_str());
+      return false;
+    }
+    directories_[wd] = rel;
+    if (!recursive_) return true;
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) return true;
+    while (struct dirent* entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..") continue;
+      // Symlinks are not followed, so a link cannot make the tree a loop.
+      bool is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN) {
+        struct stat st;
+        is_dir = lstat((path + "/" + name).c_str(), &st) == 0 &&
+                 S_ISDIR(st.st_mode);
+      }
+      if (is_dir) WatchDirectory(Join(rel, name));
+    }
+    closedir(dir);
+    return true;
+  }
+
+  int fd_ = -1;
+  std::string root_;
+  bool recursive_ = false;
+  // Watch descriptor to directory path relative to root_.
+  std::unordered_map<int, std::string> directories_;
+};
+
+#endif  // WEBSOCKET_SRC_TREE_WATCHER_H_
@@ -0,0 +1,76 @@
+// Username index for the chat server.
+//
+// Maps usernames to the socket of the connection that registered them so a
+// direct message is routed with a single hash lookup instead of a broadcast
+// scan. ShardForUser tells sharded deployments which server owns a user.
+
+#ifndef WEBSOCKET_SRC_USER_INDEX_H_
+#define WEBSOCKET_SRC_USER_INDEX_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+class UserIndex {
+ public:
+  // Binds username to sock. A connection that registers a second name drops
+  // its first one. Returns false if another connection already owns the name.
+  bool Register(const std::string& username, int sock) {
+    auto it = sockets_.find(username);
+    if (it != sockets_.end()) return it->second == sock;
+    Unregister(sock);
+    sockets_[username] = sock;
+    usernames_[sock] = username;
+    return true;
+  }
+
+  // Removes the name registered by sock, if any. Call on disconnect.
+  void Unregister(int sock) {
+    auto it = usernames_.find(sock);
+    if (it == usernames_.end()) return;
+    sockets_.erase(it->second);
+    usernames_.erase(it);
+  }
+
+  // Returns the socket that registered username, or -1.
+  int Find(const std::string& username) const {
+    auto it = sockets_.find(username);
+    return it == sockets_.end() ? -1 : it->second;
+  }
+
+  // Returns the name registered by sock, or nullptr.
+  const std::string* NameOf(int sock) const {
+    auto it = usernames_.find(sock);
+    return it == usernames_.end() ? nullptr : &it->second;
+  }
+
+ private:
+  std::unordered_map<std::string, int> sockets_;
+  std::unordered_map<int, std::string> usernames_;
+};
+
+/*
+ * Returns the shard in [0, num_shards) that owns username.
+ *
+ * The username is hashed with 64-bit FNV-1a, which unlike std::hash is stable
+ * across processes and builds, and mapped with jump consistent hashing
+ * (Lamping & Veach) so growing the cluster from n to n + 1 shards only moves
+ * about 1 / (n + 1) of the users.
+ */
+inline uint32_t ShardForUser(const std::string& username, uint32_t num_shards) {
+  uint64_t key = 0xcbf29ce484222325ULL;
+  for (unsigned char c : username) {
+    key ^= c;
+    key *= 0x100000001b3ULL;
+  }
+  int64_t b = -1, j = 0;
+  while (j < static_cast<int64_t>(num_shards)) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = static_cast<int64_t>((b + 1) * (static_cast<double>(1LL << 31) /
+                                        static_cast<double>((key >> 33) + 1)));
+  }
+  return static_cast<uint32_t>(b);
+}
+
+#endif  // WEBSOCKET_SRC_USER_INDEX_H_
@@ -1,216 +1,283 @@
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/select.h>
-#include <sys/socket.h>
 #include <unistd.h>
 
 #include <cstdint>
-#include <cstring>
+#include <cstdio>
 #include <iostream>
-#include <sstream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "async_logger.h"
+#include "chat_protocol.h"
 #include "core.h"
-#include "util.h"
-
-// --- WebSocket Handshake ---
-// Handles the WebSocket handshake process with the client by receiving the
-// request, generating the correct accept key, and sending the appropriate
-// response.
-bool DoHandshake(int client_socket) {
-  const int buffer_size = 2048;
-  char buffer[buffer_size];
-  memset(buffer, 0, buffer_size);
-
-  // Receive the WebSocket handshake request
-  int bytes_received = recv(client_socket, buffer, buffer_size - 1, 0);
-  if (bytes_received <= 0) {
-    std::cerr << "Failed to receive handshake request from client.\n";
-    return false;
-  }
+#include "event_loop.h"
+#include "topic_router.h"
+#include "user_index.h"
+#include "ws.h"
+#include "ws_coro.h"
 
-  std::string request(buffer);
+// --- Per-connection session ---
+struct ClientSession {
+  // "[name] " for the name registered by this connection, formatted once so
+  // relaying a session message does not rebuild it.
+  std::string prefix;
+};
 
-  // Extract the Sec-WebSocket-Key from the request headers
-  std::string websocket_key =
-      ExtractHTTPHeaderValue(request, "Sec-WebSocket-Key");
-  if (websocket_key.empty()) {
-    std::cerr << "WebSocket key not found in handshake request.\n";
-    return false;
-  }
+// --- Server state ---
+// Everything the message handlers need to route a chat payload.
+struct ChatServer {
+  // The WebSocket server; its connections are the connected clients.
+  WSServer* ws = nullptr;
+  // Session state of every connected client, keyed by socket.
+  std::unordered_map<int, ClientSession> sessions;
+  // Topic subscriptions of the connected clients.
+  TopicRouter router;
+  // Username to socket index for direct messages.
+  UserIndex users;
+  // This server's slot when users are sharded over several servers.
+  uint32_t shard_index = 0;
+  uint32_t shard_count = 1;
 
-  // Generate the WebSocket accept key
-  const std::string magic_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-  std::string accept_source = websocket_key + magic_guid;
-  std::string sha1_hash = ComputeSHA1Hash(accept_source);
-  std::string accept_key = EncodeBase64(sha1_hash);
-
-  // Prepare the handshake response
-  std::ostringstream response;
-  response << "HTTP/1.1 101 Switching Protocols\r\n"
-           << "Upgrade: websocket\r\n"
-           << "Connection: Upgrade\r\n"
-           << "Sec-WebSocket-Accept: " << accept_key << "\r\n\r\n";
-  std::string response_str = response.str();
-
-  // Send the WebSocket handshake response to the client
-  send(client_socket, response_str.c_str(), response_str.size(), 0);
-  return true;
-}
+  // Buffers reused for every relayed message. Once they have grown to the
+  // largest message seen, the receive-to-send path does no heap allocation:
+  // frames are unmasked in place in the receive buffer of the connection,
+  // index keys are assigned into the key strings and outbound frames are
+  // written into out_frame.
+  std::string name_key;
+  std::string topic_key;
+  WSFrameBuffer out_frame;
+};
 
-int main() {
-  const int port = 8080;
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd == -1) {
-    perror("socket");
-    return 1;
-  }
-  int opt = 1;
-  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-  sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  addr.sin_addr.s_addr = INADDR_ANY;
-  memset(addr.sin_zero, 0, sizeof(addr.sin_zero));
-  if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-    perror("bind");
-    close(server_fd);
-    return 1;
-  }
-  if (listen(server_fd, 5) == -1) {
-    perror("listen");
-    close(server_fd);
-    return 1;
+// --- Fanout ---
+// Sends frame to every socket in subscribers except skip_socket. A null list
+// (topic without subscribers) sends nothing.
+void SendToSubscribers(WSServer* ws, const std::vector<int>* subscribers,
+                       const ByteView& frame, int skip_socket) {
+  if (subscribers == nullptr) return;
+  for (int dest_socket : *subscribers) {
+    if (dest_socket != skip_socket) ws->SendFrame(dest_socket, frame);
   }
-  std::cout << "WebSocket server listening on port " << port << "...\n";
+}
 
-  // Container to hold all connected client sockets.
-  std::vector<int> client_sockets;
+void SendToSubscribers(WSServer* ws, const std::vector<int>* subscribers,
+                       const std::vector<uint8_t>& frame, int skip_socket) {
+  SendToSubscribers(ws, subscribers,
+                    {reinterpret_cast<const char*>(frame.data()), frame.size()},
+                    skip_socket);
+}
 
-  while (true) {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
+// Sends a "[Server] ..." notice to a single client.
+void SendNotice(WSServer* ws, int sock, const std::string& notice) {
+  ws->Send(sock, "[Server] " + notice);
+}
 
-    // Monitor the server socket for new connections.
-    FD_SET(server_fd, &read_fds);
-    int max_fd = server_fd;
+// --- Chat frame ---
+// Writes the text frame "#topic [name] body" ("[name] body" for the lobby,
+// "[name] (direct) body" for direct messages) into out_frame. prefix is the
+// sender's cached "[name] ", or null to format it from chat.username.
+ByteView BuildChatFrame(WSFrameBuffer* out_frame, const ChatView& chat,
+                        const std::string* prefix, bool direct) {
+  out_frame->Reset();
+  if (!direct && chat.topic.size > 0) {
+    out_frame->Append("#", 1);
+    out_frame->Append(chat.topic);
+    out_frame->Append(" ", 1);
+  }
+  if (prefix != nullptr) {
+    out_frame->Append(*prefix);
+  } else {
+    out_frame->Append("[", 1);
+    out_frame->Append(chat.username);
+    out_frame->Append("] ", 2);
+  }
+  if (direct) out_frame->Append("(direct) ", 9);
+  out_frame->Append(chat.body);
+  return out_frame->Finish(WSOpcode::TEXT);
+}
 
-    // Monitor standard input for server commands.
-    FD_SET(STDIN_FILENO, &read_fds);
-    if (STDIN_FILENO > max_fd) max_fd = STDIN_FILENO;
+// --- Username registration ---
+// Binds the sender's name to its socket and caches its "[name] " prefix in
+// the session. Users owned by another shard are refused and told where to
+// connect instead. A refused LOGIN closes the connection once the client has
+// been told why: without a registered name none of its session messages
+// could be relayed.
+void RegisterUser(ChatServer* server, int client_socket,
+                  const std::string& username, bool explicit_login) {
+  if (server->users.Find(username) == client_socket) return;
+  std::string refusal;
+  uint32_t owner = ShardForUser(username, server->shard_count);
+  if (owner != server->shard_index) {
+    refusal = username + " belongs to shard " + std::to_string(owner);
+  } else if (!server->users.Register(username, client_socket)) {
+    refusal = username + " is already logged in";
+  } else {
+    server->sessions[client_socket].prefix = "[" + username + "] ";
+    return;
+  }
+  if (!explicit_login) return;
+  SendNotice(server->ws, client_socket, refusal);
+  Log(LogLevel::INFO, "Login refused", client_socket, refusal);
+  server->ws->Close(client_socket);
+}
 
-    // Monitor each client socket for incoming messages.
-    for (int client_socket : client_sockets) {
-      FD_SET(client_socket, &read_fds);
-      if (client_socket > max_fd) max_fd = client_socket;
+// --- Chat payload dispatch ---
+void HandleChatPayload(ChatServer* server, int client_socket,
+                       const ChatView& chat) {
+  // Session kinds use the prefix cached at LOGIN. The other kinds carry the
+  // username, and the first of them (or a LOGIN frame) fills in the index.
+  const std::string* prefix = nullptr;
+  if (IsSessionKind(chat.kind)) {
+    auto it = server->sessions.find(client_socket);
+    if (it == server->sessions.end() || it->second.prefix.empty()) {
+      SendNotice(server->ws, client_socket,
+                 "log in before sending session messages");
+      return;
     }
+    prefix = &it->second.prefix;
+  } else {
+    server->name_key.assign(chat.username.data, chat.username.size);
+    RegisterUser(server, client_socket, server->name_key,
+                 chat.kind == ChatKind::LOGIN);
+  }
+  server->topic_key.assign(chat.topic.data, chat.topic.size);
+  const std::string& topic = server->topic_key;
 
-    // Wait for activity on any socket.
-    int activity = select(max_fd + 1, &read_fds, nullptr, nullptr, nullptr);
-    if (activity < 0) {
-      perror("select");
-      break;
+  if (chat.kind == ChatKind::JOIN) {
+    if (server->router.Join(topic, client_socket)) {
+      std::string notice = "[Server] " + server->name_key + " joined #" + topic;
+      Log(LogLevel::INFO, "Join", client_socket, notice);
+      SendToSubscribers(server->ws, server->router.Subscribers(topic),
+                        BuildWSFrame(notice, WSOpcode::TEXT), -1);
     }
-
-    // Accept new client connections.
-    if (FD_ISSET(server_fd, &read_fds)) {
-      int new_client = accept(server_fd, nullptr, nullptr);
-      if (new_client < 0) {
-        perror("accept");
-      } else {
-        std::cout << "New client connected: " << new_client << "\n";
-        if (!DoHandshake(new_client)) {
-          std::cerr << "Handshake failed for client: " << new_client << "\n";
-          close(new_client);
-        } else {
-          client_sockets.push_back(new_client);
-        }
-      }
+  } else if (chat.kind == ChatKind::LEAVE) {
+    if (server->router.Leave(topic, client_socket)) {
+      std::string notice = "[Server] " + server->name_key + " left #" + topic;
+      Log(LogLevel::INFO, "Leave", client_socket, notice);
+      SendToSubscribers(server->ws, server->router.Subscribers(topic),
+                        BuildWSFrame(notice, WSOpcode::TEXT), -1);
+    }
+  } else if (chat.kind == ChatKind::DIRECT ||
+             chat.kind == ChatKind::SESSION_DIRECT) {
+    // Direct messages are a single index lookup, no broadcast scan. The
+    // topic field holds the recipient.
+    int dest_socket = server->users.Find(topic);
+    if (dest_socket < 0) {
+      uint32_t owner = ShardForUser(topic, server->shard_count);
+      if (owner != server->shard_index)
+        SendNotice(server->ws, client_socket,
+                   topic + " is on shard " + std::to_string(owner));
+      else
+        SendNotice(server->ws, client_socket, topic + " is not online");
+      return;
     }
+    ByteView frame = BuildChatFrame(&server->out_frame, chat, prefix, true);
+    server->ws->SendFrame(dest_socket, frame);
+  } else if (chat.kind == ChatKind::MESSAGE ||
+             chat.kind == ChatKind::SESSION_MESSAGE) {
+    // Build a WebSocket frame containing the final message.
+    ByteView frame = BuildChatFrame(&server->out_frame, chat, prefix, false);
+    Log(LogLevel::INFO, "Message", client_socket, server->out_frame.Payload());
+    if (topic.empty()) {
+      // Lobby messages go to all clients except the sender.
+      SendToSubscribers(server->ws, &server->ws->connections(), frame,
+                        client_socket);
+    } else {
+      // Topic messages only touch that topic's subscribers.
+      SendToSubscribers(server->ws, server->router.Subscribers(topic), frame,
+                        client_socket);
+    }
+  }
+}
 
-    // Handle server console input.
-    if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-      std::string input;
-      std::getline(std::cin, input);
-      if (input == "/quit") {
-        // Send a close frame to all clients.
-        for (int client : client_sockets) {
-          std::vector<uint8_t> closeFrame = BuildWSFrame("", WSOpcode::CLOSE);
-          send(client, reinterpret_cast<const char*>(closeFrame.data()),
-               closeFrame.size(), 0);
-          close(client);
-        }
-        std::cout << "Closing all connections...\n";
-        break;
-      } else {
-        // Broadcast the server message to all clients.
-        std::string payload;
-        payload.append("[Server] ");
-        payload.append(input);
-        std::vector<uint8_t> frame = BuildWSFrame(payload, WSOpcode::TEXT);
-        for (int client : client_sockets) {
-          send(client, reinterpret_cast<const char*>(frame.data()),
-               frame.size(), 0);
-        }
-      }
+// --- Connection handler ---
+// Relays the chat payloads of one client, in order, until it disconnects.
+WSTask ServeClient(ChatServer* server, WSConnection& conn) {
+  Log(LogLevel::INFO, "New client connected", conn.id());
+  while (std::optional<WSMessage> message = co_await conn.read_message()) {
+    ChatView chat;
+    if (DecodeChatPayload(message->data, &chat)) {
+      HandleChatPayload(server, conn.id(), chat);
+    } else {
+      Log(LogLevel::WARN, "Invalid message", conn.id());
     }
+  }
+  Log(LogLevel::INFO, "Client disconnected", conn.id());
+  server->router.LeaveAll(conn.id());
+  server->users.Unregister(conn.id());
+  server->sessions.erase(conn.id());
+}
 
-    // Process messages from each connected client.
-    for (auto it = client_sockets.begin(); it != client_sockets.end();) {
-      int client_socket = *it;
-      if (FD_ISSET(client_socket, &read_fds)) {
-        char sock_buffer[4096];
-        ssize_t n = recv(client_socket, sock_buffer, sizeof(sock_buffer), 0);
-        if (n <= 0) {
-          std::cout << "Client " << client_socket << " disconnected.\n";
-          close(client_socket);
-          it = client_sockets.erase(it);
-          continue;
-        }
-        std::vector<uint8_t> data(sock_buffer, sock_buffer + n);
-        // Decode the WebSocket frame and obtain the payload string.
-        std::string payload = ParseWSFrame(data);
-        if (!payload.empty()) {
-          // Ensure the payload contains at least 4 bytes for the username
-          // length.
-          if (payload.size() < 4) {
-            std::cerr << "Invalid message from client " << client_socket
-                      << "\n";
-          } else {
-            // Extract the username length.
-            uint32_t nameLen;
-            memcpy(&nameLen, payload.data(), 4);
-            nameLen = ntohl(nameLen);
-            if (payload.size() < 4 + nameLen) {
-              std::cerr
-                  << "Invalid message (username length mismatch) from client "
-                  << client_socket << "\n";
-            } else {
-              // Extract the username and the chat message.
-              std::string username = payload.substr(4, nameLen);
-              std::string chatMsg = payload.substr(4 + nameLen);
-              // Build the final message to display and broadcast.
-              std::string fullMsg = "[" + username + "] " + chatMsg;
-              std::cout << fullMsg << "\n";
-
-              // Build a WebSocket frame containing the final message.
-              std::vector<uint8_t> frame =
-                  BuildWSFrame(fullMsg, WSOpcode::TEXT);
-              // Broadcast to all clients except the sender.
-              for (int dest_socket : client_sockets) {
-                if (dest_socket != client_socket)
-                  send(dest_socket, reinterpret_cast<const char*>(frame.data()),
-                       frame.size(), 0);
-              }
-            }
-          }
-        }
+// Usage: websocket_server [--shard=<index>/<count>] [--log-level=<level>]
+//                         [--log-rate=<records-per-second>]
+int main(int argc, char* argv[]) {
+  ChatServer server;
+  LogLevel log_level = LogLevel::INFO;
+  unsigned log_rate = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    bool valid = false;
+    if (arg.compare(0, 8, "--shard=") == 0) {
+      unsigned index, count;
+      if (sscanf(argv[i], "--shard=%u/%u", &index, &count) == 2 &&
+          count > 0 && index < count) {
+        server.shard_index = index;
+        server.shard_count = count;
+        valid = true;
       }
-      ++it;
+    } else if (arg.compare(0, 12, "--log-level=") == 0) {
+      valid = ParseLogLevel(arg.substr(12), &log_level);
+    } else if (arg.compare(0, 11, "--log-rate=") == 0) {
+      valid = sscanf(argv[i], "--log-rate=%u", &log_rate) == 1;
+    }
+    if (!valid) {
+      std::cerr << "Usage: " << argv[0]
+                << " [--shard=<index>/<count>]"
+                   " [--log-level=debug|info|warn|error|off]"
+                   " [--log-rate=<records-per-second>]\n";
+      return 1;
     }
   }
 
-  // Cleanup: close any remaining client sockets and the server socket.
-  for (int client : client_sockets) close(client);
-  close(server_fd);
+  const int port = 8080;
+  EventLoop loop;
+  WSCoServer chat(&loop, [&server](WSConnection& conn) {
+    return ServeClient(&server, conn);
+  });
+  if (!chat.Listen(port)) {
+    perror("listen");
+    return 1;
+  }
+  WSServer& ws = chat.server();
+  server.ws = &ws;
+  std::cout << "WebSocket server listening on port " << port << "...\n"
+            << std::flush;
+  // Everything after this point is logged from the event loop, so it goes
+  // through the asynchronous logger instead of blocking on stdout.
+  AsyncLogger::Instance().Start(STDOUT_FILENO, log_level, log_rate);
+
+  // Handle server console input.
+  loop.Watch(STDIN_FILENO, kReadable, [&](uint32_t) {
+    std::string input;
+    if (!std::getline(std::cin, input)) {
+      // Without a console the server just keeps serving.
+      loop.Unwatch(STDIN_FILENO);
+      return;
+    }
+    if (input == "/quit") {
+      // Send a close frame to all clients.
+      std::vector<int> clients = ws.connections();
+      for (int client : clients) ws.Close(client);
+      Log(LogLevel::INFO, "Closing all connections");
+      loop.Stop();
+    } else {
+      // Broadcast the server message to all clients.
+      std::string payload = "[Server] " + input;
+      ws.Broadcast(ByteView{payload.data(), payload.size()});
+    }
+  });
+
+  loop.Run();
+  AsyncLogger::Instance().Stop();
   return 0;
 }
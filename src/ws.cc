@@ -0,0 +1,653 @@
+// Embeddable WebSocket server and client: see ws.h.
+
+#include "ws.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <random>
+
+#include "util.h"
+
+// A peer is disconnected once this much output waits for it.
+#define WS_MAX_QUEUED_BYTES (8 << 20)
+// Largest message, or handshake, a peer may send before it is disconnected.
+#define WS_MAX_MESSAGE_BYTES (16 << 20)
+#define WS_MAX_HANDSHAKE_BYTES 8192
+// Bytes read from a socket at a time.
+#define WS_READ_BYTES (64 << 10)
+// How long a closed connection may take to write the output it has left
+// before its socket is closed anyway.
+#define WS_CLOSE_TIMEOUT_MS 5000
+
+static const char kWebSocketGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+struct WSPeer {
+  int sock = -1;
+  // Tells a peer from a later one on the same socket number.
+  uint64_t serial = 0;
+  // Set once the handshake is done.
+  bool open = false;
+  // Set when output failed; the peer is dropped from a deferred task, so
+  // loops over the connections are never disturbed by a send.
+  bool failed = false;
+  // Set once the connection is closed but output is still being written.
+  // The socket is closed when the output is gone and the other end has
+  // closed too, or when close_timer fires.
+  bool closing = false;
+  bool shut_down = false;
+  EventLoop::TimerId close_timer = 0;
+  // Received bytes not yet taken as frames: the first in_len bytes of in.
+  // in only grows, so reads go into room it already has and no read pays
+  // for clearing it.
+  std::vector<uint8_t> in;
+  size_t in_len = 0;
+  // Output the socket has not taken yet, from out_offset on.
+  std::string out;
+  size_t out_offset = 0;
+  // The fragments received so far of a message that is not complete yet.
+  std::string message;
+  WSOpcode message_opcode = WSOpcode::TEXT;
+  bool in_message = false;
+};
+
+// -------------------------------------------------------------------------
+// Helpers shared by both ends
+// -------------------------------------------------------------------------
+
+// Appends what the socket has to the received bytes of peer. Returns false
+// once the peer has closed the connection or it failed.
+static bool ReceiveInto(WSPeer* peer) {
+  if (peer->in.size() - peer->in_len < WS_READ_BYTES)
+    peer->in.resize(peer->in_len + WS_READ_BYTES);
+  ssize_t n;
+  do {
+    n = recv(peer->sock, peer->in.data() + peer->in_len,
+             peer->in.size() - peer->in_len, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+  peer->in_len += n;
+  return n > 0;
+}
+
+// Drops the first len received bytes of peer, which have been handled.
+static void ConsumeInput(WSPeer* peer, size_t len) {
+  std::memmove(peer->in.data(), peer->in.data() + len, peer->in_len - len);
+  peer->in_len -= len;
+}
+
+// Writes len bytes of data, queueing what the socket does not take. Returns
+// true if output is left waiting for room, false otherwise; sets failed if
+// the socket failed or too much is queued.
+static bool WriteOrQueue(WSPeer* peer, const char* data, size_t len) {
+  if (peer->failed) return false;
+  if (peer->out_offset == peer->out.size()) {
+    ssize_t sent;
+    do {
+      sent = send(peer->sock, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        peer->failed = true;
+        return false;
+      }
+      sent = 0;
+    }
+    if (static_cast<size_t>(sent) == len) return false;
+    peer->out.clear();
+    peer->out_offset = 0;
+    data += sent;
+    len -= sent;
+  }
+  if (peer->out.size() - peer->out_offset + len > WS_MAX_QUEUED_BYTES) {
+    peer->failed = true;
+    return false;
+  }
+  peer->out.append(data, len);
+  return true;
+}
+
+// Writes as much queued output as the socket takes. Returns true if output
+// is still waiting; sets failed if the socket failed.
+static bool FlushQueued(WSPeer* peer) {
+  while (peer->out_offset < peer->out.size()) {
+    ssize_t sent = send(peer->sock, peer->out.data() + peer->out_offset,
+                        peer->out.size() - peer->out_offset,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      peer->failed = true;
+      return false;
+    }
+    peer->out_offset += sent;
+  }
+  std::string().swap(peer->out);
+  peer->out_offset = 0;
+  return false;
+}
+
+// Continues closing peer: writes the output it has left, then shuts down
+// its sending side, discarding whatever arrives. Closing the socket right
+// away would lose the output, and unread input would reset the connection.
+// Returns false once the socket can be closed: the other end has closed
+// too, or the socket failed.
+static bool ContinueClosing(WSPeer* peer, uint32_t events) {
+  if (events & kReadable) {
+    peer->in_len = 0;
+    if (!ReceiveInto(peer)) return false;
+  }
+  if (!peer->shut_down) {
+    if (FlushQueued(peer)) return true;
+    if (peer->failed) return false;
+    shutdown(peer->sock, SHUT_WR);
+    peer->shut_down = true;
+  }
+  return true;
+}
+
+// Takes the next frame from the received bytes of peer at *pos. Returns
+// false once no complete frame is left. Sets *opcode and *message to a
+// complete message or a control frame; fragments of a message that is not
+// complete yet are kept in the peer and reported as CONTINUATION. Fails,
+// setting failed, on a message larger than WS_MAX_MESSAGE_BYTES.
+static bool NextFrame(WSPeer* peer, size_t* pos, WSOpcode* opcode,
+                      ByteView* message) {
+  size_t len = peer->in_len - *pos;
+  if (len > WS_MAX_MESSAGE_BYTES) {
+    peer->failed = true;
+    return false;
+  }
+  uint8_t* frame = peer->in.data() + *pos;
+  size_t used = ParseWSFrameInPlace(frame, len, opcode, message);
+  if (used == 0) return false;
+  *pos += used;
+  bool fin = frame[0] & 0x80;
+  if (static_cast<uint8_t>(*opcode) >= 0x8) return true;  // Control frame.
+  if (!peer->in_message) {
+    // A stray continuation is reported as such, and so ignored.
+    if (fin || *opcode == WSOpcode::CONTINUATION) return true;
+    peer->in_message = true;
+    peer->message_opcode = *opcode;
+    peer->message.clear();
+  }
+  if (peer->message.size() + message->size > WS_MAX_MESSAGE_BYTES) {
+    peer->failed = true;
+    return false;
+  }
+  peer->message.append(message->data, message->size);
+  *opcode = WSOpcode::CONTINUATION;
+  if (fin) {
+    peer->in_message = false;
+    *opcode = peer->message_opcode;
+    *message = {peer->message.data(), peer->message.size()};
+  }
+  return true;
+}
+
+// The Sec-WebSocket-Accept value for a Sec-WebSocket-Key.
+static std::string AcceptKey(const std::string& key) {
+  return EncodeBase64(ComputeSHA1Hash(key + kWebSocketGuid));
+}
+
+static uint32_t RandomUint32() {
+  static std::random_device random;
+  return random();
+}
+
+// -------------------------------------------------------------------------
+// WSServer
+// -------------------------------------------------------------------------
+
+WSServer::WSServer(EventLoop* loop) : loop_(loop) {}
+
+WSServer::~WSServer() {
+  for (auto& entry : peers_) {
+    loop_->Cancel(entry.second->close_timer);
+    loop_->Unwatch(entry.first);
+    close(entry.first);
+  }
+  if (listen_fd_ >= 0) {
+    loop_->Unwatch(listen_fd_);
+    close(listen_fd_);
+  }
+}
+
+bool WSServer::Listen(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return false;
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = INADDR_ANY;
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0 ||
+      !loop_->Watch(fd, kReadable, [this](uint32_t) { Accept(); })) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return false;
+  }
+  listen_fd_ = fd;
+  return true;
+}
+
+void WSServer::Send(int conn, const ByteView& message, WSOpcode opcode) {
+  frame_.Reset();
+  frame_.Append(message);
+  SendFrame(conn, frame_.Finish(opcode));
+}
+
+void WSServer::Send(int conn, const std::string& message, WSOpcode opcode) {
+  Send(conn, ByteView{message.data(), message.size()}, opcode);
+}
+
+void WSServer::SendFrame(int conn, const ByteView& frame) {
+  auto it = peers_.find(conn);
+  if (it == peers_.end() || !it->second->open) return;
+  Write(it->second.get(), frame.data, frame.size);
+}
+
+void WSServer::Broadcast(const ByteView& message, WSOpcode opcode, int skip) {
+  frame_.Reset();
+  frame_.Append(message);
+  ByteView frame = frame_.Finish(opcode);
+  for (int conn : connections_) {
+    if (conn != skip) SendFrame(conn, frame);
+  }
+}
+
+size_t WSServer::Queued(int conn) const {
+  auto it = peers_.find(conn);
+  if (it == peers_.end()) return 0;
+  return it->second->out.size() - it->second->out_offset;
+}
+
+void WSServer::Close(int conn) {
+  auto it = peers_.find(conn);
+  if (it == peers_.end() || it->second->closing) return;
+  WSPeer* peer = it->second.get();
+  if (!peer->open) {
+    Drop(conn);
+    return;
+  }
+  std::vector<uint8_t> frame = BuildWSFrame("", WSOpcode::CLOSE);
+  WriteOrQueue(peer, reinterpret_cast<char*>(frame.data()), frame.size());
+  peer->open = false;
+  connections_.erase(
+      std::find(connections_.begin(), connections_.end(), conn));
+  StartClosing(peer);
+  if (on_close) on_close(conn);
+}
+
+void WSServer::Accept() {
+  int sock = accept4(listen_fd_, nullptr, nullptr,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sock < 0) return;
+  std::unique_ptr<WSPeer> peer(new WSPeer());
+  peer->sock = sock;
+  peer->serial = ++serial_;
+  if (!loop_->Watch(sock, kReadable, [this, sock](uint32_t events) {
+        HandleEvents(sock, events);
+      })) {
+    close(sock);
+    return;
+  }
+  peers_[sock] = std::move(peer);
+}
+
+void WSServer::HandleEvents(int sock, uint32_t events) {
+  WSPeer* peer = peers_.at(sock).get();
+  uint64_t serial = peer->serial;
+  if (peer->closing) {
+    if (!ContinueClosing(peer, events))
+      Drop(sock);
+    else if (peer->shut_down)
+      loop_->SetEvents(sock, kReadable);
+    return;
+  }
+  if (events & kWritable) {
+    bool waiting = FlushQueued(peer);
+    if (peer->failed) {
+      Drop(sock);
+      return;
+    }
+    if (!waiting) {
+      loop_->SetEvents(sock, kReadable);
+      if (on_drain) {
+        on_drain(sock);
+        // The callback may have closed this connection.
+        if (!StillOpen(sock, serial)) return;
+      }
+    }
+  }
+  if (!(events & kReadable)) return;
+  if (!ReceiveInto(peer)) {
+    Drop(sock);
+    return;
+  }
+  if (!peer->open && !Handshake(peer)) return;
+
+  size_t pos = 0;
+  WSOpcode opcode;
+  ByteView message;
+  while (NextFrame(peer, &pos, &opcode, &message)) {
+    if (opcode == WSOpcode::CLOSE) {
+      Close(sock);
+      return;
+    }
+    if (opcode == WSOpcode::PING) {
+      Send(sock, message, WSOpcode::PONG);
+    } else if (opcode == WSOpcode::TEXT || opcode == WSOpcode::BINARY) {
+      if (on_message) on_message(sock, opcode, message);
+      // The callback may have closed this connection; frames after that
+      // are not delivered.
+      if (!StillOpen(sock, serial)) return;
+    }
+  }
+  if (peer->failed) {
+    Drop(sock);
+    return;
+  }
+  ConsumeInput(peer, pos);
+}
+
+// Answers the handshake once the request is complete. Returns false unless
+// the connection is open and frames may follow in its received bytes.
+bool WSServer::Handshake(WSPeer* peer) {
+  static const char kEnd[] = "\r\n\r\n";
+  auto received = peer->in.begin() + peer->in_len;
+  auto end = std::search(peer->in.begin(), received, kEnd, kEnd + 4);
+  if (end == received) {
+    if (peer->in_len > WS_MAX_HANDSHAKE_BYTES) Drop(peer->sock);
+    return false;
+  }
+  std::string request(peer->in.begin(), end + 4);
+  ConsumeInput(peer, request.size());
+  std::string key = ExtractHTTPHeaderValue(request, "Sec-WebSocket-Key");
+  if (key.empty()) {
+    static const char kBadRequest[] =
+        "HTTP/1.1 400 Bad Request\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    WriteOrQueue(peer, kBadRequest, sizeof(kBadRequest) - 1);
+    StartClosing(peer);
+    return false;
+  }
+  std::string response =
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: " +
+      AcceptKey(key) + "\r\n\r\n";
+  peer->open = true;
+  Write(peer, response.data(), response.size());
+  connections_.push_back(peer->sock);
+  int sock = peer->sock;
+  uint64_t serial = peer->serial;
+  if (on_open) on_open(sock);
+  return StillOpen(sock, serial);
+}
+
+void WSServer::Write(WSPeer* peer, const char* data, size_t len) {
+  if (WriteOrQueue(peer, data, len)) {
+    loop_->SetEvents(peer->sock, kReadable | kWritable);
+  } else if (peer->failed) {
+    // Dropped later, so callers looping over connections are not disturbed.
+    int sock = peer->sock;
+    uint64_t serial = peer->serial;
+    loop_->Defer([this, sock, serial] {
+      auto it = peers_.find(sock);
+      if (it != peers_.end() && it->second->serial == serial) Drop(sock);
+    });
+  }
+}
+
+// True if the connection on sock is still the one with serial and has not
+// been closed, e.g. by a callback.
+bool WSServer::StillOpen(int sock, uint64_t serial) const {
+  auto it = peers_.find(sock);
+  return it != peers_.end() && it->second->serial == serial &&
+         it->second->open && !it->second->closing;
+}
+
+// Lets the connection of peer, which is no longer open, write the output it
+// has left before its socket is closed.
+void WSServer::StartClosing(WSPeer* peer) {
+  int sock = peer->sock;
+  uint64_t serial = peer->serial;
+  peer->closing = true;
+  if (peer->failed || !ContinueClosing(peer, 0)) {
+    Drop(sock);
+    return;
+  }
+  loop_->SetEvents(sock, peer->shut_down ? kReadable : kReadable | kWritable);
+  peer->close_timer =
+      loop_->RunAfter(WS_CLOSE_TIMEOUT_MS, [this, sock, serial] {
+        auto it = peers_.find(sock);
+        if (it == peers_.end() || it->second->serial != serial) return;
+        it->second->close_timer = 0;
+        Drop(sock);
+      });
+}
+
+// Forgets the connection and closes its socket; on_close is called if it
+// was open.
+void WSServer::Drop(int sock) {
+  auto it = peers_.find(sock);
+  if (it == peers_.end()) return;
+  bool open = it->second->open;
+  loop_->Cancel(it->second->close_timer);
+  peers_.erase(it);
+  loop_->Unwatch(sock);
+  close(sock);
+  if (!open) return;
+  connections_.erase(
+      std::find(connections_.begin(), connections_.end(), sock));
+  if (on_close) on_close(sock);
+}
+
+// -------------------------------------------------------------------------
+// WSClient
+// -------------------------------------------------------------------------
+
+WSClient::WSClient(EventLoop* loop) : loop_(loop) {}
+
+WSClient::~WSClient() {
+  if (!peer_) return;
+  loop_->Cancel(peer_->close_timer);
+  loop_->Unwatch(peer_->sock);
+  close(peer_->sock);
+}
+
+bool WSClient::Connect(const std::string& ip, int port,
+                       const std::string& path) {
+  // A connection still closing is given up.
+  if (peer_ && peer_->closing) Drop();
+  struct sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0) {
+    error_ = "invalid address " + ip;
+    return false;
+  }
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || connect(sock, reinterpret_cast<struct sockaddr*>(&addr),
+                          sizeof(addr)) < 0) {
+    error_ = std::string("connect: ") + strerror(errno);
+    if (sock >= 0) close(sock);
+    return false;
+  }
+
+  std::string nonce;
+  for (int i = 0; i < 4; i++) {
+    uint32_t bits = RandomUint32();
+    nonce.append(reinterpret_cast<const char*>(&bits), sizeof(bits));
+  }
+  std::string key = EncodeBase64(nonce);
+  std::string request = "GET " + path + " HTTP/1.1\r\n" +
+                        "Host: " + ip + ":" + std::to_string(port) +
+                        "\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Key: " +
+                        key +
+                        "\r\n"
+                        "Sec-WebSocket-Version: 13\r\n\r\n";
+  send(sock, request.data(), request.size(), MSG_NOSIGNAL);
+
+  // Read the response; bytes after it are already frames.
+  std::unique_ptr<WSPeer> peer(new WSPeer());
+  peer->sock = sock;
+  static const char kEnd[] = "\r\n\r\n";
+  auto end = peer->in.begin();
+  while ((end = std::search(peer->in.begin(), peer->in.begin() + peer->in_len,
+                            kEnd, kEnd + 4)) ==
+         peer->in.begin() + peer->in_len) {
+    size_t size = peer->in_len;
+    if (size > WS_MAX_HANDSHAKE_BYTES || !ReceiveInto(peer.get()) ||
+        peer->in_len == size) {
+      error_ = "no handshake response";
+      close(sock);
+      return false;
+    }
+  }
+  std::string response(peer->in.begin(), end + 4);
+  ConsumeInput(peer.get(), response.size());
+  if (response.find("101 Switching Protocols") == std::string::npos) {
+    error_ = "handshake refused:\n" + response;
+    close(sock);
+    return false;
+  }
+  if (ExtractHTTPHeaderValue(response, "Sec-WebSocket-Accept") !=
+      AcceptKey(key)) {
+    error_ = "accept key doesn't match";
+    close(sock);
+    return false;
+  }
+
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  peer->open = true;
+  if (!loop_->Watch(sock, kReadable,
+                    [this](uint32_t events) { HandleEvents(events); })) {
+    error_ = std::string("watch: ") + strerror(errno);
+    close(sock);
+    return false;
+  }
+  peer_ = std::move(peer);
+  // Frames that came with the response are delivered from the loop.
+  if (peer_->in_len != 0) loop_->Defer([this] { HandleEvents(0); });
+  return true;
+}
+
+void WSClient::Send(const ByteView& message, WSOpcode opcode) {
+  if (!connected()) return;
+  std::vector<uint8_t> frame =
+      BuildMaskedWSFrame(message, opcode, RandomUint32());
+  Write(reinterpret_cast<char*>(frame.data()), frame.size());
+}
+
+void WSClient::Send(const std::string& message, WSOpcode opcode) {
+  Send(ByteView{message.data(), message.size()}, opcode);
+}
+
+void WSClient::Close() {
+  if (!connected()) return;
+  WSPeer* peer = peer_.get();
+  std::vector<uint8_t> frame =
+      BuildMaskedWSFrame(ByteView{"", 0}, WSOpcode::CLOSE, RandomUint32());
+  WriteOrQueue(peer, reinterpret_cast<char*>(frame.data()), frame.size());
+  // The output left is written before the socket is closed, as on the
+  // server.
+  peer->closing = true;
+  if (peer->failed || !ContinueClosing(peer, 0)) {
+    Drop();
+    return;
+  }
+  loop_->SetEvents(peer->sock,
+                   peer->shut_down ? kReadable : kReadable | kWritable);
+  peer->close_timer = loop_->RunAfter(WS_CLOSE_TIMEOUT_MS, [this, peer] {
+    if (peer_.get() != peer) return;
+    peer->close_timer = 0;
+    Drop();
+  });
+  if (on_close) on_close();
+}
+
+bool WSClient::connected() const { return peer_ && !peer_->closing; }
+
+void WSClient::HandleEvents(uint32_t events) {
+  if (!peer_) return;
+  WSPeer* peer = peer_.get();
+  if (peer->closing) {
+    if (!ContinueClosing(peer, events))
+      Drop();
+    else if (peer->shut_down)
+      loop_->SetEvents(peer->sock, kReadable);
+    return;
+  }
+  if (events & kWritable) {
+    if (!FlushQueued(peer)) loop_->SetEvents(peer->sock, kReadable);
+    if (peer->failed) {
+      Drop();
+      return;
+    }
+  }
+  if ((events & kReadable) && !ReceiveInto(peer)) {
+    Drop();
+    return;
+  }
+
+  size_t pos = 0;
+  WSOpcode opcode;
+  ByteView message;
+  while (NextFrame(peer, &pos, &opcode, &message)) {
+    if (opcode == WSOpcode::CLOSE) {
+      Close();
+      return;
+    }
+    if (opcode == WSOpcode::PING) {
+      Send(message, WSOpcode::PONG);
+    } else if (opcode == WSOpcode::TEXT || opcode == WSOpcode::BINARY) {
+      if (on_message) on_message(opcode, message);
+      if (peer_.get() != peer) return;  // Closed by the callback.
+    }
+  }
+  if (peer->failed) {
+    Drop();
+    return;
+  }
+  ConsumeInput(peer, pos);
+}
+
+void WSClient::Write(const char* data, size_t len) {
+  if (WriteOrQueue(peer_.get(), data, len)) {
+    loop_->SetEvents(peer_->sock, kReadable | kWritable);
+  } else if (peer_->failed) {
+    WSPeer* peer = peer_.get();
+    loop_->Defer([this, peer] {
+      if (peer_.get() == peer) Drop();
+    });
+  }
+}
+
+// Closes the socket; on_close is called unless Close() already did.
+void WSClient::Drop() {
+  if (!peer_) return;
+  bool closing = peer_->closing;
+  loop_->Cancel(peer_->close_timer);
+  loop_->Unwatch(peer_->sock);
+  close(peer_->sock);
+  peer_.reset();
+  if (!closing && on_close) on_close();
+}
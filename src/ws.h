@@ -0,0 +1,142 @@
+// Embeddable WebSocket server and client, the API of libws.
+//
+// Both run on an EventLoop (see event_loop.h) owned by the caller, who can
+// watch descriptors and run timers of its own on the same loop. Everything
+// is reported through callbacks, called from the loop:
+//
+//   on_open     once the handshake is done (server side)
+//   on_message  for every complete text or binary message; fragmented
+//               messages are reassembled first
+//   on_close    once the connection is gone, closed by either side
+//   on_drain    once output queued for a connection has all been written
+//               (server side)
+//
+// A server identifies connections by their socket. Sends never block: what
+// the socket does not take is queued and written as it drains, and a peer
+// that lets too much pile up is disconnected. Pings are answered and close
+// frames acknowledged without involving the caller.
+//
+// Callbacks may send, and may close any connection, including their own.
+
+#ifndef WEBSOCKET_SRC_WS_H_
+#define WEBSOCKET_SRC_WS_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core.h"
+#include "event_loop.h"
+
+// One end of a WebSocket connection; defined in ws.cc.
+struct WSPeer;
+
+// --- Server ---
+class WSServer {
+ public:
+  typedef std::function<void(int conn)> OpenHandler;
+  typedef std::function<void(int conn, WSOpcode opcode,
+                             const ByteView& message)>
+      MessageHandler;
+  typedef std::function<void(int conn)> CloseHandler;
+  typedef std::function<void(int conn)> DrainHandler;
+
+  explicit WSServer(EventLoop* loop);
+  ~WSServer();
+  WSServer(const WSServer&) = delete;
+  WSServer& operator=(const WSServer&) = delete;
+
+  // Listens on port on all interfaces. Returns false with errno set.
+  bool Listen(int port);
+
+  // Sends message as one frame of the given opcode.
+  void Send(int conn, const ByteView& message,
+            WSOpcode opcode = WSOpcode::TEXT);
+  void Send(int conn, const std::string& message,
+            WSOpcode opcode = WSOpcode::TEXT);
+  // Sends a complete, unmasked frame, e.g. one built with a WSFrameBuffer,
+  // so a frame sent to many connections is built once.
+  void SendFrame(int conn, const ByteView& frame);
+  // Sends message to every open connection except skip.
+  void Broadcast(const ByteView& message, WSOpcode opcode = WSOpcode::TEXT,
+                 int skip = -1);
+
+  // Sends a close frame and closes the connection; on_close is called.
+  // Output already queued for it is still written, for at most a few
+  // seconds, before its socket is closed.
+  void Close(int conn);
+
+  // The open connections, oldest first.
+  const std::vector<int>& connections() const { return connections_; }
+  // Bytes sent to conn that the socket has not taken yet.
+  size_t Queued(int conn) const;
+
+  OpenHandler on_open;
+  MessageHandler on_message;
+  CloseHandler on_close;
+  DrainHandler on_drain;
+
+ private:
+  void Accept();
+  void HandleEvents(int sock, uint32_t events);
+  bool Handshake(WSPeer* peer);
+  void Write(WSPeer* peer, const char* data, size_t len);
+  bool StillOpen(int sock, uint64_t serial) const;
+  void StartClosing(WSPeer* peer);
+  void Drop(int sock);
+
+  EventLoop* loop_;
+  int listen_fd_ = -1;
+  std::unordered_map<int, std::unique_ptr<WSPeer>> peers_;
+  std::vector<int> connections_;
+  uint64_t serial_ = 0;
+  // Reused for every frame built here, so sends do not allocate.
+  WSFrameBuffer frame_;
+};
+
+// --- Client ---
+class WSClient {
+ public:
+  typedef std::function<void(WSOpcode opcode, const ByteView& message)>
+      MessageHandler;
+  typedef std::function<void()> CloseHandler;
+
+  explicit WSClient(EventLoop* loop);
+  ~WSClient();
+  WSClient(const WSClient&) = delete;
+  WSClient& operator=(const WSClient&) = delete;
+
+  // Connects to the server at ip:port and performs the handshake for path,
+  // blocking until it is done; the server cannot be on the same loop.
+  // Returns false and sets error() on failure.
+  bool Connect(const std::string& ip, int port,
+               const std::string& path = "/");
+
+  // Sends message as one masked frame of the given opcode.
+  void Send(const ByteView& message, WSOpcode opcode = WSOpcode::TEXT);
+  void Send(const std::string& message, WSOpcode opcode = WSOpcode::TEXT);
+
+  // Sends a close frame and closes the connection; on_close is called.
+  // Output already queued is still written before the socket is closed.
+  void Close();
+
+  bool connected() const;
+  const std::string& error() const { return error_; }
+
+  MessageHandler on_message;
+  CloseHandler on_close;
+
+ private:
+  void HandleEvents(uint32_t events);
+  void Write(const char* data, size_t len);
+  void Drop();
+
+  EventLoop* loop_;
+  std::unique_ptr<WSPeer> peer_;
+  std::string error_;
+};
+
+#endif  // WEBSOCKET_SRC_WS_H_
@@ -0,0 +1,196 @@
+// Coroutine connection handlers: see ws_coro.h.
+
+#include "ws_coro.h"
+
+#include <new>
+
+// Frame sizes are rounded up to a multiple of this, and every size up to
+// WS_CORO_POOLED_BYTES has a free list of its own; larger frames always
+// come from the heap.
+#define WS_CORO_FRAME_ALIGN 64
+#define WS_CORO_POOLED_BYTES 4096
+// Free frames kept per size; the heap gets the rest back.
+#define WS_CORO_POOL_DEPTH 1024
+
+// -------------------------------------------------------------------------
+// Coroutine frame pool
+// -------------------------------------------------------------------------
+
+static const size_t kFrameClasses = WS_CORO_POOLED_BYTES / WS_CORO_FRAME_ALIGN;
+
+struct FreeFrame {
+  FreeFrame* next;
+};
+
+struct FramePool {
+  ~FramePool() {
+    for (size_t i = 0; i < kFrameClasses; i++) {
+      while (free[i] != nullptr) {
+        FreeFrame* frame = free[i];
+        free[i] = frame->next;
+        ::operator delete(frame);
+      }
+    }
+  }
+
+  FreeFrame* free[kFrameClasses] = {};
+  size_t count[kFrameClasses] = {};
+};
+
+static thread_local FramePool ThreadFramePool;
+
+// The free list for frames of size bytes, which must be pooled.
+static size_t FrameClass(size_t size) {
+  return (size + WS_CORO_FRAME_ALIGN - 1) / WS_CORO_FRAME_ALIGN - 1;
+}
+
+void* AllocateCoroutineFrame(size_t size) {
+  if (size == 0 || size > WS_CORO_POOLED_BYTES) return ::operator new(size);
+  size_t index = FrameClass(size);
+  FramePool& pool = ThreadFramePool;
+  if (FreeFrame* frame = pool.free[index]) {
+    pool.free[index] = frame->next;
+    pool.count[index]--;
+    return frame;
+  }
+  return ::operator new((index + 1) * WS_CORO_FRAME_ALIGN);
+}
+
+void FreeCoroutineFrame(void* frame, size_t size) {
+  if (size == 0 || size > WS_CORO_POOLED_BYTES) {
+    ::operator delete(frame);
+    return;
+  }
+  size_t index = FrameClass(size);
+  FramePool& pool = ThreadFramePool;
+  if (pool.count[index] == WS_CORO_POOL_DEPTH) {
+    ::operator delete(frame);
+    return;
+  }
+  FreeFrame* free = static_cast<FreeFrame*>(frame);
+  free->next = pool.free[index];
+  pool.free[index] = free;
+  pool.count[index]++;
+}
+
+// -------------------------------------------------------------------------
+// WSConnection
+// -------------------------------------------------------------------------
+
+WSConnection::SendAwaiter WSConnection::send(const ByteView& message,
+                                             WSOpcode opcode) {
+  if (!closed_) server_->ws_.Send(id_, message, opcode);
+  return SendAwaiter(this);
+}
+
+WSConnection::SendAwaiter WSConnection::send(const std::string& message,
+                                             WSOpcode opcode) {
+  return send(ByteView{message.data(), message.size()}, opcode);
+}
+
+WSConnection::SendAwaiter WSConnection::send_frame(const ByteView& frame) {
+  if (!closed_) server_->ws_.SendFrame(id_, frame);
+  return SendAwaiter(this);
+}
+
+void WSConnection::close() {
+  if (!closed_) server_->ws_.Close(id_);
+}
+
+bool WSConnection::TakePending() {
+  if (pending_.empty()) return false;
+  current_.swap(pending_.front().second);
+  message_.opcode = pending_.front().first;
+  message_.data = ByteView{current_.data(), current_.size()};
+  pending_.pop_front();
+  has_message_ = true;
+  return true;
+}
+
+bool WSConnection::Backlogged() const {
+  return server_->ws_.Queued(id_) > WS_CORO_SEND_WATERMARK;
+}
+
+// A handler waiting to read is handed message in place; it is only copied
+// when the handler is busy.
+void WSConnection::Deliver(WSOpcode opcode, const ByteView& message) {
+  if (!reader_) {
+    pending_.emplace_back(opcode, std::string(message.data, message.size));
+    return;
+  }
+  message_.opcode = opcode;
+  message_.data = message;
+  has_message_ = true;
+  std::coroutine_handle<> reader = reader_;
+  reader_ = nullptr;
+  reader.resume();  // May return with this connection gone.
+}
+
+void WSConnection::Drained() {
+  if (!sender_) return;
+  std::coroutine_handle<> sender = sender_;
+  sender_ = nullptr;
+  sender.resume();
+}
+
+void WSConnection::Closed() {
+  closed_ = true;
+  std::coroutine_handle<> waiting = reader_ ? reader_ : sender_;
+  reader_ = nullptr;
+  sender_ = nullptr;
+  if (waiting) waiting.resume();
+}
+
+// -------------------------------------------------------------------------
+// WSCoServer
+// -------------------------------------------------------------------------
+
+WSCoServer::WSCoServer(EventLoop* loop, Handler handler)
+    : ws_(loop), handler_(std::move(handler)) {
+  ws_.on_open = [this](int id) { Open(id); };
+  ws_.on_message = [this](int id, WSOpcode opcode, const ByteView& message) {
+    auto it = open_.find(id);
+    if (it != open_.end()) it->second->Deliver(opcode, message);
+  };
+  ws_.on_drain = [this](int id) {
+    auto it = open_.find(id);
+    if (it != open_.end()) it->second->Drained();
+  };
+  ws_.on_close = [this](int id) {
+    auto it = open_.find(id);
+    if (it == open_.end()) return;
+    WSConnection* conn = it->second;
+    open_.erase(it);
+    conn->Closed();
+  };
+}
+
+WSCoServer::~WSCoServer() {
+  // Handlers that are still suspended are destroyed without being resumed;
+  // what their destructors do to the connection is not reported back.
+  ws_.on_open = nullptr;
+  ws_.on_message = nullptr;
+  ws_.on_drain = nullptr;
+  ws_.on_close = nullptr;
+  open_.clear();
+  for (WSConnection* conn : running_) {
+    conn->closed_ = true;
+    conn->task_.destroy();
+    delete conn;
+  }
+}
+
+void WSCoServer::Open(int id) {
+  WSConnection* conn = new WSConnection(this, id);
+  open_[id] = conn;
+  running_.insert(conn);
+  conn->task_ = handler_(*conn).Release([this, conn] { Finished(conn); });
+  conn->task_.resume();  // May return with conn gone.
+}
+
+// Called once the handler of conn has returned.
+void WSCoServer::Finished(WSConnection* conn) {
+  running_.erase(conn);
+  conn->close();
+  delete conn;
+}
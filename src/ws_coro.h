@@ -0,0 +1,245 @@
+// Coroutine connection handlers over a WSServer, part of libws.
+//
+// Instead of reacting to on_message callbacks, a WSCoServer starts one
+// coroutine per connection that reads its messages in order:
+//
+//   WSTask Echo(WSConnection& conn) {
+//     while (std::optional<WSMessage> message = co_await conn.read_message())
+//       co_await conn.send(message->data, message->opcode);
+//   }
+//
+// read_message() yields nothing once the connection is closed, and the
+// handler should then return; when a handler returns first, its connection
+// is closed. send() never blocks the loop: it queues what the socket does
+// not take and only suspends the handler while more than
+// WS_CORO_SEND_WATERMARK bytes wait, until they have all been written.
+//
+// Handlers run on the loop's thread, resumed from its callbacks, so nothing
+// is shared with other threads and a loop per core scales as before.
+// Coroutine frames come from a pool per thread, so a handler's frame is
+// recycled rather than allocated once one of its size has been freed on
+// that thread. The rest of a connection is not pooled: opening one still
+// allocates its WSConnection and the server's bookkeeping for it.
+
+#ifndef WEBSOCKET_SRC_WS_CORO_H_
+#define WEBSOCKET_SRC_WS_CORO_H_
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "core.h"
+#include "event_loop.h"
+#include "ws.h"
+
+// A handler that sends is suspended while more than this much output waits
+// for its connection.
+#define WS_CORO_SEND_WATERMARK (256 << 10)
+
+// --- Coroutine frame pool ---
+// Frames are recycled per thread in size classes; a frame must be freed on
+// the thread that allocated it.
+void* AllocateCoroutineFrame(size_t size);
+void FreeCoroutineFrame(void* frame, size_t size);
+
+// --- A connection handler ---
+// Returned by handler coroutines. The coroutine does not start until it is
+// released and resumed, and its frame is freed as soon as it returns.
+class WSTask {
+ public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    void await_suspend(Handle handle) noexcept {
+      std::function<void()> done = std::move(handle.promise().done);
+      handle.destroy();
+      if (done) done();
+    }
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type {
+    WSTask get_return_object() { return WSTask(Handle::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    static void* operator new(size_t size) {
+      return AllocateCoroutineFrame(size);
+    }
+    static void operator delete(void* frame, size_t size) {
+      FreeCoroutineFrame(frame, size);
+    }
+
+    // Called once the coroutine has returned and its frame is gone.
+    std::function<void()> done;
+  };
+
+  WSTask(WSTask&& other) noexcept : handle_(other.handle_) {
+    other.handle_ = nullptr;
+  }
+  WSTask& operator=(WSTask&& other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  ~WSTask() {
+    if (handle_) handle_.destroy();
+  }
+
+  // Gives up the coroutine, to be run by the caller; done is called once it
+  // returns.
+  Handle Release(std::function<void()> done) {
+    Handle handle = handle_;
+    handle_ = nullptr;
+    handle.promise().done = std::move(done);
+    return handle;
+  }
+
+ private:
+  explicit WSTask(Handle handle) : handle_(handle) {}
+
+  Handle handle_;
+};
+
+// --- A message read by a handler ---
+struct WSMessage {
+  WSOpcode opcode = WSOpcode::TEXT;
+  // Valid until the handler next awaits its connection.
+  ByteView data = {nullptr, 0};
+};
+
+class WSCoServer;
+
+// --- One connection, as seen by its handler ---
+class WSConnection {
+ public:
+  class [[nodiscard]] ReadAwaiter {
+   public:
+    bool await_ready() { return conn_->TakePending() || conn_->closed_; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      conn_->reader_ = handle;
+    }
+    std::optional<WSMessage> await_resume() {
+      if (!conn_->has_message_) return std::nullopt;
+      conn_->has_message_ = false;
+      return conn_->message_;
+    }
+
+   private:
+    friend class WSConnection;
+    explicit ReadAwaiter(WSConnection* conn) : conn_(conn) {}
+    WSConnection* conn_;
+  };
+
+  class [[nodiscard]] SendAwaiter {
+   public:
+    bool await_ready() { return conn_->closed_ || !conn_->Backlogged(); }
+    void await_suspend(std::coroutine_handle<> handle) {
+      conn_->sender_ = handle;
+    }
+    // Returns false if the connection is closed.
+    bool await_resume() { return !conn_->closed_; }
+
+   private:
+    friend class WSConnection;
+    explicit SendAwaiter(WSConnection* conn) : conn_(conn) {}
+    WSConnection* conn_;
+  };
+
+  WSConnection(const WSConnection&) = delete;
+  WSConnection& operator=(const WSConnection&) = delete;
+
+  // The connection's socket, as the WSServer knows it.
+  int id() const { return id_; }
+  bool closed() const { return closed_; }
+
+  // Waits for the next message; yields nothing once the connection is
+  // closed. Messages that arrive while the handler is busy are kept.
+  ReadAwaiter read_message() { return ReadAwaiter(this); }
+
+  // Sends message as one frame of the given opcode, or frame as it is,
+  // waiting only if the connection is backlogged.
+  SendAwaiter send(const ByteView& message,
+                   WSOpcode opcode = WSOpcode::TEXT);
+  SendAwaiter send(const std::string& message,
+                   WSOpcode opcode = WSOpcode::TEXT);
+  SendAwaiter send_frame(const ByteView& frame);
+
+  // Closes the connection; the handler's reads yield nothing from now on.
+  void close();
+
+ private:
+  friend class WSCoServer;
+
+  WSConnection(WSCoServer* server, int id) : server_(server), id_(id) {}
+
+  // Makes the oldest kept message the current one. Returns false if there
+  // is none.
+  bool TakePending();
+  bool Backlogged() const;
+  // Called by the server as messages arrive, output drains and the
+  // connection closes.
+  void Deliver(WSOpcode opcode, const ByteView& message);
+  void Drained();
+  void Closed();
+
+  WSCoServer* server_;
+  int id_;
+  bool closed_ = false;
+  // The handler, until it returns.
+  WSTask::Handle task_;
+  // The suspended handler, waiting for a message or for output to drain.
+  std::coroutine_handle<> reader_;
+  std::coroutine_handle<> sender_;
+  // The message the handler is given, and the copies of messages that
+  // arrived while it was not reading. current_ holds the data of a copy
+  // once it is handed over; messages read on arrival are not copied.
+  bool has_message_ = false;
+  WSMessage message_;
+  std::deque<std::pair<WSOpcode, std::string>> pending_;
+  std::string current_;
+};
+
+// --- Server running a handler coroutine per connection ---
+class WSCoServer {
+ public:
+  typedef std::function<WSTask(WSConnection& conn)> Handler;
+
+  WSCoServer(EventLoop* loop, Handler handler);
+  ~WSCoServer();
+  WSCoServer(const WSCoServer&) = delete;
+  WSCoServer& operator=(const WSCoServer&) = delete;
+
+  // Listens on port on all interfaces. Returns false with errno set.
+  bool Listen(int port) { return ws_.Listen(port); }
+
+  // The underlying server, e.g. to send to other connections or broadcast.
+  // Its callbacks belong to the WSCoServer.
+  WSServer& server() { return ws_; }
+
+ private:
+  friend class WSConnection;
+
+  void Open(int id);
+  void Finished(WSConnection* conn);
+
+  WSServer ws_;
+  Handler handler_;
+  // Connections by socket while they are open.
+  std::unordered_map<int, WSConnection*> open_;
+  // Every connection whose handler has not returned yet; the handlers that
+  // are left are destroyed with the server.
+  std::unordered_set<WSConnection*> running_;
+};
+
+#endif  // WEBSOCKET_SRC_WS_CORO_H_
@@ -0,0 +1,162 @@
+// Checks the line diff of the file monitor.
+//
+// For pairs of file versions, computes the edits with DiffLines, encodes
+// them with EncodeLinePatch and applies the patch with ApplyLinePatch, the
+// way the page does; the result must be the new version. The pairs cover
+// empty versions, versions that only gain or only lose lines, changes at
+// either end, and random edits of random files.
+//
+// Usage: line_diff_test
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "line_diff.h"
+
+// Budget large enough that no pair here falls back to a snapshot.
+#define MAX_EDITS 1000000
+#define MAX_WORK 1000000000
+#define RANDOM_PAIRS 2000
+
+static int Failures = 0;
+
+// Escapes newlines, so a version prints on one line.
+static std::string Show(const std::string& text) {
+  std::string shown;
+  for (char c : text) {
+    if (c == '\n')
+      shown += "\\n";
+    else
+      shown.push_back(c);
+  }
+  return "\"" + shown + "\"";
+}
+
+// Diffs old_text against new_text and checks that the patch rebuilds
+// new_text from old_text.
+static void CheckPair(const std::string& old_text,
+                      const std::string& new_text) {
+  LineTable old_table, new_table;
+  BuildLineTable(old_text.data(), old_text.size(), &old_table);
+  BuildLineTable(new_text.data(), new_text.size(), &new_table);
+  std::vector<LineEdit> edits;
+  std::string patched;
+  if (!DiffLines(old_table.hashes, new_table.hashes, MAX_EDITS, MAX_WORK,
+                 &edits)) {
+    fprintf(stderr, "DiffLines gave up: %s -> %s\n", Show(old_text).c_str(),
+            Show(new_text).c_str());
+  } else if (!ApplyLinePatch(
+                 EncodeLinePatch(1, 2, edits, new_table, new_text.data()),
+                 old_text, &patched)) {
+    fprintf(stderr, "patch does not fit: %s -> %s\n", Show(old_text).c_str(),
+            Show(new_text).c_str());
+  } else if (patched != new_text) {
+    fprintf(stderr, "patched %s into %s instead of %s\n",
+            Show(old_text).c_str(), Show(patched).c_str(),
+            Show(new_text).c_str());
+  } else {
+    return;
+  }
+  Failures++;
+}
+
+// Checks the pair both ways.
+static void CheckBothWays(const std::string& a, const std::string& b) {
+  CheckPair(a, b);
+  CheckPair(b, a);
+}
+
+// A file of up to max_lines lines drawn from a few short ones, so versions
+// share lines and the diff has matches to find.
+static std::string RandomFile(std::mt19937* random, int max_lines) {
+  static const char* const kLines[] = {"", "a", "b", "c", "dd", "eee"};
+  int lines = (*random)() % (max_lines + 1);
+  std::string text;
+  for (int i = 0; i < lines; i++) {
+    if (i > 0) text.push_back('\n');
+    text += kLines[(*random)() % 6];
+  }
+  // Half the files end with a newline.
+  if ((*random)() % 2) text.push_back('\n');
+  return text;
+}
+
+// Inserts, deletes and replaces a few random lines of text.
+static std::string Mutate(std::mt19937* random, const std::string& text) {
+  LineTable table;
+  BuildLineOffsets(text.data(), text.size(), &table);
+  std::vector<std::string> lines;
+  for (size_t i = 0; i < table.LineCount(); i++)
+    lines.push_back(text.substr(table.offsets[i],
+                                table.offsets[i + 1] - 1 - table.offsets[i]));
+  int changes = 1 + (*random)() % 4;
+  for (int i = 0; i < changes; i++) {
+    size_t at = (*random)() % (lines.size() + 1);
+    switch ((*random)() % 3) {
+      case 0:
+        lines.insert(lines.begin() + at, std::to_string((*random)() % 4));
+        break;
+      case 1:
+        if (at < lines.size()) lines.erase(lines.begin() + at);
+        break;
+      default:
+        if (at < lines.size()) lines[at] = "x";
+    }
+  }
+  std::string mutated;
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (i > 0) mutated.push_back('\n');
+    mutated += lines[i];
+  }
+  return mutated;
+}
+
+int main() {
+  // Empty versions, and versions that are all insert or all delete.
+  CheckPair("", "");
+  CheckBothWays("", "\n");
+  CheckBothWays("", "one");
+  CheckBothWays("", "one\ntwo\nthree\n");
+  CheckBothWays("\n", "one\ntwo\n");
+  CheckBothWays("\n\n\n", "");
+
+  // Nothing in common.
+  CheckBothWays("a\nb\nc", "x\ny");
+  CheckBothWays("a\nb\nc\n", "x\ny\nz\nw\n");
+
+  // Changes at the ends, in the middle, and of the final newline.
+  CheckBothWays("a\nb\nc\n", "a\nb\nc\nd\n");
+  CheckBothWays("a\nb\nc\n", "z\na\nb\nc\n");
+  CheckBothWays("a\nb\nc\n", "a\nx\nc\n");
+  CheckBothWays("a\nb\nc\n", "a\nb\nc");
+  CheckBothWays("a\nb\nc", "a\nb\nc\n\n");
+  CheckBothWays("a\nb\na\nb\na\n", "b\na\nb\na\nb\n");
+
+  // Random edits of random files, reproducible from the seed.
+  std::mt19937 random(12345);
+  for (int i = 0; i < RANDOM_PAIRS; i++) {
+    std::string old_text = RandomFile(&random, 40);
+    std::string new_text = i % 4 == 0 ? RandomFile(&random, 40)
+                                      : Mutate(&random, old_text);
+    CheckPair(old_text, new_text);
+  }
+
+  // Past the edit budget the diff gives up rather than send a huge patch.
+  LineTable old_table, new_table;
+  BuildLineTable("a\nb\nc\nd", 7, &old_table);
+  BuildLineTable("w\nx\ny\nz", 7, &new_table);
+  std::vector<LineEdit> edits;
+  if (DiffLines(old_table.hashes, new_table.hashes, 4, MAX_WORK, &edits)) {
+    fprintf(stderr, "DiffLines ignored its edit budget\n");
+    Failures++;
+  }
+
+  if (Failures > 0) {
+    printf("line_diff_test: FAILED (%d)\n", Failures);
+    return 1;
+  }
+  printf("line_diff_test: all patches rebuild the new version\n");
+  return 0;
+}
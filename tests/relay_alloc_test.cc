@@ -0,0 +1,167 @@
+// Checks that the chat server relays messages without heap allocation.
+//
+// Starts the server with alloc_counter.so preloaded and logs three clients
+// in: alice, and bob and carol, who join #dev. They then exchange rounds of
+// lobby, topic and direct messages, in both the session and the legacy
+// kinds. The first rounds let the server's buffers grow to their working
+// size; after that, relaying must not allocate at all.
+//
+// Usage: relay_alloc_test <websocket_server> <alloc_counter.so>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "chat_protocol.h"
+#include "event_loop.h"
+#include "ws.h"
+
+// Rounds relayed before counting, and while counting.
+#define WARMUP_ROUNDS 200
+#define COUNTED_ROUNDS 2000
+// Messages one round delivers to the clients.
+#define RECEIVED_PER_ROUND 8
+// How long to wait for the server before giving up.
+#define TIMEOUT_MS 5000
+
+static EventLoop Loop;
+static int Received = 0;
+static int Target = 0;
+
+// Runs the loop until target messages have been received in total.
+static bool ReceiveUntil(int target) {
+  Target = target;
+  if (Received < Target) {
+    EventLoop::TimerId timer = Loop.RunAfter(TIMEOUT_MS, [] { Loop.Stop(); });
+    Loop.Run();
+    Loop.Cancel(timer);
+  }
+  if (Received >= Target) return true;
+  fprintf(stderr, "received %d of %d messages\n", Received, Target);
+  return false;
+}
+
+// Asks the server for its allocation count and reads the reply from its
+// stderr. Returns -1 on failure.
+static long ServerAllocations(pid_t server, int server_stderr) {
+  kill(server, SIGUSR1);
+  std::string line;
+  char c;
+  while (line.empty() || line.back() != '\n') {
+    struct pollfd pfd = {server_stderr, POLLIN, 0};
+    if (poll(&pfd, 1, TIMEOUT_MS) <= 0 || read(server_stderr, &c, 1) != 1)
+      return -1;
+    line.push_back(c);
+  }
+  long count;
+  if (sscanf(line.c_str(), "ALLOCATIONS %ld", &count) != 1) return -1;
+  return count;
+}
+
+static pid_t StartServer(const char* binary, const char* counter,
+                         int* server_stderr) {
+  int fds[2];
+  if (pipe(fds) != 0) return -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDERR_FILENO);
+    freopen("/dev/null", "r", stdin);
+    freopen("/dev/null", "w", stdout);
+    close(fds[0]);
+    close(fds[1]);
+    setenv("LD_PRELOAD", counter, 1);
+    execl(binary, binary, static_cast<char*>(nullptr));
+    _exit(127);
+  }
+  close(fds[1]);
+  *server_stderr = fds[0];
+  return pid;
+}
+
+static bool Connect(WSClient* client) {
+  for (int attempt = 0; attempt < 50; attempt++) {
+    if (client->Connect("127.0.0.1", 8080, "/chat")) return true;
+    usleep(100 * 1000);
+  }
+  fprintf(stderr, "connect: %s\n", client->error().c_str());
+  return false;
+}
+
+static bool Run(pid_t server, int server_stderr) {
+  WSClient alice(&Loop), bob(&Loop), carol(&Loop);
+  WSClient* clients[] = {&alice, &bob, &carol};
+  for (WSClient* client : clients) {
+    if (!Connect(client)) return false;
+    client->on_message = [](WSOpcode, const ByteView&) {
+      if (++Received >= Target) Loop.Stop();
+    };
+    client->on_close = [] {
+      fprintf(stderr, "the server closed a connection\n");
+      Loop.Stop();
+    };
+  }
+  alice.Send(EncodeChatPayload(ChatKind::LOGIN, "alice", ""));
+  bob.Send(EncodeChatPayload(ChatKind::LOGIN, "bob", ""));
+  carol.Send(EncodeChatPayload(ChatKind::LOGIN, "carol", ""));
+  // Three join notices and alice's note to herself show that every LOGIN
+  // has been handled.
+  carol.Send(EncodeChatPayload(ChatKind::JOIN, "carol", "dev"));
+  bob.Send(EncodeChatPayload(ChatKind::JOIN, "bob", "dev"));
+  alice.Send(EncodeSessionPayload(ChatKind::SESSION_DIRECT, "alice", "hi"));
+  if (!ReceiveUntil(4)) return false;
+
+  const std::string lobby =
+      EncodeSessionPayload(ChatKind::SESSION_MESSAGE, "", "hello lobby");
+  const std::string topic =
+      EncodeSessionPayload(ChatKind::SESSION_MESSAGE, "dev", "hello dev");
+  const std::string direct =
+      EncodeSessionPayload(ChatKind::SESSION_DIRECT, "carol", "hi carol");
+  const std::string legacy_lobby =
+      EncodeChatPayload(ChatKind::MESSAGE, "bob", "", "hello from bob");
+  const std::string legacy_direct =
+      EncodeChatPayload(ChatKind::DIRECT, "bob", "alice", "hi alice");
+  long before = -1;
+  for (int round = 0; round < WARMUP_ROUNDS + COUNTED_ROUNDS; round++) {
+    if (round == WARMUP_ROUNDS) {
+      before = ServerAllocations(server, server_stderr);
+      if (before < 0) return false;
+    }
+    alice.Send(lobby);
+    alice.Send(topic);
+    alice.Send(direct);
+    bob.Send(legacy_lobby);
+    bob.Send(legacy_direct);
+    if (!ReceiveUntil(Received + RECEIVED_PER_ROUND)) return false;
+  }
+  long after = ServerAllocations(server, server_stderr);
+  if (after < 0) return false;
+  printf("relay_alloc_test: %d messages relayed with %ld allocations\n",
+         COUNTED_ROUNDS * RECEIVED_PER_ROUND, after - before);
+  for (WSClient* client : clients) client->on_close = nullptr;
+  return after == before;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <websocket_server> <alloc_counter.so>\n",
+            argv[0]);
+    return 2;
+  }
+  int server_stderr;
+  pid_t server = StartServer(argv[1], argv[2], &server_stderr);
+  if (server < 0) {
+    perror("fork");
+    return 2;
+  }
+  bool ok = Run(server, server_stderr);
+  kill(server, SIGTERM);
+  waitpid(server, nullptr, 0);
+  if (!ok) printf("relay_alloc_test: FAILED\n");
+  return ok ? 0 : 1;
+}